@@ -161,15 +161,21 @@ end
 
 -- crappy event loop thing
 
--- list of coroutines waiting to be resumed
--- contains objects with properties:
+-- coroutines waiting to be resumed
+-- this is a min-heap in C (src/lua/timeouts.c) ordered by (target, gen)
+-- each entry has:
 --   co: the coroutine
 --   target: timestamp of when it should be resumed
 --   gen: value of ev_generation_counter when it was added
-local ev_timeouts = make_resetable_table()
+--   delay: the ms value given to wait()
+--   ticket: ev_co_ticket(co) when it was added
+local ev_timeouts = _timeout_queue_new()
+add_reset_callback(function ()
+	ev_timeouts:clear()
+end)
 
 -- counter for ev_do_timeouts() to know if a timeout was added during the same event loop iteration (-> should not resume it)
--- timeouts added to the ev_timeouts table have a "gen" property set to whatever this was when the timeout was added
+-- timeouts added to ev_timeouts have a "gen" property set to whatever this was when the timeout was added
 local ev_generation_counter = 1
 add_reset_callback(function ()
 	-- note: all timeouts (= references to past values) are removed on reset so this is safe to reset too
@@ -180,8 +186,9 @@ end)
 -- callbacks here are called when the coroutine makes an error
 ev_error_handlers = setmetatable({}, {__mode = 'k'}) -- local
 
--- coroutine -> function(the_coroutine, this_function)
+-- coroutine -> function(the_coroutine, this_function, done)
 -- callbacks here are called once when the coroutine yields/returns/errors, then removed from the table
+-- done is true if the coroutine has finished (returned or erred) after having yielded
 -- the callback can re-add itself during the call if it wants to be called next time
 -- (this is badly named)
 local ev_return_handlers = setmetatable({}, {__mode = 'k'})
@@ -191,12 +198,14 @@ local ev_return_handlers = setmetatable({}, {__mode = 'k'})
 local ev_co_to_fn = setmetatable({}, {__mode = 'kv'})
 
 -- unique values for yielding
-local sym_ready = {} -- ev_loop_co is ready to be reused
+local sym_ready = {} -- the function returned, the coroutine is ready to be reused
 local sym_wait = {} -- coroutine used wait() and put itself in the list
 
 -- ev_loop_co: used for calling functions in a coroutine context without
 --  creating a new coroutine each time for that
--- if the function yields, ev_loop_co gets replaced with a new coroutine
+-- if the function yields, the coroutine is left to it and ev_loop_co is
+--  replaced with one from ev_pool. when the function is done, the coroutine
+--  goes back in the pool
 local ev_loop_co
 local ev_loop_fn
 
@@ -211,15 +220,8 @@ do
 			ev_co_to_fn[this_co] = fn
 			fn(select(2, table.unpack(args)))
 
-			-- the thing we called used yield so we're not the main
-			--  coroutine anymore
-			if ev_loop_co ~= this_co then
-				break
-			end
-
 			-- clear state, pretend this is a new coroutine
 			ev_error_handlers[this_co] = nil
-			ev_return_handlers[this_co] = nil
 
 			args = {coroutine.yield(sym_ready)}
 		end
@@ -233,18 +235,151 @@ do
 		return xpcall(ev_loop_fn_main, ev_loop_fn_catch, ...)
 	end
 end
-ev_loop_co = coroutine.create(ev_loop_fn)
 
-local ev_handle_return = function (co, ok, rv1, rv2)
+-- idle coroutines for ev_loop_co, waiting at yield(sym_ready) (or not started)
+-- it keeps as many as were in use at the same time at most (the high-water
+--  mark), within EV_POOL_MIN and EV_POOL_MAX
+local EV_POOL_MIN = 4
+local EV_POOL_MAX = 64
+local ev_pool = {}
+local ev_in_flight = setmetatable({}, {__mode = 'k'}) -- coroutine -> true while it's yielded
+local ev_pool_stats = {}
+
+local ev_pool_fill = function ()
+	while #ev_pool < EV_POOL_MIN do
+		local co = coroutine.create(ev_loop_fn)
+		table.insert(ev_pool, co)
+		ev_pool_stats.created = ev_pool_stats.created+1
+	end
+end
+
+local ev_pool_reset = function ()
+	for i, co in ipairs(ev_pool) do
+		coroutine.close(co)
+		ev_pool[i] = nil
+	end
+	ev_pool_stats = {
+		created = 0, -- coroutine.create()
+		reused = 0, -- taken from the pool
+		returned = 0, -- put back after use
+		dropped = 0, -- closed because the pool was full
+		in_flight = 0, -- yielded and not done yet
+		high_water = 0, -- most in_flight at the same time
+	}
+	ev_pool_fill()
+end
+ev_pool_reset()
+add_reset_callback(function ()
+	-- coroutines that were waiting for something are gone now
+	for co in pairs(ev_in_flight) do
+		ev_in_flight[co] = nil
+	end
+	ev_pool_reset()
+end)
+
+local ev_co_take = function ()
+	local n = #ev_pool
+	if n > 0 then
+		local co = ev_pool[n]
+		ev_pool[n] = nil
+		ev_pool_stats.reused = ev_pool_stats.reused+1
+		return co
+	end
+	ev_pool_stats.created = ev_pool_stats.created+1
+	return coroutine.create(ev_loop_fn)
+end
+
+local ev_co_give = function (co)
+	local limit = math.max(EV_POOL_MIN, math.min(EV_POOL_MAX, ev_pool_stats.high_water))
+	if #ev_pool < limit then
+		table.insert(ev_pool, co)
+		ev_pool_stats.returned = ev_pool_stats.returned+1
+	else
+		coroutine.close(co)
+		ev_pool_stats.dropped = ev_pool_stats.dropped+1
+	end
+end
+
+-- a coroutine from the pool runs one function after another, so anything that
+--  keeps one around to resume it later keeps its ticket with it too.
+--  ev_resume() won't resume it if the ticket has changed since: the function
+--  it was for is done and the coroutine may be running something else now
+local ev_co_uses = setmetatable({}, {__mode = 'k'}) -- coroutine -> functions it's finished
+
+local ev_co_ticket = function (co)
+	return ev_co_uses[co] or 0
+end
+
+local ev_co_retire = function (co)
+	ev_co_uses[co] = (ev_co_uses[co] or 0)+1
+end
+
+local ev_co_landed = function (co)
+	if ev_in_flight[co] then
+		ev_in_flight[co] = nil
+		ev_pool_stats.in_flight = math.max(0, ev_pool_stats.in_flight-1)
+	end
+end
+
+-- the counters above, and size: how many are in the pool now
+coroutine_pool_stats = function ()
+	local t = {size = #ev_pool}
+	for k, v in pairs(ev_pool_stats) do
+		t[k] = v
+	end
+	return t
+end
+
+ev_loop_co = ev_co_take()
+
+-- coroutine -> lane (see with_lane()) it was writing to when it yielded
+-- a function started with ev_call() writes to the same lane as its caller,
+--  and output after a resume goes back to the lane it had before
+local ev_co_lanes = setmetatable({}, {__mode = 'k'})
+
+-- lane: what the one that resumed co had
+local ev_handle_return = function (co, lane, ok, rv1, rv2)
+	local co_lane = _get_lane()
+	if co_lane ~= lane then
+		_set_lane(lane)
+	end
 	if ok then
-		-- user coroutine yielded/erred?
-		if co == ev_loop_co and rv1 ~= sym_ready then
-			ev_loop_co = coroutine.create(ev_loop_fn)
+		local done = false
+
+		if rv1 ~= sym_ready and coroutine.status(co) == 'suspended' then
+			ev_co_lanes[co] = co_lane
+		end
+
+		if co == ev_loop_co then
+			if rv1 == sym_ready then
+				-- returned without yielding, keep using it
+				ev_return_handlers[co] = nil
+				ev_co_retire(co)
+			else
+				-- user coroutine yielded/erred
+				ev_loop_co = ev_co_take()
+				if coroutine.status(co) == 'suspended' then
+					ev_in_flight[co] = true
+					local n = ev_pool_stats.in_flight+1
+					ev_pool_stats.in_flight = n
+					if n > ev_pool_stats.high_water then
+						ev_pool_stats.high_water = n
+					end
+				end
+			end
+		elseif rv1 == sym_ready then
+			-- one that had yielded (or called ev_call()) is done now
+			done = true
+			ev_co_retire(co)
+			ev_co_landed(co)
 		end
 
 		-- pcall threw up and the coroutine died?
 		if rv1 == false and coroutine.status(co) == 'dead' then
 			-- note: rv2 is the return value from ev_loop_fn_catch()
+			done = true
+			ev_co_retire(co)
+			ev_co_landed(co)
 
 			-- someone wants to know about this error?
 			local handler = ev_error_handlers[co]
@@ -265,7 +400,11 @@ local ev_handle_return = function (co, ok, rv1, rv2)
 		local cb = ev_return_handlers[co]
 		if cb then
 			ev_return_handlers[co] = nil
-			return ev_call(cb, co, cb)
+			ev_call(cb, co, cb, done)
+		end
+
+		if done and coroutine.status(co) == 'suspended' then
+			ev_co_give(co)
 		end
 	else
 		-- some kind of a programmer error. ev_loop_fn uses pcall so we
@@ -277,12 +416,22 @@ end
 
 ev_call = function (fn, ...) -- note: this is declared as local above
 	if coroutine.running() == ev_loop_co then
-		ev_loop_co = coroutine.create(ev_loop_fn)
+		ev_loop_co = ev_co_take()
 	end
-	return ev_handle_return(ev_loop_co, coroutine.resume(ev_loop_co, fn, ...))
+	return ev_handle_return(ev_loop_co, _get_lane(), coroutine.resume(ev_loop_co, fn, ...))
 end
-local ev_resume = function (co, ...)
-	return ev_handle_return(co, coroutine.resume(co, ...))
+-- ticket: ev_co_ticket(co) from when it yielded
+local ev_resume = function (co, ticket, ...)
+	-- it's been recycled, this would resume something random
+	if ticket ~= ev_co_ticket(co) then
+		return error('cannot resume a coroutine that has finished', 2)
+	end
+	local lane = _get_lane()
+	local co_lane = ev_co_lanes[co]
+	if co_lane and co_lane ~= lane then
+		_set_lane(co_lane)
+	end
+	return ev_handle_return(co, lane, coroutine.resume(co, ...))
 end
 
 -- find the "file and line defined" for a coroutine/function (for debugging)
@@ -314,37 +463,38 @@ wait = function (ms, canceldata)
 	local this_co, is_main = coroutine.running()
 	assert(not is_main, 'tried to wait() outside a coroutine')
 
-	-- click_id is the "id" of the click. it's either userdata for
-	--  pthread_t, or true if the click didn't spawn a thread ("ms" was 0
-	--  and do_click() was called directly)
+	-- click_id is the "id" of the click. it's either userdata for the
+	--  click thread's timer id, or true if the click wasn't scheduled ("ms"
+	--  was 0 and do_click() was called directly)
+
+	local ticket = ev_co_ticket(this_co)
 
 	if type(canceldata) == 'table' then
 		assert(nil == next(canceldata), 'wait: canceldata is not empty')
 		canceldata.co = this_co
+		canceldata.ticket = ticket
 		canceldata.id = click_id
 		check_cancel = true
 	end
 
-	table.insert(ev_timeouts, {
-		gen    = ev_generation_counter,
-		target = target,
-		co     = this_co,
-
-		-- for informative purposes
-		delay = ms,
-	})
+	local handle = ev_timeouts:insert(target, ev_generation_counter, this_co, ms, ticket)
+	if check_cancel then
+		canceldata.timeout = handle
+	end
 
 	coroutine.yield(sym_wait)
 
 	-- was it a cancellable wait?
 	if check_cancel then
 		local stored_id = canceldata.id
-		-- same type (userdata/pthread_t or true)
+		-- same type (userdata/timer id or true)
 		if type(stored_id) == type(click_id) then
 			if stored_id == click_id then
 				-- ok: wait was NOT cancelled
 				canceldata.co = nil
+				canceldata.ticket = nil
 				canceldata.id = nil
+				canceldata.timeout = nil
 				return true
 			else
 				-- error: reused the table for a different wait. don't do this
@@ -364,7 +514,9 @@ end
 
 _list_timeouts = function ()
 	local now = _ms()
-	for i, t in ipairs(ev_timeouts) do
+	local ts = ev_timeouts:list()
+	table.sort(ts, function (a, b) return a.target < b.target end)
+	for i, t in ipairs(ts) do
 		local status
 		if t.target > now then
 			status = string.format('+%dms',
@@ -379,18 +531,7 @@ _list_timeouts = function ()
 		    t.gen, math.floor(t.delay),
 		    status)
 	end
-	println('total %d', #ev_timeouts)
-end
-
-local ev_delete_timeout_for_co = function (co)
-	local ts = ev_timeouts
-	for i = 1, #ts do
-		if ts[i].co == co then
-			table.remove(ts, i)
-			return true
-		end
-	end
-	return false
+	println('total %d', #ts)
 end
 
 cancel_wait = function (canceldata)
@@ -398,9 +539,10 @@ cancel_wait = function (canceldata)
 		local id = canceldata.id
 		if id == true or type(id) == 'userdata' then
 			-- ok: in these cases, the coroutine is still waiting to be resumed
-			-- if id is userdata, then there's a thread we might be able to cancel to save a useless click()
+			-- if id is userdata, then there's a timer we might be able to cancel to save a useless click()
 
 			local co = canceldata.co
+			local ticket = canceldata.ticket
 
 			if type(id) == 'userdata' then
 				-- cancel the thread to potentially avoid a useless click
@@ -408,12 +550,14 @@ cancel_wait = function (canceldata)
 			end
 
 			-- remove the coroutine from the timeouts list
-			assert(ev_delete_timeout_for_co(co))
+			assert(ev_timeouts:cancel(canceldata.timeout) == co)
 
 			-- clear canceldata and resume the coroutine
 			canceldata.co = nil
+			canceldata.ticket = nil
 			canceldata.id = nil
-			ev_resume(co)
+			canceldata.timeout = nil
+			ev_resume(co, ticket)
 
 			return
 		elseif id == nil then
@@ -433,28 +577,31 @@ local ev_do_timeouts = function ()
 	ev_generation_counter = cur_gen+1
 
 	-- do all timeouts that are both
-	-- * expired (now >= t.target)
-	-- * added before this call to ev_do_timeouts() (t.gen <= cur_gen)
-	-- note: the loop is restarted after each timeout because they can also
-	--  modify the list (adding and removing entries from any position)
+	-- * expired (now >= target)
+	-- * added before this call to ev_do_timeouts() (gen <= cur_gen)
+	-- note: the queue is checked again after each timeout because they can
+	--  also modify it (adding and cancelling entries)
 	-- the generation counter exists so this can be done without ending up
 	--  in an infinite loop calling new timeouts that are already expired
-::again::
-	local now = _ms()
-	for i, t in ipairs(ev_timeouts) do
-		if now >= t.target and t.gen <= cur_gen then
-			table.remove(ev_timeouts, i)
-
-			-- warn if it gets badly delayed for whatever reason
-			local delay = now-t.target
-			local three_frames = 1000/120*3
-			if delay > three_frames then
-				eprintln('warning: wait(%d) at %s was delayed by %.2f ms!',
-				    math.floor(t.delay), ev_find_origin(t.co), delay)
-			end
+	while true do
+		local now = _ms()
+		local co, target, ms, ticket = ev_timeouts:pop(now, cur_gen)
+		if not co then
+			break
+		end
+
+		-- warn if it gets badly delayed for whatever reason
+		local delay = now-target
+		local three_frames = 1000/120*3
+		if delay > three_frames then
+			eprintln('warning: wait(%d) at %s was delayed by %.2f ms!',
+			    math.floor(ms), ev_find_origin(co), delay)
+		end
 
-			ev_resume(t.co)
-			goto again
+		-- a stale one is left behind if something else resumed it
+		--  during the wait() and the coroutine has moved on
+		if ticket == ev_co_ticket(co) then
+			ev_resume(co, ticket)
 		end
 	end
 end
@@ -465,18 +612,54 @@ spinoff = ev_call
 
 -- event stuff
 
+-- event name -> array of listeners, with [listener] = true for each too
+--  (or the coroutine's ticket if it's a coroutine)
+-- fire_event() goes through the array as it is, without copying it. while
+--  it's doing that, add_listener() and remove_listener() put a changed copy
+--  in events[name] instead of changing it
 local events = make_resetable_table()
+local events_busy = setmetatable({}, {__mode = 'k'}) -- array -> fire_event()s using it
+
+-- returns the array for name, copied first if fire_event() is using it
+local events_writable = function (name, t)
+	if events_busy[t] then
+		local copy = table.move(t, 1, #t, 1, {})
+		for _, cb in ipairs(t) do
+			copy[cb] = t[cb]
+		end
+		events[name] = copy
+		return copy
+	end
+	return t
+end
+
+local events_unbusy = function (t)
+	local n = events_busy[t]
+	events_busy[t] = (n > 1) and n-1 or nil
+end
+
+-- tells cfgfs_read() whether it can handle this key's binds without lua
+-- (defined later near bind())
+local update_fast_bind
 
 add_listener = function (name, cb)
 	if type(name) == 'string' then
+		local v = (type(cb) == 'thread') and ev_co_ticket(cb) or true
 		local t = events[name]
 		if t then
-			if not t[cb] then
+			local old = t[cb]
+			if not old then
+				t = events_writable(name, t)
 				table.insert(t, cb)
-				t[cb] = true
+				t[cb] = v
+			elseif old ~= v then
+				-- left behind by something the coroutine was doing before
+				t = events_writable(name, t)
+				t[cb] = v
 			end
 		else
-			events[name] = {[1] = cb, [cb] = true}
+			events[name] = {[1] = cb, [cb] = v}
+			update_fast_bind(name)
 		end
 	elseif type(name) == 'table' then
 		for _, name in ipairs(name) do
@@ -512,6 +695,7 @@ remove_listener = function (name, cb)
 		local t = events[name]
 		if t and t[cb] then
 			if #t > 1 then
+				t = events_writable(name, t)
 				for i = 1, #t do
 					if t[i] == cb then
 						table.remove(t, i)
@@ -521,8 +705,8 @@ remove_listener = function (name, cb)
 				end
 			else
 				assert(#t == 1)
-				t[cb] = nil
 				events[name] = nil
+				update_fast_bind(name)
 			end
 		end
 	elseif type(name) == 'table' then
@@ -539,13 +723,26 @@ local last_event_name = nil
 local in_event = false
 local canceldata = nil
 
+-- true if anything is listening for this event
+has_listeners = function (name)
+	return events[name] ~= nil
+end
+
 fire_event = function (name, ...)
 	local rv = 0
 	local t = events[name]
 	if t then
-		local copy = {table.unpack(t)}
-		for _, cb in ipairs(copy) do
-			if t[cb] then
+		events_busy[t] = (events_busy[t] or 0)+1
+		for i = 1, #t do
+			local cb = t[i]
+			-- skip the ones removed by an earlier listener
+			local cur = events[name]
+			local v = cur and cur[cb]
+			if v and type(cb) == 'thread' and v ~= ev_co_ticket(cb) then
+				-- left behind by a coroutine that was reused after
+				--  its function was done
+				remove_listener(name, cb)
+			elseif v then
 				last_event_name = name
 
 				local old_in_event = in_event
@@ -556,7 +753,14 @@ fire_event = function (name, ...)
 				if type(cb) == 'function' then
 					ev_call(cb, ...)
 				elseif type(cb) == 'thread' then
-					ev_resume(cb, ...)
+					-- raises if it can't be resumed (dead or running)
+					local ok, err = pcall(ev_resume, cb, v, ...)
+					if not ok then
+						in_event = old_in_event
+						canceldata = old_canceldata
+						events_unbusy(t)
+						return error(err, 0)
+					end
 				end
 				rv = rv+1
 
@@ -565,10 +769,12 @@ fire_event = function (name, ...)
 				canceldata = old_canceldata
 
 				if my_canceldata then
+					events_unbusy(t)
 					return -rv, my_canceldata
 				end
 			end
 		end
+		events_unbusy(t)
 	end
 	return rv
 end
@@ -586,10 +792,11 @@ wait_for_event = function (name, timeout_opt)
 	if not is_main then
 		local canceldata = {}
 		if timeout_opt then
+			local ticket = ev_co_ticket(this_co)
 			spinoff(function ()
 				if wait(timeout_opt, canceldata) then
 					last_event_name = nil
-					return ev_resume(this_co)
+					return ev_resume(this_co, ticket)
 				end
 			end)
 		end
@@ -615,8 +822,149 @@ end
 -- cfg/cmd magic tables
 
 cfg = assert(_cfg)
+-- cfg_lines{line, ...} is the same as calling cfg() for each one, only faster
+cfg_lines = assert(_cfg_lines)
 cfgf = function (fmt, ...) return cfg(string.format(fmt, ...)) end
 
+-- runs fn with cmd/cfg output going to the given lane ('urgent' or 'bulk')
+-- keybind handlers use 'urgent' by default, everything else 'bulk'
+-- the lane is kept per coroutine, so it's the same after wait() and
+--  wait_for_event(), and it doesn't leak to others while fn is waiting
+with_lane = function (lane, fn, ...)
+	local old = _set_lane(lane)
+	local rv = table.pack(pcall(fn, ...))
+	_set_lane(old)
+	if not rv[1] then
+		return error(rv[2], 0)
+	end
+	return table.unpack(rv, 2, rv.n)
+end
+
+-- lets repeated cvar/alias/bind sets replace each other if the game hasn't
+--  read them yet. off by default (and after a reload)
+-- coalesce_stats() tells how many lines it saved
+set_coalescing = function (enabled)
+	return _set_coalescing(enabled)
+end
+coalesce_stats = function ()
+	return _coalesce_stats()
+end
+add_reset_callback(function ()
+	_set_coalescing(false)
+end)
+
+-- limits how much stale output can pile up while the game isn't reading it
+-- (on linux nothing is read while the game window isn't active)
+--   max_age_ms: lines older than this are stale
+--   max_bytes: if there's more than this, all of it is stale
+--   echo: 'drop' or 'keep' stale echo lines (default 'drop')
+--   state: 'merge' (default) keeps only the last stale alias/bind of each name,
+--          or 'keep'
+--   other: 'drop' or 'keep' (default) other stale commands
+-- set_backlog_policy(nil) turns it off (also the default after a reload)
+-- backlog_stats() tells what was shed
+set_backlog_policy = function (t)
+	if t == nil then
+		return _set_backlog_policy(nil)
+	end
+	local check = function (k, a, b, default)
+		local v = t[k] or default
+		if v ~= a and v ~= b then
+			return error(string.format('set_backlog_policy: %s must be "%s" or "%s"', k, a, b), 3)
+		end
+		return v == a
+	end
+	return _set_backlog_policy(
+	    t.max_age_ms or 0,
+	    t.max_bytes or 0,
+	    check('echo', 'drop', 'keep', 'drop'),
+	    check('state', 'merge', 'keep', 'merge'),
+	    check('other', 'drop', 'keep', 'keep'))
+end
+backlog_stats = function ()
+	return _backlog_stats()
+end
+add_reset_callback(function ()
+	_set_backlog_policy(nil)
+end)
+
+-- how many bytes the game gets per read of a config (it's one frame per read)
+-- set_cfg_size(nil) goes back to the default
+-- set_cfg_size_adaptive(true, ceiling) grows it up to the ceiling while there's
+--  a backlog (only as long as that helps). the ceiling defaults to the max
+-- cfg_size_stats() has the limits and what adaptive mode did
+set_cfg_size = function (n)
+	return _set_cfg_size(n)
+end
+set_cfg_size_adaptive = function (enabled, ceiling)
+	return _set_cfg_size_adaptive(enabled, ceiling)
+end
+cfg_size_stats = function ()
+	return _cfg_size_stats()
+end
+add_reset_callback(function ()
+	_set_cfg_size_adaptive(false)
+	_set_cfg_size(nil)
+end)
+
+-- puts long lines that keep getting written in generated aliases (_c0 to
+--  _c63) and writes just the alias name after that. off by default (and after
+--  a reload)
+--   min_len: shorter lines are left alone (default 32)
+--   threshold: how many times a line is written before it gets an alias
+--              (default 3)
+-- lines with double quotes can't be put in an alias
+-- interning_stats() tells how much it saved
+set_interning = function (enabled, t)
+	t = t or {}
+	return _set_interning(enabled, t.min_len, t.threshold)
+end
+interning_stats = function ()
+	return _interning_stats()
+end
+add_reset_callback(function ()
+	_set_interning(false)
+end)
+
+-- who held the lua lock and for how long (ms), per locker name
+-- lock_stats()[name].wait and .hold have p50, p90, p99 and max, .blocked_by
+--  has who was holding it when this one had to wait
+-- `cfgfs_lock_stats' in the cli prints the same as a table
+-- set_lock_stats_file(path, interval_ms) rewrites that table to a file every
+--  interval_ms (default 5000), set_lock_stats_file(nil) stops it
+lock_stats = function ()
+	return _lock_stats()
+end
+set_lock_stats_file = function (path, interval_ms)
+	return _set_lock_stats_file(path, interval_ms)
+end
+add_reset_callback(function ()
+	_set_lock_stats_file(nil)
+end)
+
+-- garbage collection in a background thread, in slices of at most budget_ms
+--  (default 1) while nothing game-facing wants the lua lock
+-- mode is 'incremental' (default) or 'generational'
+--   budget_ms: how long one slice may hold the lock
+--   interval_ms: how often an idle step is done (default 250, 0: never)
+--   step_kb: how much allocation's worth of work an idle step does
+--            (default 16)
+-- gc_stats() has the pause times
+set_gc = function (mode, t)
+	t = t or {}
+	return _set_gc(mode, t.budget_ms, t.interval_ms, t.step_kb)
+end
+gc_stats = function ()
+	return _gc_stats()
+end
+-- how much memory lua is using, per size class for small objects
+mem_stats = function ()
+	return _mem_stats()
+end
+add_reset_callback(function ()
+	_set_gc(nil)
+end)
+
 -- note: these are separate tables so that assigning an existing value calls
 --  __newindex() too
 local cmd_fns = make_resetable_table()
@@ -626,9 +974,15 @@ local cmdp_fns = make_resetable_table()
 -- used by cfgfs_readdir()
 _defined_alias_names = make_resetable_table()
 
+-- cmd.batch{{'bind', 'f', '+x'}, {'alias', 'a', 'b'}, ...} is the same as
+--  calling cmd() for each one but it's done in one go
+local cmd_builtins = {
+	batch = assert(_cmd_batch),
+}
+
 cmd = setmetatable({--[[ empty ]]}, {
 	__index = function (self, k)
-		local fn = cmd_fns[k]
+		local fn = cmd_fns[k] or cmd_builtins[k]
 		if fn then
 			return fn
 		end
@@ -705,6 +1059,15 @@ cmdp = setmetatable({--[[ empty ]]}, {
 	end,
 })
 
+-- the values are matched by src/cvar_query.c as the game's output comes in,
+--  this gets them all at once when the echo at the end comes back
+_cvar_query_done = function (id, rv, incnt, outcnt)
+	return fire_event('_cvar_query.'..id, rv, incnt, outcnt)
+end
+add_reset_callback(function ()
+	_cvar_query_reset()
+end)
+
 local get_cvars = function (t)
 	if #t == 0 then
 		return {}
@@ -714,36 +1077,31 @@ local get_cvars = function (t)
 			wait_for_event('attention')
 		end
 	end
-	local rv = {}
-	local incnt, outcnt = 0, 0
+	local id, sentinel = _cvar_query_begin(t)
+	local cmds = {}
+	local seen = {}
 	for _, k in ipairs(t) do
-		if rv[k] == nil then
-			cmd.help(k)
-			rv[k] = false
-			outcnt = outcnt+1
-		end
-	end
-	for ev, line in wait_for_events({'game_console_output', 'game_console_output_jumbled'}, 1000) do
-		if ev == 'game_console_output_jumbled' then
-			local mk, mv = line:match('^"([^"]+)" = "(.*)"$')
-			if mk then
-				if rv[mk] == false then
-					rv[mk] = mv
-					incnt = incnt+1
-					fire_event('cvar.'..mk, mv)
-				end
-			end
-		elseif ev == 'game_console_output' then
-			local mk = line:match('^help:  no cvar or command named (.*)$')
-			if mk then
-				if rv[mk] == false then
-					rv[mk] = nil
-					incnt = incnt+1
-				end
-			end
+		if not seen[k] then
+			seen[k] = true
+			table.insert(cmds, {'help', k})
 		end
-		if incnt == outcnt then
-			break
+	end
+	table.insert(cmds, {'echo', sentinel})
+	local ok, err = pcall(cmd.batch, cmds)
+	if not ok then
+		_cvar_query_cancel(id)
+		return error(err, 2)
+	end
+	local ev, rv, incnt, outcnt = wait_for_event('_cvar_query.'..id, 1000)
+	if not ev then
+		rv, incnt, outcnt = _cvar_query_cancel(id)
+		if not rv then -- reset
+			return {}
+		end
+	end
+	for k, v in pairs(rv) do
+		if v then
+			fire_event('cvar.'..k, v)
 		end
 	end
 	if incnt ~= outcnt then
@@ -760,7 +1118,7 @@ cvar = setmetatable({--[[ empty ]]}, {
 	__newindex = function (_, k, v)
 		-- ignore nil i guess
 		if v ~= nil then
-			return cmd(k, v)
+			return _cvar_set(k, v)
 		end
 	end,
 	-- cvars list -> name/value map (gets the values)
@@ -801,6 +1159,28 @@ cvar = setmetatable({--[[ empty ]]}, {
 local binds_down = make_resetable_table()
 local binds_up = make_resetable_table()
 
+add_reset_callback(function ()
+	return _fast_bind_reset()
+end)
+
+-- name: key name or +/- event name for a key
+update_fast_bind = function (name)
+	local c = name:sub(1, 1)
+	if c == '+' or c == '-' then
+		name = name:sub(2)
+	end
+	local n = key2num[name]
+	if not n then
+		return
+	end
+	local vd, vu = binds_down[name], binds_up[name]
+	if events['+'..name] or events['-'..name] or
+	   type(vd) == 'function' or type(vu) == 'function' then
+		return _fast_bind_set(n, false)
+	end
+	return _fast_bind_set(n, true, vd, vu)
+end
+
 local click_key_bound = false
 
 bind = function (key, cmd, cmd2)
@@ -849,29 +1229,45 @@ bind = function (key, cmd, cmd2)
 
 	binds_down[key] = cmd
 	binds_up[key] = cmd2
+
+	update_fast_bind(key)
 end
 
 --------------------------------------------------------------------------------
 
+-- the state is kept in C so that cfgfs_read() can update it for binds it
+--  handles without lua
 is_pressed = setmetatable({}, {
 	__index = function (_, key)
-		return error(string.format('unknown key "%s"', key), 2)
+		local n = key2num[key]
+		if not n then
+			return error(string.format('unknown key "%s"', key), 2)
+		end
+		return _key_get_pressed(n)
+	end,
+	__newindex = function (_, key, v)
+		local n = key2num[key]
+		if not n then
+			return error(string.format('unknown key "%s"', key), 2)
+		end
+		return _key_set_pressed(n, v)
 	end,
 })
-for key in pairs(key2num) do
-	is_pressed[key] = false
-end
 
 _get_contents = function (path)
 	-- keybind?
 	local t = bindfilenames[path]
 	if t then
+		-- output from here skips ahead of any bulk output
+		-- (cfgfs_read() sets it back)
+		_set_lane('urgent')
 		local name = t.name
+		local num = t.num
 		if t.type == 'down' then
 
-			is_pressed[name] = _ms()
+			_key_set_pressed(num, _ms())
 
-			local evname = '+'..name
+			local evname = t.down_event
 			if events[evname] then
 				if fire_event(evname, true, name) < 0 then
 					return
@@ -891,9 +1287,9 @@ _get_contents = function (path)
 
 		elseif t.type == 'up' then
 
-			is_pressed[name] = false
+			_key_set_pressed(num, false)
 
-			local evname = '-'..name
+			local evname = t.up_event
 			if events[evname] then
 				if fire_event(evname, false, name) < 0 then
 					return
@@ -912,10 +1308,10 @@ _get_contents = function (path)
 			return
 
 		elseif t.type == 'toggle' then
-			if is_pressed[name] then
-				is_pressed[name] = false
+			if _key_get_pressed(num) then
+				_key_set_pressed(num, false)
 
-				local evname = '-'..name
+				local evname = t.up_event
 				if events[evname] then
 					if fire_event(evname, false, name) < 0 then
 						return
@@ -931,9 +1327,9 @@ _get_contents = function (path)
 					end
 				end
 			else
-				is_pressed[name] = _ms()
+				_key_set_pressed(num, _ms())
 
-				local evname = '+'..name
+				local evname = t.down_event
 				if events[evname] then
 					if fire_event(evname, true, name) < 0 then
 						return
@@ -952,9 +1348,9 @@ _get_contents = function (path)
 			return
 		elseif t.type == 'once' then
 			do
-				is_pressed[name] = _ms()
+				_key_set_pressed(num, _ms())
 
-				local evname = '+'..name
+				local evname = t.down_event
 				local name = name
 				if events[evname] then
 					if fire_event(evname, true, name) < 0 then
@@ -972,9 +1368,9 @@ _get_contents = function (path)
 				end
 			end
 			do
-				is_pressed[name] = false
+				_key_set_pressed(num, false)
 
-				local evname = '-'..name
+				local evname = t.up_event
 				local name = name
 				if events[evname] then
 					if fire_event(evname, false, name) < 0 then
@@ -1078,9 +1474,9 @@ end
 
 -- relief for buggy toggle keys
 release_all_keys = function ()
-	for key, pressedness in pairs(is_pressed) do
-		if pressedness then
-			is_pressed[key] = false
+	for key, n in pairs(key2num) do
+		if _key_get_pressed(n) then
+			_key_set_pressed(n, false)
 			local vu = binds_up[key]
 			if vu ~= nil then
 				if type(vu) == 'function' then
@@ -1101,7 +1497,7 @@ local is_active = false
 _attention = function (new_is_active)
 	is_active = new_is_active
 	fire_event('attention', new_is_active)
-	collectgarbage()
+	_gc_soon()
 end
 
 is_game_window_active = function ()
@@ -1159,6 +1555,11 @@ _cli_input = function (line)
 		return
 	end
 
+	if line == 'cfgfs_lock_stats' then
+		printv((_lock_stats_text():gsub('\n$', '')))
+		return
+	end
+
 	local fn_to_run = nil
 	if lua_mode then
 		local fn, err = repl_fn(line)
@@ -1175,8 +1576,8 @@ _cli_input = function (line)
 		local id = yield_id
 		local cb_initial
 		local cb_yielded
-		cb_initial = function (co, cb)
-			if co ~= ev_loop_co and coroutine.status(co) == 'suspended' then
+		cb_initial = function (co, cb, done)
+			if not done and co ~= ev_loop_co and coroutine.status(co) == 'suspended' then
 				eprintln('\27[1;34m->\27[0m %d', id)
 				yield_id = yield_id+1
 				ev_return_handlers[co] = cb_yielded
@@ -1194,8 +1595,8 @@ _cli_input = function (line)
 				end
 			end
 		end
-		cb_yielded = function (co, cb)
-			if coroutine.status(co) == 'dead' then
+		cb_yielded = function (co, cb, done)
+			if done then
 				eprintln('\27[1;34m<-\27[0m %d', id)
 			else
 				ev_return_handlers[co] = cb_yielded
@@ -1219,13 +1620,15 @@ _cli_input = function (line)
 		attention_message_shown = true
 	end
 
-	collectgarbage()
+	_gc_soon()
 
 end
 
 --------------------------------------------------------------------------------
 
-local our_logfile
+-- written by a background thread (src/logwriter.c)
+-- indexed for log_search() (src/logindex.c)
+local our_log
 if os.getenv('CFGFS_STARTTIME') then
 	if __linux__ then
 		os.execute('mkdir -p logs')
@@ -1234,13 +1637,16 @@ if os.getenv('CFGFS_STARTTIME') then
 		os.execute('/bin/mkdir -p logs')
 	end
 	logfilename = os.date('logs/console_%Y-%m-%d_%H:%M:%S.log', tonumber(os.getenv('CFGFS_STARTTIME')))
-	our_logfile = io.open(logfilename, 'a')
+	our_log = _log_open(logfilename, true)
 end
-if not our_logfile then
+if not our_log then
 	logfilename = 'console.log'
-	our_logfile = assert(io.open(logfilename, 'a'))
+	our_log = assert(_log_open(logfilename, true))
+end
+
+log_write = function (line)
+	return _log_write(our_log, line, '\n')
 end
-our_logfile:setvbuf('line')
 
 --------------------------------------------------------------------------------
 
@@ -1296,69 +1702,90 @@ end
 
 -- terminal printing / coloring / etc
 
-local is_spam = function (line)
+-- patterns for console lines that are hidden or dimmed
+-- see src/lua/filters.c for the syntax (* = anything, # = integer, %x = x)
+local builtin_console_filters = {
 	-- spammy errors there's nothing for us to do about
-	if #line >= 18 then
-		local c = line:sub(1, 1)
-		if c == '\n' and #line >= 56 and line:find('^\n ##### CTexture::LoadTextureBitsFromFile couldn\'t find .*$') then goto match end
-		if c == '*' and #line >= 41 and line:find('^%*%*%* Invalid sample rate %(%-?[0-9]+%) for sound \'.*\'%.$') then goto match end
-		if c == '-' and #line >= 26 and line:find('^%-%-%- Missing Vgui material .*$') then goto match end
-		if c == 'A' and #line >= 48 and line:find('^Attemped to precache unknown particle system ".*"!$') then goto match end
-		if c == 'A' and #line >= 65 and line:find('^Attempt to set particle collection .* to invalid orientation matrix$') then goto match end
-		if c == 'C' and #line >= 23 and line:find('^Could not find table ".*"$') then goto match end
-		if c == 'C' and #line >= 44 and line:find('^Cannot update control point %-?[0-9]+ for effect \'.*\'%.$') then goto match end
-		if c == 'C' and #line >= 74 and line:find('^Convar .* has conflicting FCVAR_CHEAT flags %(child: .*, parent: .*, parent wins%)$') then goto match end
-		if c == 'E' and #line >= 34 and line:find('^EmitSound: pitch out of bounds = %-?[0-9]+$') then goto match end
-		if c == 'E' and #line >= 41 and line:find('^Error: Material ".*" uses unknown shader ".*"$') then goto match end
-		if c == 'E' and #line >= 51 and line:find('^Error: Material ".*" : proxy ".*" unable to initialize!$') then goto match end
-		if c == 'E' and #line >= 54 and line:find('^Error! Variable ".*" is multiply defined in material ".*"!$') then goto match end
-		if c == 'F' and #line >= 37 and line:find('^Failed to create decoder for MP3 %[ .* %]$') then goto match end
-		if c == 'F' and #line >= 67 and line:find('^Failed to load sound ".*", file probably missing from disk/repository$') then goto match end
-		if c == 'F' and #line >= 72 and line:find('^For FCVAR_REPLICATED, ConVar must be defined in client and game %.dlls %(.*%)$') then goto match end
-		if c == 'F' and #line >= 130 and line:find('^Failed to find attachment point specified for AE_CL_CREATE_PARTICLE_EFFECT event%. Trying to spawn effect \'.*\' on attachment named \'.*\'$') then goto match end
-		if c == 'I' and #line >= 69 and line:find('^Ignoring unreasonable position %(%-?[0-9]+%.[0-9]+,%-?[0-9]+%.[0-9]+,%-?[0-9]+%.[0-9]+%) from vphysics! %(entity .*%)$') then goto match end
-		if c == 'M' and #line >= 25 and line:find('^Missing RecvProp for .* %- .*/.*$') then goto match end
-		if c == 'M' and #line >= 39 and line:find('^MDLCache: Failed load of %.PHY data for .*$') then goto match end
-		if c == 'M' and #line >= 65 and line:find('^MP3 initialized with no sound cache, this may cause janking%. %[ .* %]$') then goto match end
-		if c == 'M' and #line >= 68 and line:find('^Model \'.*\' doesn\'t have attachment \'.*\' to attach particle system \'.*\' to%.$') then goto match end
-		if c == 'N' and #line >= 35 and line:find('^No such variable ".*" for material ".*"$') then goto match end
-		if c == 'P' and #line >= 40 and line:find('^Parent cvar in server%.dll not allowed %(.*%)$') then goto match end
-		if c == 'R' and #line >= 78 and line:find('^Requesting texture value from var ".*" which is not a texture value %(material: .*%)$') then goto match end
-		if c == 'S' and #line >= 33 and line:find('^Shutdown function .* not in list!!!$') then goto match end
-		if c == 'S' and #line >= 49 and line:find('^SetupBones: invalid bone array size %(%-?[0-9]+ %- needs %-?[0-9]+%)$') then goto match end
-		if c == 'S' and #line >= 51 and line:find('^Shader \'.*\' %- Couldn\'t load combo %-?[0-9]+ of shader %(dyn=%-?[0-9]+%)$') then goto match end
-		if c == 'S' and #line >= 53 and line:find('^SOLID_VPHYSICS static prop with no vphysics model! %(.*%)$') then goto match end
-		if c == 'U' and #line >= 18 and line:find('^Unable to remove .*!$') then goto match end
-		if c == 'U' and #line >= 55 and line:find('^Unable to bind a key for command ".*" after %-?[0-9]+ attempt%(s%)%.$') then goto match end
-		if c == 'm' and #line >= 42 and line:find('^m_face%->glyph%->bitmap%.width is 0 for ch:%-?[0-9]+ .*$') then goto match end
-		if c == 'm' and #line >= 106 and line:find('^material .* has a normal map and %$basealphaenvmapmask%.  Must use %$normalmapalphaenvmapmask to get specular%.\n$') --[[ <-- extra newline ]] then goto match end
-		if line == 'Unknown command "dimmer_clicked"' then goto match end
-		if line == 'Unknown command: dimmer_clicked' then goto match end
-		if line == 'hit surface has no samples' then goto match end
-		goto nomatch
-		::match::
-		return true
-	end
-	::nomatch::
-	return false
-end
+	{'\n %#%#%#%#%# CTexture::LoadTextureBitsFromFile couldn\'t find *', 'hide'},
+	{'%*%*%* Invalid sample rate (#) for sound \'*\'.', 'hide'},
+	{'--- Missing Vgui material *', 'hide'},
+	{'Attemped to precache unknown particle system "*"!', 'hide'},
+	{'Attempt to set particle collection * to invalid orientation matrix', 'hide'},
+	{'Could not find table "*"', 'hide'},
+	{'Cannot update control point # for effect \'*\'.', 'hide'},
+	{'Convar * has conflicting FCVAR_CHEAT flags (child: *, parent: *, parent wins)', 'hide'},
+	{'EmitSound: pitch out of bounds = #', 'hide'},
+	{'Error: Material "*" uses unknown shader "*"', 'hide'},
+	{'Error: Material "*" : proxy "*" unable to initialize!', 'hide'},
+	{'Error! Variable "*" is multiply defined in material "*"!', 'hide'},
+	{'Failed to create decoder for MP3 [ * ]', 'hide'},
+	{'Failed to load sound "*", file probably missing from disk/repository', 'hide'},
+	{'For FCVAR_REPLICATED, ConVar must be defined in client and game .dlls (*)', 'hide'},
+	{'Failed to find attachment point specified for AE_CL_CREATE_PARTICLE_EFFECT event. Trying to spawn effect \'*\' on attachment named \'*\'', 'hide'},
+	{'Ignoring unreasonable position (#.#,#.#,#.#) from vphysics! (entity *)', 'hide'},
+	{'Missing RecvProp for * - */*', 'hide'},
+	{'MDLCache: Failed load of .PHY data for *', 'hide'},
+	{'MP3 initialized with no sound cache, this may cause janking. [ * ]', 'hide'},
+	{'Model \'*\' doesn\'t have attachment \'*\' to attach particle system \'*\' to.', 'hide'},
+	{'No such variable "*" for material "*"', 'hide'},
+	{'Parent cvar in server.dll not allowed (*)', 'hide'},
+	{'Requesting texture value from var "*" which is not a texture value (material: *)', 'hide'},
+	{'Shutdown function * not in list!!!', 'hide'},
+	{'SetupBones: invalid bone array size (# - needs #)', 'hide'},
+	{'Shader \'*\' - Couldn\'t load combo # of shader (dyn=#)', 'hide'},
+	{'SOLID_VPHYSICS static prop with no vphysics model! (*)', 'hide'},
+	{'Unable to remove *!', 'hide'},
+	{'Unable to bind a key for command "*" after # attempt(s).', 'hide'},
+	{'m_face->glyph->bitmap.width is 0 for ch:# *', 'hide'},
+	{'material * has a normal map and $basealphaenvmapmask.  Must use $normalmapalphaenvmapmask to get specular.\n', 'hide'}, -- <-- extra newline
+	{'Unknown command "dimmer_clicked"', 'hide'},
+	{'Unknown command: dimmer_clicked', 'hide'},
+	{'hit surface has no samples', 'hide'},
 
-local dim_clutter = function (line)
 	-- spammy messages that might still be useful in some cases
-	if #line >= 18 then
-		local c = line:sub(1, 1)
-		if c == '\'' and #line >= 31 and line:find('^\'.*\' not present; not executing%.$') then goto match end
-		if c == 'C' and #line >= 80 and line:find('^Can\'t use cheat cvar .* in multiplayer, unless the server has sv_cheats set to 1%.$') then goto match end
-		if c == 'C' and #line >= 84 and line:find('^Can\'t change .* when playing, disconnect from the server or switch team to spectators$') then goto match end
-		if c == 'F' and #line >= 55 and line:find('^FCVAR_CLIENTCMD_CAN_EXECUTE prevented running command: .*$') then goto match end
-		if c == 'U' and #line >= 17 and line:find('^Unknown command: .*$') then goto match end
-		if c == 'U' and #line >= 18 and line:find('^Unknown command ".*"$') then goto match end
-		goto nomatch
-		::match::
-		return '\27[2m' .. line .. '\27[0m'
-	end
-	::nomatch::
-	return nil
+	{'\'*\' not present; not executing.', 'dim'},
+	{'Can\'t use cheat cvar * in multiplayer, unless the server has sv_cheats set to 1.', 'dim'},
+	{'Can\'t change * when playing, disconnect from the server or switch team to spectators', 'dim'},
+	{'FCVAR_CLIENTCMD_CAN_EXECUTE prevented running command: *', 'dim'},
+	{'Unknown command: *', 'dim'},
+	{'Unknown command "*"', 'dim'},
+}
+
+-- added by the script with add_console_filter()
+local user_console_filters = make_resetable_table()
+
+-- compiled from both lists when it's first needed
+local console_filter = nil
+local console_filter_actions = nil
+add_reset_callback(function ()
+	console_filter = nil
+	console_filter_actions = nil
+end)
+
+-- action: 'hide' or 'dim'
+-- the built-in patterns are checked first
+add_console_filter = function (pattern, action)
+	assert(type(pattern) == 'string', 'add_console_filter: pattern must be a string')
+	assert(action == 'hide' or action == 'dim', 'add_console_filter: action must be "hide" or "dim"')
+	table.insert(user_console_filters, {pattern, action})
+	console_filter = nil
+end
+
+-- returns 'hide', 'dim' or nil
+local classify_console_line = function (line)
+	if not console_filter then
+		local patterns, actions = {}, {}
+		for _, list in ipairs({builtin_console_filters, user_console_filters}) do
+			for _, t in ipairs(list) do
+				table.insert(patterns, t[1])
+				table.insert(actions, t[2])
+			end
+		end
+		console_filter = compile_filters(patterns)
+		console_filter_actions = actions
+	end
+	local id = console_filter:match(line)
+	return id and console_filter_actions[id]
 end
 
 local bright = function (s) return string.format('\27[34;38;2;251;236;203m%s\27[0m', s) end
@@ -1396,76 +1823,58 @@ local colorize_sourcemod_thing = function (line)
 	return false
 end
 
-local gco_unjumble = linereader(function (line)
-	if line then
-		return _game_console_output(line, true, true)
-	end
-end)
-_game_console_output = function (line, complete, was_jumbled)
-	if complete == true then
-		if not was_jumbled then
-			our_logfile:write(line, '\n')
-			if fire_event('game_console_output', line) < 0 then
-				return
-			end
-			if is_spam(line) then
-				return
-			end
-			line = parse_game_message(line)
-			    or colorize_sourcemod_thing(line)
-			    or dim_clutter(line)
-			    or line
-			_println(line)
-		else
-			-- reconstructed jumbled line
-			-- probably contains either
-			-- * "help" command output for getting a cvar
-			-- * echos from outside cfgfs
-
-			our_logfile:write(line, '\n')
-
-			-- 2 = dim
-			printv('\27[2m', line, '\27[0m')
-		end
-
-		-- write out any jumbled line contents that might've been left
-		--  in the buffer
-		-- this might cause it to printed too early but that's not much
-		--  different from how it would be printed in the in-game console
-		return gco_unjumble(nil)
-	elseif complete == false then
-		if not (line == '\n' or line == '\r\n') then
-			local contents, rest = line:match('^(.*)\x7f( \r?)$')
-			if contents then
-				-- cmd.echo() from lua
-				-- (\x7f is added in cmd.c to mark echos so they
-				--  can be identified here)
-
-				our_logfile:write(contents, rest, '\n')
-				-- preserve the trailing spac↑e from echo
-
-				return _println(contents)
-			else
-				-- some other partial write
+-- called by console_log.c with the lines written to console.log
+-- kind:
+--   "line": a normal line
+--   "jumbled": line reconstructed from pieces that were written separately
+--     probably contains either
+--     * "help" command output for getting a cvar
+--     * echos from outside cfgfs
+--   "echo": cmd.echo() from lua (line has the \x7f marker removed)
+--   "fragment": one of the pieces of a jumbled line. return false to leave it
+--     out of the reconstructed line
+--   nil: line written to us manually
+_game_console_output = function (line, kind)
+	if kind == 'line' then
+		log_write(line)
+		if line == 'Cbuf_AddText: buffer overflow' then
+			-- the config was too big for the game, make them smaller
+			_cfg_size_overflow()
+		end
+		if events.game_console_output and fire_event('game_console_output', line) < 0 then
+			return
+		end
+		local action = classify_console_line(line)
+		if action == 'hide' then
+			return
+		end
+		line = parse_game_message(line)
+		    or colorize_sourcemod_thing(line)
+		    or (action == 'dim' and '\27[2m' .. line .. '\27[0m')
+		    or line
+		_println(line)
+	elseif kind == 'jumbled' then
+		log_write(line)
 
-				-- this event is for the individual pieces of
-				--  lines written in multiple parts
-				if fire_event('game_console_output_jumbled', line) < 0 then
-					return
-				end
+		-- 2 = dim
+		printv('\27[2m', line, '\27[0m')
+	elseif kind == 'echo' then
+		-- preserve the trailing space from echo
+		_log_write(our_log, line, ' \n')
 
-				return gco_unjumble(line)
-			end
-		else
-			-- writing the newline
-			return gco_unjumble(nil)
+		return _println(line)
+	elseif kind == 'fragment' then
+		-- this event is for the individual pieces of lines written in
+		--  multiple parts
+		if not events.game_console_output_jumbled then
+			return true
 		end
-	elseif complete == nil then
-		-- line written to us manually
-		our_logfile:write(line, '\n')
+		return fire_event('game_console_output_jumbled', line) >= 0
+	elseif kind == nil then
+		log_write(line)
 		return _println(line)
 	else
-		fatal('_game_console_output: bad value for "complete"')
+		fatal('_game_console_output: bad value for "kind"')
 	end
 end
 
@@ -1476,7 +1885,10 @@ do
 local rcon_curr_id = 0
 local rcon_lr = linereader(function (line)
 	if not line then return end
-	local cnt, data = fire_event('rcon_output', line, rcon_curr_id)
+	local cnt, data = 0, nil
+	if events.rcon_output then
+		cnt, data = fire_event('rcon_output', line, rcon_curr_id)
+	end
 	local shall_log = true
 	local shall_print = true
 	if cnt < 0 then
@@ -1489,7 +1901,7 @@ local rcon_lr = linereader(function (line)
 		end
 	end
 	if shall_log then
-		our_logfile:write(line, '\n')
+		log_write(line)
 	end
 	if shall_print then
 		_println(line)
@@ -1787,19 +2199,54 @@ do
 end
 
 open_log = function ()
+	-- make sure recent lines are in the file
+	_log_sync()
 	local f = assert(io.open(logfilename, 'r'))
 	assert(f:seek('set', logpos))
 	return f
 end
 
-grep = function (pat)
-	local f = open_log()
-	for line in f:lines() do
-		if line:find(pat) then
-			printv(line)
+-- searches run on other threads, cb(lines) is called with each batch of
+--  matching lines and then with nil when it's done
+-- since_ms: only look at lines logged in the last since_ms milliseconds
+-- search ids are kept across reloads so that a search from before can't be
+--  mistaken for a new one
+_log_search_last_id = _log_search_last_id or 0
+
+_log_search_result = function (sid, lines)
+	fire_event('log_search.' .. sid, lines)
+end
+
+log_search = function (pat, cb, since_ms)
+	local ok, err = pcall(string.find, '', pat)
+	if not ok then
+		return error('log_search: ' .. err, 2)
+	end
+	_log_search_last_id = _log_search_last_id+1
+	local evname = 'log_search.' .. _log_search_last_id
+	local listener
+	listener = function (lines)
+		if lines == nil then
+			remove_listener(evname, listener)
 		end
+		return cb(lines)
 	end
-	f:close()
+	add_listener(evname, listener)
+	_log_search(our_log, pat, since_ms, _log_search_last_id)
+end
+
+log_lines_since = function (ms)
+	return _log_lines_since(our_log, ms)
+end
+
+grep = function (pat, since_ms)
+	log_search(pat, function (lines)
+		if lines then
+			for _, line in ipairs(lines) do
+				printv(line)
+			end
+		end
+	end, since_ms)
 end
 
 --------------------------------------------------------------------------------
@@ -1834,9 +2281,12 @@ else
 	con_logfile_tmp = 'console.log'
 end
 
+-- the game only reopens the log when con_logfile changes, so it's set to
+--  something else first. cmd.con_logfile() and not cvar.con_logfile so that
+--  set_coalescing() doesn't merge the two
 local reinit_log = function ()
-	cvar.con_logfile = con_logfile_tmp
-	cvar.con_logfile = con_logfile_main
+	cmd.con_logfile(con_logfile_tmp)
+	cmd.con_logfile(con_logfile_main)
 	cmd.echo('cfgfs: log file has been reinited')
 end
 
@@ -1851,11 +2301,11 @@ local before_script_exec = function ()
 
 	cmd.cfgfs_restart = function ()
 		cmd.echo "restarting..."
-		cvar.con_logfile = con_logfile_tmp
+		cmd.con_logfile(con_logfile_tmp)
 		wait(0)
 		_cfgfs_unmount()
 		wait(150)
-		cvar.con_logfile = con_logfile_main
+		cmd.con_logfile(con_logfile_main)
 		cmd.echo "restart failed?"
 	end
 
@@ -1916,7 +2366,7 @@ _reload_2 = function (ok)
 
 	fire_event('reload')
 
-	collectgarbage()
+	_gc_soon(true)
 end
 
 -- initial run of script.lua is done and output isn't going in init.cfg anymore
@@ -1936,7 +2386,10 @@ end
 -- As verbs the difference between exit and quit is that exit is to go out
 --  while quit is to pay (a debt, fine etc).
 _fire_unload = function (exiting)
-	return fire_event('unload', exiting)
+	local rv = fire_event('unload', exiting)
+	-- make sure the log is on disk in case we don't come back
+	_log_sync(true)
+	return rv
 end
 
 --------------------------------------------------------------------------------
@@ -2019,6 +2472,6 @@ end
 
 --------------------------------------------------------------------------------
 
-collectgarbage()
+_gc_soon(true)
 
 return true
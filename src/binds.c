@@ -0,0 +1,245 @@
+#include "binds.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+
+#include "cfg.h"
+#include "cli_output.h"
+#include "macros.h"
+#include "main.h"
+
+// native copy of the simple keybinds so that cfgfs_read() can answer key
+//  presses without waiting for the lua lock
+// a key is only handled here if builtin.lua has told us it's safe: both of its
+//  binds are plain strings and nothing is listening for its +key/-key events
+// the pressed state of every key lives here too (is_pressed in builtin.lua)
+//  since both paths need to agree on it for toggle binds
+
+// bigger than the number of keys in keys.c
+#define MAX_KEYS 192
+
+struct fast_bind {
+	char   *down;
+	char   *up;
+	size_t  downlen; // includes the newline
+	size_t  uplen;
+	bool    enabled;
+	double  pressed; // mono_ms() when pressed or 0.0 if not
+};
+
+static struct fast_bind binds[MAX_KEYS+1]; // indexed by key number (1-based)
+static pthread_mutex_t binds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// both commands have to fit in a single read
+_Static_assert(min_reported_cfg_size >= 2*(max_line_length+1),
+    "min_reported_cfg_size is too low for fast binds");
+
+// -----------------------------------------------------------------------------
+
+#define keys_pre "/cfgfs/keys/"
+
+// parses "/cfgfs/keys/+12.cfg" -> '+', 12
+static bool parse_key_path(const char *restrict path,
+                           size_t pathlen,
+                           char *type_out,
+                           int *n_out) {
+	if (unlikely(pathlen < strlen(keys_pre)+strlen("+1.cfg"))) return false;
+	if (unlikely(0 != memcmp(path, keys_pre, strlen(keys_pre)))) return false;
+	if (unlikely(0 != memcmp(path+pathlen-strlen(".cfg"), ".cfg", strlen(".cfg")))) return false;
+
+	const char *p = path+strlen(keys_pre);
+	const char *end = path+pathlen-strlen(".cfg");
+
+	char type = *p++;
+	size_t n = 0;
+	if (unlikely(p == end)) return false;
+	for (; p != end; p++) {
+		if (unlikely(*p < '0' || *p > '9')) return false;
+		if (unlikely(n > MAX_KEYS)) return false;
+		n = n*10 + (size_t)(*p-'0');
+	}
+	if (unlikely(n == 0 || n > MAX_KEYS)) return false;
+
+	*type_out = type;
+	*n_out = (int)n;
+	return true;
+}
+
+static size_t copy_down(const struct fast_bind *b, char *buf) {
+	if (b->down != NULL) memcpy(buf, b->down, b->downlen);
+	return (b->down != NULL) ? b->downlen : 0;
+}
+
+static size_t copy_up(const struct fast_bind *b, char *buf) {
+	if (b->up != NULL) memcpy(buf, b->up, b->uplen);
+	return (b->up != NULL) ? b->uplen : 0;
+}
+
+__attribute__((hot))
+int binds_try_read(const char *restrict path, size_t pathlen, char *restrict buf) {
+	char type;
+	int n;
+	if (!parse_key_path(path, pathlen, &type, &n)) return -1;
+
+	size_t sz = 0;
+	pthread_mutex_lock(&binds_lock);
+	struct fast_bind *b = &binds[n];
+	if (unlikely(!b->enabled)) {
+		pthread_mutex_unlock(&binds_lock);
+		return -1;
+	}
+	switch (type) {
+	case '^':
+		type = (b->pressed != 0.0) ? '-' : '+';
+		break;
+	}
+	switch (type) {
+	case '+':
+		b->pressed = mono_ms();
+		sz = copy_down(b, buf);
+		break;
+	case '-':
+		b->pressed = 0.0;
+		sz = copy_up(b, buf);
+		break;
+	case '@':
+		sz = copy_down(b, buf);
+		sz += copy_up(b, buf+sz);
+		b->pressed = 0.0;
+		break;
+	default:
+		pthread_mutex_unlock(&binds_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&binds_lock);
+
+VV	eprintln("binds_try_read: %s handled without lua", path);
+
+	return (int)sz;
+}
+
+// -----------------------------------------------------------------------------
+
+static int check_key_num(lua_State *L, int idx) {
+	lua_Integer n = luaL_checkinteger(L, idx);
+	if (unlikely(n < 1 || n > MAX_KEYS)) {
+		return luaL_error(L, "key number %d out of range", (int)n);
+	}
+	return (int)n;
+}
+
+// copies a bind string and adds a newline to it
+// returns NULL and sets *ok to false if it can't be used from C
+static char *dup_payload(lua_State *L, int idx, size_t *len_out, bool *ok) {
+	*len_out = 0;
+	if (lua_isnil(L, idx)) return NULL;
+	int type = lua_type(L, idx);
+	if (type != LUA_TSTRING && type != LUA_TNUMBER) goto nope;
+	size_t len;
+	const char *s = lua_tolstring(L, idx, &len);
+	// lua does nothing for these
+	if (len == 0) return NULL;
+	// too long for one line, leave it to cfg() to split or complain
+	if (len > max_line_length) goto nope;
+	char *p = malloc(len+1);
+	memcpy(p, s, len);
+	p[len] = '\n';
+	*len_out = len+1;
+	return p;
+nope:
+	*ok = false;
+	return NULL;
+}
+
+// _fast_bind_set(n, enabled, down, up)
+static int l_fast_bind_set(lua_State *L) {
+	int n = check_key_num(L, 1);
+	bool enabled = lua_toboolean(L, 2);
+	char *down = NULL, *up = NULL;
+	size_t downlen = 0, uplen = 0;
+
+	if (enabled) {
+		down = dup_payload(L, 3, &downlen, &enabled);
+		up = dup_payload(L, 4, &uplen, &enabled);
+		if (!enabled) {
+			free(exchange(down, NULL));
+			free(exchange(up, NULL));
+		}
+	}
+
+	pthread_mutex_lock(&binds_lock);
+	struct fast_bind *b = &binds[n];
+	b->enabled = enabled;
+	down = exchange(b->down, down);
+	up = exchange(b->up, up);
+	b->downlen = downlen;
+	b->uplen = uplen;
+	pthread_mutex_unlock(&binds_lock);
+
+	free(down);
+	free(up);
+
+	lua_pushboolean(L, enabled);
+	return 1;
+}
+
+// called on reload
+// keeps the pressed state since is_pressed isn't reset either
+__attribute__((minsize))
+static int l_fast_bind_reset(lua_State *L) {
+	(void)L;
+	for (int n = 1; n <= MAX_KEYS; n++) {
+		pthread_mutex_lock(&binds_lock);
+		struct fast_bind *b = &binds[n];
+		char *down = exchange(b->down, NULL);
+		char *up = exchange(b->up, NULL);
+		b->enabled = false;
+		b->downlen = 0;
+		b->uplen = 0;
+		pthread_mutex_unlock(&binds_lock);
+		free(down);
+		free(up);
+	}
+	return 0;
+}
+
+// _key_get_pressed(n) -> false or the _ms() timestamp
+static int l_key_get_pressed(lua_State *L) {
+	int n = check_key_num(L, 1);
+	pthread_mutex_lock(&binds_lock);
+	double pressed = binds[n].pressed;
+	pthread_mutex_unlock(&binds_lock);
+	if (pressed != 0.0) {
+		lua_pushnumber(L, pressed);
+	} else {
+		lua_pushboolean(L, false);
+	}
+	return 1;
+}
+
+// _key_set_pressed(n, false or timestamp)
+static int l_key_set_pressed(lua_State *L) {
+	int n = check_key_num(L, 1);
+	double pressed = 0.0;
+	if (lua_toboolean(L, 2)) {
+		pressed = (lua_type(L, 2) == LUA_TNUMBER) ? lua_tonumber(L, 2) : mono_ms();
+		if (pressed == 0.0) pressed = 1.0;
+	}
+	pthread_mutex_lock(&binds_lock);
+	binds[n].pressed = pressed;
+	pthread_mutex_unlock(&binds_lock);
+	return 0;
+}
+
+const luaL_Reg l_binds_fns[] = {
+	{"_fast_bind_set", l_fast_bind_set},
+	{"_fast_bind_reset", l_fast_bind_reset},
+	{"_key_get_pressed", l_key_get_pressed},
+	{"_key_set_pressed", l_key_set_pressed},
+	{NULL, NULL},
+};
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <lauxlib.h>
+
+// tries to answer a read of /cfgfs/keys/{+,-,^,@}N.cfg without calling lua
+// buf must have room for at least min_reported_cfg_size bytes
+// returns the number of bytes written to buf, or -1 if lua has to handle it
+int binds_try_read(const char *restrict path, size_t pathlen, char *restrict buf);
+
+extern const luaL_Reg l_binds_fns[];
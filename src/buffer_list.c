@@ -1,8 +1,12 @@
 #include "buffer_list.h"
 
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "cfg.h"
 #include "macros.h"
@@ -13,13 +17,16 @@
 #define cfg_exec_next_cmd "exec cfgfs/buffer"
 #define cfg_exec_next_cmd_len (sizeof(cfg_exec_next_cmd)-1)
 
-// make sure reported_cfg_size is big enough that we'll always be able to put at
+// make sure min_reported_cfg_size is big enough that we'll always be able to put at
 //  least one command in a single buffer
-_Static_assert(reported_cfg_size >= max_line_length+1+cfg_exec_next_cmd_len+1,
-    "reported_cfg_size is too low (not enough space to reliably fit one command)");
+_Static_assert(min_reported_cfg_size >= max_line_length+1+cfg_exec_next_cmd_len+1,
+    "min_reported_cfg_size is too low (not enough space to reliably fit one command)");
+_Static_assert(default_reported_cfg_size >= min_reported_cfg_size &&
+               default_reported_cfg_size <= max_reported_cfg_size,
+    "default_reported_cfg_size is out of range");
 
 static size_t buffer_space(const struct buffer *self) {
-	return reported_cfg_size - self->size;
+	return self->cap - self->size;
 }
 
 static bool buffer_may_add_line(const struct buffer *self, size_t len) {
@@ -54,15 +61,278 @@ static void buffer_copy_from_that_to_this(struct buffer *self,
 
 // -----------------------------------------------------------------------------
 
+// buffer pool
+// a fixed number of buffers is allocated (and faulted in) on startup, so the
+//  read path doesn't have to touch malloc as long as they're enough. beyond
+//  that each buffer is malloc'd and freed on its own, so a big burst of output
+//  doesn't keep its memory around forever
+// taking a buffer is only done with the lua lock held (writing to a list), but
+//  cfgfs_read() frees them after releasing it. so freed buffers go on a
+//  lock-free "returned" stack, and the free list only takes them over (all at
+//  once) when it runs out. that way there's one consumer and no ABA problem
+// shared buffers (see buffer_list_append_from_that_to_this()) have no data of
+//  their own, they're malloc'd without it
+
+#if !defined(BUFFER_POOL_SIZE)
+ #define BUFFER_POOL_SIZE 64
+#endif
+#define buffer_alloc_size (sizeof(struct buffer) + max_reported_cfg_size)
+
+static char *pool_slab;
+static struct buffer *pool_free; // only touched with the lua lock held
+static struct buffer *_Atomic pool_returned;
+
+static _Atomic(size_t) pool_in_use;
+static _Atomic(size_t) pool_high_water;
+static _Atomic(size_t) pool_overflows;
+static _Atomic(size_t) pool_overflow_in_use;
+
+static inline bool buffer_is_pooled(const struct buffer *self) {
+	return ((const char *)self >= pool_slab &&
+	        (const char *)self < pool_slab+BUFFER_POOL_SIZE*buffer_alloc_size);
+}
+
+static inline void buffer_init(struct buffer *self) {
+	memset(self, 0, sizeof(struct buffer));
+	self->data = ((char *)self + sizeof(struct buffer));
+	atomic_init(&self->refs, 1);
+	// the size at the time, the data is split up in these
+	self->cap = reported_cfg_size;
+	self->created = mono_ms();
+	self->updated = self->created;
+}
+
+__attribute__((cold))
+__attribute__((noinline))
+static struct buffer *buffer_new_overflow(void) {
+	struct buffer *self = malloc(buffer_alloc_size);
+	unsafe_optimization_hint(self != NULL);
+	atomic_fetch_add_explicit(&pool_overflows, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pool_overflow_in_use, 1, memory_order_relaxed);
+	return self;
+}
+
+static inline struct buffer *buffer_new(void) {
+	if (unlikely(pool_free == NULL)) {
+		pool_free = atomic_exchange_explicit(&pool_returned, NULL, memory_order_acquire);
+		if (unlikely(pool_free == NULL)) {
+			struct buffer *_new_ent = buffer_new_overflow();
+			buffer_init(_new_ent);
+			return _new_ent;
+		}
+	}
+	struct buffer *_new_ent = pool_free;
+	pool_free = _new_ent->next;
+	buffer_init(_new_ent);
+
+	size_t in_use = atomic_fetch_add_explicit(&pool_in_use, 1, memory_order_relaxed)+1;
+	if (unlikely(in_use > atomic_load_explicit(&pool_high_water, memory_order_relaxed))) {
+		atomic_store_explicit(&pool_high_water, in_use, memory_order_relaxed);
+	}
+	return _new_ent;
+}
+
+void buffer_free(struct buffer *self) {
+	if (atomic_fetch_sub_explicit(&self->refs, 1, memory_order_acq_rel) != 1) return;
+	struct buffer *shared = self->shared;
+	if (shared != NULL) {
+		free(self);
+		buffer_free(shared);
+	} else if (unlikely(!buffer_is_pooled(self))) {
+		free(self);
+		atomic_fetch_sub_explicit(&pool_overflow_in_use, 1, memory_order_relaxed);
+	} else {
+		struct buffer *head = atomic_load_explicit(&pool_returned, memory_order_relaxed);
+		do self->next = head;
+		while (!atomic_compare_exchange_weak_explicit(&pool_returned, &head, self,
+		    memory_order_release, memory_order_relaxed));
+		atomic_fetch_sub_explicit(&pool_in_use, 1, memory_order_relaxed);
+	}
+}
+
+// makes a buffer that serves the same data as buf without copying it
+static struct buffer *buffer_new_shared(const struct buffer *buf) {
+	struct buffer *src = (buf->shared != NULL) ? buf->shared : (struct buffer *)buf;
+	struct buffer *self = malloc(sizeof(struct buffer));
+	unsafe_optimization_hint(self != NULL);
+	memset(self, 0, sizeof(struct buffer));
+	atomic_init(&self->refs, 1);
+	self->size = buf->size;
+	self->cap = buf->cap;
+	self->full = buf->full;
+	self->data = buf->data;
+	self->created = buf->created;
+	self->updated = buf->updated;
+	self->shared = src;
+	atomic_fetch_add_explicit(&src->refs, 1, memory_order_relaxed);
+	return self;
+}
+
+// copy on write: replaces a shared buffer with one that has its own copy of
+//  the data. it's the non-full one, so it's the last in the list
+__attribute__((cold))
+__attribute__((noinline))
+static struct buffer *buffer_list_unshare(struct buffer_list *self, struct buffer *buf) {
+D	assert(self->last == buf && buf->next == NULL);
+	struct buffer *own = buffer_new();
+	memcpy(own->data, buf->data, buf->size);
+	own->size = buf->size;
+	own->cap = buf->cap;
+	own->full = buf->full;
+	own->created = buf->created;
+	own->updated = buf->updated;
+	if (self->first == buf) {
+		self->first = own;
+	} else {
+		struct buffer *prev = self->first;
+		while (prev->next != buf) prev = prev->next;
+		prev->next = own;
+	}
+	self->last = own;
+	if (self->nonfull == buf) self->nonfull = own;
+	buffer_free(buf);
+	return own;
+}
+
+__attribute__((constructor))
+static void buffer_pool_init(void) {
+	pool_slab = malloc(BUFFER_POOL_SIZE*buffer_alloc_size);
+	unsafe_optimization_hint(pool_slab != NULL);
+	// fault it in now instead of on the first write to each buffer
+	memset(pool_slab, 0, BUFFER_POOL_SIZE*buffer_alloc_size);
+	for (size_t i = BUFFER_POOL_SIZE; i-- > 0;) {
+		struct buffer *buf = (struct buffer *)(pool_slab+i*buffer_alloc_size);
+		buf->next = pool_free;
+		pool_free = buf;
+	}
+}
+
+void buffer_pool_get_stats(struct buffer_pool_stats *out) {
+	out->capacity = BUFFER_POOL_SIZE;
+	out->in_use = atomic_load(&pool_in_use);
+	out->high_water = atomic_load(&pool_high_water);
+	out->overflows = atomic_load(&pool_overflows);
+	out->overflow_in_use = atomic_load(&pool_overflow_in_use);
+}
+
+// -----------------------------------------------------------------------------
+
+// coalescing index
+// maps keys to where the line that set them is. it only covers lines since
+//  the last barrier (any line that doesn't set something), and gets cleared
+//  whenever buffers are handed out or moved around
+
+#define COALESCE_SLOTS 256 // power of 2
+#define COALESCE_MAX_ENTRIES (COALESCE_SLOTS/2)
+#define COALESCE_KEYS_SIZE 4096
+
+struct coalesce_entry {
+	struct buffer *buf; // NULL if unused
+	uint32_t       hash;
+	uint16_t       off;
+	uint16_t       len; // including the newline
+	uint16_t       keyoff; // in keys[]
+	uint16_t       keylen;
+	uint8_t        kind;
+};
+
+struct coalesce_index {
+	struct coalesce_entry slots[COALESCE_SLOTS];
+	size_t                count;
+	size_t                keys_used;
+	char                  keys[COALESCE_KEYS_SIZE];
+	struct coalesce_stats stats;
+};
+
+_Static_assert(max_reported_cfg_size <= UINT16_MAX, "offsets don't fit in coalesce_entry");
+
+static inline void coalesce_clear(struct buffer_list *self) {
+	struct coalesce_index *ci = self->coalesce;
+	if (likely(ci == NULL || ci->count == 0)) return;
+	for (size_t i = 0; i < COALESCE_SLOTS; i++) ci->slots[i].buf = NULL;
+	ci->count = 0;
+	ci->keys_used = 0;
+}
+
+static uint32_t coalesce_hash(enum line_key_kind kind, const char *key, size_t keylen) {
+	uint32_t h = 2166136261u ^ (uint32_t)kind;
+	for (size_t i = 0; i < keylen; i++) {
+		h = (h ^ (unsigned char)key[i]) * 16777619u;
+	}
+	return h;
+}
+
+// removes the line of an entry from its buffer, "end" is where the data in it
+//  ends (including anything not committed yet)
+static void coalesce_remove_line(struct buffer_list *self,
+                                 struct coalesce_index *ci,
+                                 const struct coalesce_entry *e,
+                                 size_t end) {
+	struct buffer *buf = e->buf;
+	char *p = (char *)buf->data+e->off;
+	memmove(p, p+e->len, end-(e->off+e->len));
+	buf->size -= e->len;
+	// fix up the others after it
+	for (size_t i = 0; i < COALESCE_SLOTS; i++) {
+		struct coalesce_entry *o = &ci->slots[i];
+		if (o->buf == buf && o->off > e->off) o->off -= e->len;
+	}
+	ci->stats.lines += 1;
+	ci->stats.bytes += e->len;
+
+	// nothing but the exec left? then drop it instead of making the game
+	//  read it. (not the fake one from cfgfs_read(), that's not refcounted)
+	if (buf->full &&
+	    buf->size == cfg_exec_next_cmd_len+1 &&
+	    atomic_load_explicit(&buf->refs, memory_order_relaxed) != 0) {
+D		assert(buf != self->last && buf != self->nonfull);
+		if (self->first == buf) {
+			self->first = buf->next;
+		} else {
+			struct buffer *prev = self->first;
+			while (prev->next != buf) prev = prev->next;
+			prev->next = buf->next;
+		}
+		buffer_free(buf);
+	}
+}
+
+__attribute__((cold))
+void buffer_list_set_coalescing(struct buffer_list *self, bool enabled) {
+	if (enabled && self->coalesce == NULL) {
+		self->coalesce = calloc(1, sizeof(struct coalesce_index));
+	} else if (!enabled && self->coalesce != NULL) {
+		free(exchange(self->coalesce, NULL));
+	}
+}
+
+void buffer_list_get_coalesce_stats(const struct buffer_list *self, struct coalesce_stats *out) {
+	if (self->coalesce != NULL) {
+		*out = self->coalesce->stats;
+	} else {
+		memset(out, 0, sizeof(struct coalesce_stats));
+	}
+}
+
+// -----------------------------------------------------------------------------
+
 // struct buffer_list
 
+// the coalescing state stays with the list it was enabled on
 __attribute__((cold)) // only used by reloader
 void buffer_list_swap(struct buffer_list *self, struct buffer_list *bl) {
+	coalesce_clear(self);
+	coalesce_clear(bl);
+	struct coalesce_index *self_ci = self->coalesce;
+	struct coalesce_index *bl_ci = bl->coalesce;
 	struct buffer_list tmp = *bl;
 	*bl = *self;
 	*self = tmp;
+	self->coalesce = self_ci;
+	bl->coalesce = bl_ci;
 }
 
+// the buffers go back to the pool
 __attribute__((cold)) // only used by reloader
 void buffer_list_reset(struct buffer_list *self) {
 	struct buffer *ent = self->first;
@@ -71,11 +341,15 @@ void buffer_list_reset(struct buffer_list *self) {
 		buffer_free(ent);
 		ent = next;
 	}
+	coalesce_clear(self);
+	struct coalesce_index *ci = self->coalesce;
 	memset(self, 0, sizeof(struct buffer_list));
+	self->coalesce = ci;
 }
 
 struct buffer *buffer_list_grab_first(struct buffer_list *self) {
 	struct buffer *ent = self->first;
+	coalesce_clear(self);
 	if (likely(ent != NULL)) {
 		struct buffer *next = ent->next; // note: ent is freed after this so no need to clear ent->next
 		self->first = next;
@@ -96,19 +370,13 @@ D			assert(self->nonfull != ent);
 	return ent;
 }
 
-static inline struct buffer *buffer_new(void) {
-	struct buffer *_new_ent = malloc((sizeof(struct buffer) + reported_cfg_size));
-	unsafe_optimization_hint(_new_ent != NULL);
-	memset(_new_ent, 0, sizeof(struct buffer));
-	_new_ent->data = ((char *)_new_ent + sizeof(struct buffer));
-	return _new_ent;
-}
-
 static struct buffer *buffer_list_get_nonfull_alloc(struct buffer_list *self);
 static struct buffer *buffer_list_get_nonfull(struct buffer_list *self) {
 	struct buffer *rv = self->nonfull;
 	if (likely(rv != NULL)) {
 D		assert(!rv->full);
+		if (unlikely(rv->shared != NULL)) rv = buffer_list_unshare(self, rv);
+D		assert(atomic_load(&rv->refs) <= 1); // nobody else is reading it
 		return rv;
 	} else {
 		return buffer_list_get_nonfull_alloc(self);
@@ -149,11 +417,13 @@ D	assert(!rv->full);
 
 bool buffer_list_maybe_unshift_fake_buf(struct buffer_list *self,
                                         struct buffer *buf,
-                                        char *data) {
+                                        char *data,
+                                        size_t cap) {
 	if (unlikely(self->first != NULL)) return false;
 
 	memset(buf, 0, sizeof(struct buffer));
 	buf->data = data;
+	buf->cap = cap;
 
 	self->nonfull = buf;
 	self->first = buf;
@@ -164,6 +434,7 @@ bool buffer_list_maybe_unshift_fake_buf(struct buffer_list *self,
 
 void buffer_list_remove_fake_buf(struct buffer_list *self, struct buffer *buf) {
 D	assert(self->first == buf);
+	coalesce_clear(self);
 	self->first = buf->next;
 	if (likely(buf->next == NULL)) {
 		// this was the only buffer in the list
@@ -182,6 +453,72 @@ D		assert(self->last != buf);
 	}
 }
 
+// the buffers of "that" are shared, not copied, so it must not be written to
+//  afterwards (init_cfg never is). the last one only gets copied if something
+//  is written after it
+// moves the fake buffer's data (which is in cfgfs_read()'s output buffer) into
+//  a real one so that something else can be returned first
+__attribute__((cold))
+void buffer_list_unfake(struct buffer_list *self, struct buffer *buf) {
+D	assert(self->first == buf);
+	coalesce_clear(self);
+	if (buf->size == 0) {
+		buffer_list_remove_fake_buf(self, buf);
+		return;
+	}
+	struct buffer *ent = buffer_new();
+	memcpy(ent->data, buf->data, buf->size);
+	ent->size = buf->size;
+	ent->cap = buf->cap;
+	ent->full = buf->full;
+	ent->next = buf->next;
+	self->first = ent;
+	if (self->last == buf) self->last = ent;
+	if (self->nonfull == buf) self->nonfull = ent;
+}
+
+// moves whole lines from the start of the list to out+size, as many as fit in
+//  limit bytes. if anything is left in the list after that, an exec line is
+//  added so that the game comes back for it
+// returns the new size
+size_t buffer_list_top_up(struct buffer_list *self, char *out, size_t size, size_t limit) {
+	struct buffer *buf;
+	coalesce_clear(self);
+	while ((buf = self->first) != NULL) {
+		const char *p = buf->data;
+		size_t end = buf->size;
+		if (buf->full) end -= cfg_exec_next_cmd_len+1;
+		size_t off = 0;
+		while (off < end) {
+			const char *nl = memchr(p+off, '\n', end-off);
+			size_t len = (size_t)(nl-(p+off))+1;
+			// the very last line doesn't need room for an exec after it
+			bool last = (!buf->full && off+len == end);
+			size_t need = len + (last ? 0 : cfg_exec_next_cmd_len+1);
+			if (size+need > limit) goto partial;
+			memcpy(out+size, p+off, len);
+			size += len;
+			off += len;
+		}
+		buffer_free(buffer_list_grab_first(self));
+		continue;
+partial:
+		if (off != 0) {
+			if (buf->shared != NULL) {
+				// read-only, just point past it
+				buf->data = (char *)buf->data+off;
+			} else {
+				memmove(buf->data, (char *)buf->data+off, buf->size-off);
+			}
+			buf->size -= off;
+		}
+		memcpy(out+size, cfg_exec_next_cmd "\n", cfg_exec_next_cmd_len+1);
+		size += cfg_exec_next_cmd_len+1;
+		break;
+	}
+	return size;
+}
+
 __attribute__((cold)) // only used in _init()
 void buffer_list_append_from_that_to_this(struct buffer_list *self,
                                           const struct buffer_list *that) {
@@ -189,20 +526,43 @@ void buffer_list_append_from_that_to_this(struct buffer_list *self,
 
 	if (unlikely(buf == NULL || buf->size == 0)) return;
 
-	struct buffer *nonfull = buffer_list_get_nonfull(self);
-	if (nonfull->size != 0) {
+	coalesce_clear(self);
+
+	struct buffer *nonfull = self->nonfull;
+	if (nonfull != NULL &&
+	    nonfull->size == 0 &&
+	    nonfull->shared == NULL &&
+	    buf->size <= nonfull->cap) {
+		// nothing written to the current one yet (cfgfs_read()'s fake buffer
+		//  usually), the data has to end up in it anyway
+		buffer_copy_from_that_to_this(nonfull, buf);
+		if (!nonfull->full) return;
+		buf = buf->next;
+		if (buf == NULL || buf->size == 0) return;
+	} else if (nonfull != NULL) {
+		nonfull = buffer_list_get_nonfull(self);
 		buffer_make_full(nonfull);
-		self->nonfull = nonfull->next;
-		nonfull = buffer_list_get_next_for(self, nonfull);
 	}
+	self->nonfull = NULL;
 
 	for (;;) {
-		buffer_copy_from_that_to_this(nonfull, buf);
+		struct buffer *ent = buffer_new_shared(buf);
+		if (self->last != NULL) {
+			self->last->next = ent;
+		} else {
+			self->first = ent;
+		}
+		self->last = ent;
+		if (!ent->full) {
+			self->nonfull = ent;
+			break;
+		}
 		buf = buf->next;
-		if (buf == NULL || buf->size == 0) break;
-		assert(nonfull->full);
-		self->nonfull = nonfull->next;
-		nonfull = buffer_list_get_next_for(self, nonfull);
+		if (unlikely(buf == NULL || buf->size == 0)) {
+			// it ended with a full buffer and an empty one after it
+			buffer_list_get_next_for(self, ent);
+			break;
+		}
 	}
 }
 
@@ -220,6 +580,32 @@ D	assert(len <= max_line_length); // caller checks this
 D		assert(buffer_may_add_line(buf, len));
 	}
 	buffer_add_line(buf, s, len);
+	buf->updated = mono_ms();
+	coalesce_clear(self);
+}
+
+// copies as many whole lines at a time as fit in each buffer
+void buffer_list_write_lines(struct buffer_list *self, const char *s, size_t size) {
+	if (unlikely(size == 0)) return;
+	struct buffer *buf = buffer_list_get_nonfull(self);
+	for (;;) {
+		size_t room = buffer_space(buf);
+		// always leave room for the exec
+		room = (room > cfg_exec_next_cmd_len+1) ? room-(cfg_exec_next_cmd_len+1) : 0;
+		size_t n = size;
+		if (n > room) {
+			const char *nl = memrchr(s, '\n', room);
+			n = (nl != NULL) ? (size_t)(nl-s)+1 : 0;
+		}
+		memcpy((char *)buf->data+buf->size, s, n);
+		buf->size += n;
+		buf->updated = mono_ms();
+		s += n;
+		size -= n;
+		if (size == 0) break;
+		buf = buffer_list_write_wont_fit(self);
+	}
+	coalesce_clear(self);
 }
 
 // note: len does not include the newline
@@ -247,4 +633,230 @@ D	assert(self->last == buf); // nonfull so must've been the last one
 // note: sz here includes the newline
 void buffer_list_commit_write(struct buffer_list *self, size_t sz) {
 	self->nonfull->size += sz;
+	self->nonfull->updated = mono_ms();
+	coalesce_clear(self);
+}
+
+void buffer_list_commit_keyed_write(struct buffer_list *self,
+                                   size_t sz,
+                                   enum line_key_kind kind,
+                                   const char *key,
+                                   size_t keylen) {
+	struct coalesce_index *ci = self->coalesce;
+	struct buffer *nonfull = self->nonfull;
+	nonfull->updated = mono_ms();
+	if (likely(ci == NULL)) {
+		nonfull->size += sz;
+		return;
+	}
+
+	uint32_t hash = coalesce_hash(kind, key, keylen);
+	size_t i = hash & (COALESCE_SLOTS-1);
+	struct coalesce_entry *e;
+	for (;;) {
+		e = &ci->slots[i];
+		if (e->buf == NULL) break;
+		if (e->hash == hash &&
+		    e->kind == kind &&
+		    e->keylen == keylen &&
+		    0 == memcmp(ci->keys+e->keyoff, key, keylen)) {
+			// set again before the game read it, drop the old one
+			size_t end = (e->buf == nonfull) ? nonfull->size+sz : e->buf->size;
+			coalesce_remove_line(self, ci, e, end);
+			e->buf = nonfull;
+			e->off = (uint16_t)nonfull->size;
+			e->len = (uint16_t)sz;
+			nonfull->size += sz;
+			return;
+		}
+		i = (i+1) & (COALESCE_SLOTS-1);
+	}
+
+	if (unlikely(ci->count == COALESCE_MAX_ENTRIES ||
+	             ci->keys_used+keylen > COALESCE_KEYS_SIZE)) {
+		// full, start over
+		coalesce_clear(self);
+		i = hash & (COALESCE_SLOTS-1);
+		e = &ci->slots[i];
+	}
+	memcpy(ci->keys+ci->keys_used, key, keylen);
+	*e = (struct coalesce_entry){
+		.buf = nonfull,
+		.hash = hash,
+		.off = (uint16_t)nonfull->size,
+		.len = (uint16_t)sz,
+		.keyoff = (uint16_t)ci->keys_used,
+		.keylen = (uint16_t)keylen,
+		.kind = (uint8_t)kind,
+	};
+	ci->keys_used += keylen;
+	ci->count += 1;
+	nonfull->size += sz;
+}
+
+// -----------------------------------------------------------------------------
+
+// shedding
+
+enum line_category {
+	lc_other,
+	lc_echo,
+	lc_state,
+};
+
+struct shed_line {
+	const char *s;
+	size_t      len; // not including the newline
+	size_t      keylen; // key is s[0..keylen), like "alias name"
+	uint8_t     cat;
+	bool        stale;
+	bool        keep;
+};
+
+static enum line_category categorize_line(const char *s, size_t len, size_t *keylen) {
+	size_t wlen;
+	if (len > 4 && memcmp(s, "echo", 4) == 0 && (s[4] == '"' || s[4] == ' ')) {
+		return lc_echo;
+	} else if (len > 5 && memcmp(s, "alias", 5) == 0 && (s[5] == '"' || s[5] == ' ')) {
+		wlen = 5;
+	} else if (len > 4 && memcmp(s, "bind", 4) == 0 && (s[4] == '"' || s[4] == ' ')) {
+		wlen = 4;
+	} else {
+		return lc_other;
+	}
+	const char *p = s+wlen, *end = s+len;
+	if (*p == ' ') p++;
+	const char *name = p;
+	if (p < end && *p == '"') {
+		name = ++p;
+		while (p < end && *p != '"') p++;
+		if (p < end) p++;
+	} else {
+		while (p < end && *p != ' ' && *p != '"') p++;
+	}
+	// without a value it just prints the current one
+	if (p == name || p == end) return lc_other;
+	*keylen = (size_t)(p-s);
+	return lc_state;
+}
+
+// set of keys for merging. slots from an older generation count as empty so
+//  that it can be cleared without touching them
+struct key_set {
+	uint32_t *gen;
+	uint32_t *idx;
+	size_t    mask;
+	uint32_t  cur;
+};
+
+static bool key_set_check_add(struct key_set *ks, const struct shed_line *lines, uint32_t i) {
+	const struct shed_line *l = &lines[i];
+	uint32_t h = 2166136261u;
+	for (size_t j = 0; j < l->keylen; j++) h = (h ^ (unsigned char)l->s[j]) * 16777619u;
+	for (size_t slot = h & ks->mask;; slot = (slot+1) & ks->mask) {
+		if (ks->gen[slot] != ks->cur) {
+			ks->gen[slot] = ks->cur;
+			ks->idx[slot] = i;
+			return false;
+		}
+		const struct shed_line *o = &lines[ks->idx[slot]];
+		if (o->keylen == l->keylen && 0 == memcmp(o->s, l->s, l->keylen)) return true;
+	}
+}
+
+__attribute__((cold))
+void buffer_list_shed(struct buffer_list *self,
+                      const struct shed_policy *policy,
+                      struct shed_stats *stats) {
+	if (self->first == NULL) return;
+
+	// anything to do?
+	double now = mono_ms();
+	double stale_before = (policy->max_age_ms > 0.0) ? now-policy->max_age_ms : -INFINITY;
+	size_t total = 0, nlines_max = 0;
+	bool any_stale = false;
+	for (const struct buffer *buf = self->first; buf != NULL; buf = buf->next) {
+		total += buf->size;
+		nlines_max += buf->size/2+1;
+		if (buf->updated < stale_before) any_stale = true;
+	}
+	bool over = (policy->max_bytes != 0 && total > policy->max_bytes);
+	if (!over && !any_stale) return;
+
+	struct shed_line *lines = malloc(nlines_max*sizeof(struct shed_line));
+	if (unlikely(lines == NULL)) return;
+	size_t n = 0, nstate = 0;
+	for (const struct buffer *buf = self->first; buf != NULL; buf = buf->next) {
+		const char *p = buf->data;
+		const char *end = p+buf->size;
+		if (buf->full) end -= cfg_exec_next_cmd_len+1;
+		bool stale = over || buf->updated < stale_before;
+		while (p < end) {
+			const char *nl = memchr(p, '\n', (size_t)(end-p));
+			struct shed_line *l = &lines[n++];
+			l->s = p;
+			l->len = (size_t)(nl-p);
+			l->keylen = 0;
+			l->cat = (uint8_t)categorize_line(p, l->len, &l->keylen);
+			l->stale = stale;
+			l->keep = true;
+			if (stale) {
+				if (l->cat == lc_echo) l->keep = !policy->drop_echo;
+				if (l->cat == lc_other) l->keep = !policy->drop_other;
+			}
+			if (l->cat == lc_state) nstate++;
+			p = nl+1;
+		}
+	}
+
+	// merge: going backwards, a stale alias/bind is dropped if a later one
+	//  sets the same thing
+	if (policy->merge_state && nstate > 1) {
+		size_t cap = 16;
+		while (cap < nstate*2) cap *= 2;
+		struct key_set ks = {
+			.gen = calloc(cap, sizeof(uint32_t)),
+			.idx = malloc(cap*sizeof(uint32_t)),
+			.mask = cap-1,
+			.cur = 1,
+		};
+		if (likely(ks.gen != NULL && ks.idx != NULL)) {
+			for (size_t i = n; i-- > 0;) {
+				struct shed_line *l = &lines[i];
+				if (l->cat == lc_other && l->keep) {
+					ks.cur += 1; // clear
+				} else if (l->cat == lc_state) {
+					if (key_set_check_add(&ks, lines, (uint32_t)i) && l->stale) {
+						l->keep = false;
+					}
+				}
+			}
+		}
+		free(ks.gen);
+		free(ks.idx);
+	}
+
+	// rebuild the list from what's left
+	size_t dropped = 0;
+	for (size_t i = 0; i < n; i++) dropped += !lines[i].keep;
+	if (dropped != 0) {
+		struct buffer_list kept = {0};
+		for (size_t i = 0; i < n; i++) {
+			const struct shed_line *l = &lines[i];
+			if (l->keep) {
+				buffer_list_write_line(&kept, l->s, l->len);
+				continue;
+			}
+			stats->bytes += l->len+1;
+			switch (l->cat) {
+			case lc_echo: stats->echo_dropped += 1; break;
+			case lc_state: stats->state_merged += 1; break;
+			default: stats->other_dropped += 1; break;
+			}
+		}
+		buffer_list_swap(self, &kept);
+		buffer_list_reset(&kept);
+		stats->runs += 1;
+	}
+	free(lines);
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,9 +9,16 @@
 
 struct buffer {
 	size_t         size;
+	size_t         cap; // how much it can be filled up to
 	bool           full;
 	void          *data;
-	struct buffer *next;
+	struct buffer *next; // also the free list link when in the pool
+	// if not NULL, data points into this buffer's data and is read-only
+	// (see buffer_list_append_from_that_to_this())
+	struct buffer *shared;
+	_Atomic(unsigned int) refs;
+	double         created; // mono_ms()
+	double         updated; // mono_ms() of the last line written to it
 };
 
 static inline size_t buffer_get_size(const struct buffer *self) {
@@ -23,22 +31,36 @@ static inline void buffer_memcpy_to(const struct buffer *self,
 	memcpy(buf, self->data, sz);
 }
 
-static inline void buffer_free(struct buffer *self) {
-	free(self);
-}
+// drops a reference to the buffer, giving it back to the pool if it was the
+//  last one
+// doesn't need the lua lock
+void buffer_free(struct buffer *self);
+
+struct buffer_pool_stats {
+	size_t capacity;        // buffers in the pool
+	size_t in_use;          // pool buffers currently in some list (or being read)
+	size_t high_water;      // max in_use
+	size_t overflows;       // buffers malloc'd because the pool was empty
+	size_t overflow_in_use; // of those, ones that haven't been freed yet
+};
+void buffer_pool_get_stats(struct buffer_pool_stats *out);
 
 void buffer_make_full(struct buffer *self);
 
 // -----------------------------------------------------------------------------
 
+struct coalesce_index;
+
 struct buffer_list {
 	struct buffer *nonfull;
 	struct buffer *first;
 	struct buffer *last;
+	struct coalesce_index *coalesce; // NULL unless coalescing is enabled
 };
 
-bool buffer_list_maybe_unshift_fake_buf(struct buffer_list *self, struct buffer *buf, char *data);
+bool buffer_list_maybe_unshift_fake_buf(struct buffer_list *self, struct buffer *buf, char *data, size_t cap);
 void buffer_list_remove_fake_buf(struct buffer_list *self, struct buffer *buf);
+void buffer_list_unfake(struct buffer_list *self, struct buffer *buf);
 struct buffer *buffer_list_grab_first(struct buffer_list *self);
 
 void buffer_list_append_from_that_to_this(struct buffer_list *self, const struct buffer_list *that);
@@ -55,6 +77,72 @@ static inline bool buffer_list_is_empty(const struct buffer_list *self) {
 // -----------------------------------------------------------------------------
 
 void buffer_list_write_line(struct buffer_list *self, const char *s, size_t len);
+// s is any number of lines that each end with a newline
+void buffer_list_write_lines(struct buffer_list *self, const char *s, size_t size);
 
 char *buffer_list_get_write_buffer(struct buffer_list *self, size_t len);
 void buffer_list_commit_write(struct buffer_list *self, size_t sz);
+
+// -----------------------------------------------------------------------------
+
+// coalescing: a line that sets something (a cvar, alias or bind) replaces an
+//  earlier unread line that set the same thing, as long as only other such
+//  lines were written in between. any other line could look at the old value,
+//  so it ends the run
+
+enum line_key_kind {
+	lk_cvar = 1,
+	lk_alias = 2,
+	lk_bind = 3,
+};
+
+void buffer_list_set_coalescing(struct buffer_list *self, bool enabled);
+
+// like buffer_list_commit_write() but for a line that sets "key"
+void buffer_list_commit_keyed_write(struct buffer_list *self,
+                                   size_t sz,
+                                   enum line_key_kind kind,
+                                   const char *key,
+                                   size_t keylen);
+
+// -----------------------------------------------------------------------------
+
+// shedding: thins out a backlog that the game hasn't read for a while (on
+//  linux nothing reads it while the game window isn't active)
+// lines in buffers last written to more than max_age_ms ago are stale. if the
+//  whole list is over max_bytes, everything is. stale lines are handled by
+//  category:
+// - echo: dropped if drop_echo
+// - alias/bind: only the last one of each name is kept if merge_state (but
+//   not across other commands that are kept, they could be using it)
+// - anything else: dropped if drop_other
+
+struct shed_policy {
+	double max_age_ms; // 0 = no limit
+	size_t max_bytes;  // 0 = no limit
+	bool   drop_echo;
+	bool   merge_state;
+	bool   drop_other;
+};
+
+struct shed_stats {
+	size_t runs;
+	size_t echo_dropped;
+	size_t state_merged;
+	size_t other_dropped;
+	size_t bytes;
+};
+
+void buffer_list_shed(struct buffer_list *self,
+                      const struct shed_policy *policy,
+                      struct shed_stats *stats);
+
+// -----------------------------------------------------------------------------
+
+struct coalesce_stats {
+	size_t lines; // lines eliminated
+	size_t bytes;
+};
+void buffer_list_get_coalesce_stats(const struct buffer_list *self, struct coalesce_stats *out);
+
+size_t buffer_list_top_up(struct buffer_list *self, char *out, size_t size, size_t limit);
@@ -1,25 +1,434 @@
 #include "buffers.h"
 
+#include <string.h>
+#include <time.h>
+
 #include <lua.h>
 
+#include "intern.h"
+#include "macros.h"
+#include "main.h"
+
 struct buffer_list buffers;
+struct buffer_list urgent_buffers;
 struct buffer_list init_cfg;
 
+struct buffer_list *write_buffers = &buffers;
+
+// -----------------------------------------------------------------------------
+
+struct lane_stats {
+	size_t reads;
+	double max_wait_ms; // longest time a buffer waited to be read
+};
+
+static struct lane_stats urgent_stats;
+static struct lane_stats bulk_stats;
+
+static inline void note_read(struct lane_stats *st, const struct buffer *ent) {
+	st->reads += 1;
+	if (likely(ent->created != 0.0)) {
+		double waited = mono_ms()-ent->created;
+		if (waited > st->max_wait_ms) st->max_wait_ms = waited;
+	}
+}
+
+static bool have_shed_policy;
+static struct shed_policy shed_policy;
+static struct shed_stats shed_stats;
+
+// called by cfgfs_read() before anything else touches the buffers
+void buffers_apply_backlog_policy(void) {
+	if (unlikely(have_shed_policy) && buffers.first != NULL && buffers.first->next != NULL) {
+		buffer_list_shed(&buffers, &shed_policy, &shed_stats);
+	}
+}
+
+// gets the next config's worth of data for cfgfs_read()
+// if the urgent lane has anything, its first buffer is returned and the rest
+//  of the space is filled up from the bulk lane. the result is then written
+//  to out and fakebuf is returned, pointing to it
+// otherwise it's the same as buffer_list_grab_first(&buffers) (the caller
+//  copies the data to out and frees it if it's not fakebuf)
+// fakebuf is the one that cfgfs_read() passed to
+//  buffer_list_maybe_unshift_fake_buf(&buffers, ...) (it might not be used)
+// at most limit bytes are returned. buffers made before the config size was
+//  lowered can be bigger than that, those are split up
+struct buffer *buffers_grab_for_read(char *out, struct buffer *fakebuf, size_t limit) {
+	size_t size;
+	if (likely(buffer_list_is_empty(&urgent_buffers))) {
+		struct buffer *first = buffers.first;
+		if (likely(first == NULL || buffer_get_size(first) <= limit)) {
+			struct buffer *ent = buffer_list_grab_first(&buffers);
+			if (likely(ent != NULL)) note_read(&bulk_stats, ent);
+			return ent;
+		}
+		note_read(&bulk_stats, first);
+		size = buffer_list_top_up(&buffers, out, 0, limit);
+		goto out;
+	}
+
+	// the fake buffer's data is already in out, get it out of the way
+	if (buffers.first == fakebuf) buffer_list_unfake(&buffers, fakebuf);
+
+	struct buffer *first = urgent_buffers.first;
+	note_read(&urgent_stats, first);
+	bool full;
+	if (likely(buffer_get_size(first) <= limit)) {
+		struct buffer *ent = buffer_list_grab_first(&urgent_buffers);
+		size = buffer_get_size(ent);
+		full = ent->full;
+		buffer_memcpy_to(ent, out, size);
+		buffer_free(ent);
+	} else {
+		size = buffer_list_top_up(&urgent_buffers, out, 0, limit);
+		// it only leaves something behind if it added an exec
+		full = !buffer_list_is_empty(&urgent_buffers);
+	}
+
+	// a full one ends with an exec, there's more urgent stuff after it
+	if (!full && !buffer_list_is_empty(&buffers)) {
+		first = buffers.first;
+		size_t newsize = buffer_list_top_up(&buffers, out, size, limit);
+		if (newsize != size) note_read(&bulk_stats, first);
+		size = newsize;
+	}
+
+out:
+	memset(fakebuf, 0, sizeof(struct buffer));
+	fakebuf->data = out;
+	fakebuf->size = size;
+	return fakebuf;
+}
+
+// -----------------------------------------------------------------------------
+
+// the size of the configs can be changed at runtime. with a bigger one a
+//  backlog gets to the game in fewer reads (each one costs at least a frame)
+//  but the game's command buffer only takes so much at once
+// in adaptive mode it's doubled while there's a backlog, as long as that gets
+//  more bytes through per millisecond. it goes back to the base size once the
+//  backlog is gone
+_Atomic(size_t) live_cfg_size = default_reported_cfg_size;
+
+// backlogged reads to measure before deciding to grow again
+#define ADAPT_SAMPLES 4
+
+static struct {
+	size_t base; // what _set_cfg_size() asked for
+	size_t ceiling; // adaptive mode doesn't go over this
+	bool   adaptive;
+
+	// measurements in adaptive mode
+	unsigned samples; // backlogged reads since the last change
+	unsigned short_reads; // reads in a row smaller than the live size
+	double   last_read_ms;
+	double   interval_ema; // ms between backlogged reads
+	double   rate_before_grow; // bytes per ms before the last grow
+	size_t   grew_from;
+
+	// stats
+	size_t grows;
+	size_t reverts;
+	size_t overflows;
+	size_t last_read_size;
+} cfg_size = {
+	.base = default_reported_cfg_size,
+	.ceiling = max_reported_cfg_size,
+};
+
+static void set_live_cfg_size(size_t size) {
+	atomic_store_explicit(&live_cfg_size, size, memory_order_relaxed);
+	cfg_size.samples = 0;
+	cfg_size.interval_ema = 0.0;
+}
+
+static void adapt_reset(void) {
+	cfg_size.grew_from = 0;
+	cfg_size.short_reads = 0;
+	set_live_cfg_size(cfg_size.base);
+}
+
+// called by cfgfs_read() after each read of a config with the size that the
+//  game asked for
+void buffers_note_read(size_t read_size) {
+	cfg_size.last_read_size = read_size;
+	if (likely(!cfg_size.adaptive)) return;
+
+	size_t live = reported_cfg_size;
+	double now = mono_ms();
+	double interval = now-exchange(cfg_size.last_read_ms, now);
+
+	// the game reads what getattr() said, unless it has its own limit. one
+	//  short read can just be a getattr() from before the last change
+	if (read_size < live) {
+		if (++cfg_size.short_reads >= 2) {
+			cfg_size.ceiling = (read_size > cfg_size.base) ? read_size : cfg_size.base;
+			set_live_cfg_size(cfg_size.ceiling);
+		}
+		return;
+	}
+	cfg_size.short_reads = 0;
+
+	if (buffers_are_empty()) {
+		if (live != cfg_size.base) adapt_reset();
+		return;
+	}
+
+	// the first interval after a change still has the old size in it
+	if (cfg_size.samples++ == 0) return;
+	cfg_size.interval_ema = (cfg_size.interval_ema != 0.0)
+	    ? cfg_size.interval_ema*0.75 + interval*0.25
+	    : interval;
+	if (cfg_size.samples <= ADAPT_SAMPLES) return;
+
+	double rate = (double)live/(cfg_size.interval_ema+1.0);
+	if (cfg_size.grew_from != 0 && rate < cfg_size.rate_before_grow*1.1) {
+		// reads got slower by about as much as they got bigger, go back
+		//  and stay there
+		cfg_size.reverts += 1;
+		cfg_size.ceiling = exchange(cfg_size.grew_from, 0);
+		set_live_cfg_size(cfg_size.ceiling);
+		return;
+	}
+	if (live < cfg_size.ceiling) {
+		cfg_size.grows += 1;
+		cfg_size.rate_before_grow = rate;
+		cfg_size.grew_from = live;
+		set_live_cfg_size((live*2 < cfg_size.ceiling) ? live*2 : cfg_size.ceiling);
+		return;
+	}
+	cfg_size.grew_from = 0;
+}
+
+__attribute__((cold))
+static size_t check_cfg_size(lua_State *L, int arg) {
+	lua_Integer n = luaL_checkinteger(L, arg);
+	luaL_argcheck(L,
+	    n >= (lua_Integer)min_reported_cfg_size && n <= (lua_Integer)max_reported_cfg_size,
+	    arg,
+	    "config size out of range");
+	return (size_t)n;
+}
+
+// _set_cfg_size(n) or _set_cfg_size(nil) for the default
+// must be between _cfg_size_stats().min and .max
+static int l_set_cfg_size(lua_State *L) {
+	cfg_size.base = lua_isnoneornil(L, 1) ? default_reported_cfg_size : check_cfg_size(L, 1);
+	if (cfg_size.ceiling < cfg_size.base) cfg_size.ceiling = cfg_size.base;
+	adapt_reset();
+	return 0;
+}
+
+// _set_cfg_size_adaptive(enabled, ceiling)
+static int l_set_cfg_size_adaptive(lua_State *L) {
+	cfg_size.adaptive = lua_toboolean(L, 1);
+	cfg_size.ceiling = lua_isnoneornil(L, 2) ? max_reported_cfg_size : check_cfg_size(L, 2);
+	if (cfg_size.ceiling < cfg_size.base) cfg_size.ceiling = cfg_size.base;
+	cfg_size.last_read_ms = mono_ms();
+	adapt_reset();
+	return 0;
+}
+
+// _cfg_size_overflow()
+// the game said that its command buffer overflowed, halve the size and don't
+//  go over that again
+static int l_cfg_size_overflow(lua_State *L) {
+	(void)L;
+	cfg_size.overflows += 1;
+	size_t size = reported_cfg_size/2;
+	if (size < min_reported_cfg_size) size = min_reported_cfg_size;
+	cfg_size.ceiling = size;
+	if (cfg_size.base > size) cfg_size.base = size;
+	cfg_size.grew_from = 0;
+	set_live_cfg_size(size);
+	return 0;
+}
+
+// _cfg_size_stats() -> table
+static int l_cfg_size_stats(lua_State *L) {
+	lua_createtable(L, 0, 10);
+	 lua_pushinteger(L, (lua_Integer)reported_cfg_size);
+	 lua_setfield(L, -2, "size");
+	 lua_pushinteger(L, (lua_Integer)cfg_size.base);
+	 lua_setfield(L, -2, "base");
+	 lua_pushinteger(L, (lua_Integer)cfg_size.ceiling);
+	 lua_setfield(L, -2, "ceiling");
+	 lua_pushinteger(L, (lua_Integer)min_reported_cfg_size);
+	 lua_setfield(L, -2, "min");
+	 lua_pushinteger(L, (lua_Integer)max_reported_cfg_size);
+	 lua_setfield(L, -2, "max");
+	 lua_pushboolean(L, cfg_size.adaptive);
+	 lua_setfield(L, -2, "adaptive");
+	 lua_pushinteger(L, (lua_Integer)cfg_size.last_read_size);
+	 lua_setfield(L, -2, "last_read_size");
+	 lua_pushinteger(L, (lua_Integer)cfg_size.grows);
+	 lua_setfield(L, -2, "grows");
+	 lua_pushinteger(L, (lua_Integer)cfg_size.reverts);
+	 lua_setfield(L, -2, "reverts");
+	 lua_pushinteger(L, (lua_Integer)cfg_size.overflows);
+	 lua_setfield(L, -2, "overflows");
+	return 1;
+}
+
+// -----------------------------------------------------------------------------
+
 // copies init_cfg to the buffer
 static int l_init(lua_State *L) {
 	(void)L;
+	// the game is (re)starting, it doesn't have the interned aliases
+	intern_reset();
 	buffer_list_append_from_that_to_this(&buffers, &init_cfg);
 	return 0;
 }
 
 __attribute__((minsize))
 static int l_buffer_is_empty(lua_State *L) {
-	lua_pushboolean(L, buffer_list_is_empty(&buffers));
+	lua_pushboolean(L, buffers_are_empty());
+	return 1;
+}
+
+// _buffer_pool_stats() -> table
+static int l_buffer_pool_stats(lua_State *L) {
+	struct buffer_pool_stats st;
+	buffer_pool_get_stats(&st);
+	lua_createtable(L, 0, 5);
+	 lua_pushinteger(L, (lua_Integer)st.capacity);
+	 lua_setfield(L, -2, "capacity");
+	 lua_pushinteger(L, (lua_Integer)st.in_use);
+	 lua_setfield(L, -2, "in_use");
+	 lua_pushinteger(L, (lua_Integer)st.high_water);
+	 lua_setfield(L, -2, "high_water");
+	 lua_pushinteger(L, (lua_Integer)st.overflows);
+	 lua_setfield(L, -2, "overflows");
+	 lua_pushinteger(L, (lua_Integer)st.overflow_in_use);
+	 lua_setfield(L, -2, "overflow_in_use");
+	return 1;
+}
+
+static inline const char *lane_name(void) {
+	return (write_buffers == &urgent_buffers) ? "urgent" : "bulk";
+}
+
+// _get_lane() -> 'urgent' or 'bulk'
+static int l_get_lane(lua_State *L) {
+	lua_pushstring(L, lane_name());
+	return 1;
+}
+
+// _set_lane('urgent' or 'bulk') -> previous lane
+// cfgfs_read() sets it back to bulk after each read
+static int l_set_lane(lua_State *L) {
+	static const char *const names[] = {"bulk", "urgent", NULL};
+	int lane = luaL_checkoption(L, 1, NULL, names);
+	lua_pushstring(L, lane_name());
+	write_buffers = (lane == 1) ? &urgent_buffers : &buffers;
+	return 1;
+}
+
+static void push_lane_stats(lua_State *L,
+                            const struct buffer_list *bl,
+                            const struct lane_stats *st) {
+	size_t nbufs = 0, bytes = 0;
+	for (const struct buffer *p = bl->first; p != NULL; p = p->next) {
+		nbufs += 1;
+		bytes += buffer_get_size(p);
+	}
+	double age = 0.0;
+	if (bl->first != NULL && bl->first->created != 0.0) {
+		age = mono_ms()-bl->first->created;
+	}
+	lua_createtable(L, 0, 5);
+	 lua_pushinteger(L, (lua_Integer)nbufs);
+	 lua_setfield(L, -2, "buffers");
+	 lua_pushinteger(L, (lua_Integer)bytes);
+	 lua_setfield(L, -2, "bytes");
+	 lua_pushnumber(L, age);
+	 lua_setfield(L, -2, "age_ms");
+	 lua_pushinteger(L, (lua_Integer)st->reads);
+	 lua_setfield(L, -2, "reads");
+	 lua_pushnumber(L, st->max_wait_ms);
+	 lua_setfield(L, -2, "max_wait_ms");
+}
+
+// _buffer_lane_stats() -> {urgent = {...}, bulk = {...}}
+static int l_buffer_lane_stats(lua_State *L) {
+	lua_createtable(L, 0, 2);
+	 push_lane_stats(L, &urgent_buffers, &urgent_stats);
+	 lua_setfield(L, -2, "urgent");
+	 push_lane_stats(L, &buffers, &bulk_stats);
+	 lua_setfield(L, -2, "bulk");
+	return 1;
+}
+
+// _set_coalescing(enabled)
+// makes repeated cvar/alias/bind sets in the bulk lane replace each other
+//  until the game reads them
+static int l_set_coalescing(lua_State *L) {
+	buffer_list_set_coalescing(&buffers, lua_toboolean(L, 1));
+	return 0;
+}
+
+// _coalesce_stats() -> {lines = n, bytes = n}
+static int l_coalesce_stats(lua_State *L) {
+	struct coalesce_stats st;
+	buffer_list_get_coalesce_stats(&buffers, &st);
+	lua_createtable(L, 0, 2);
+	 lua_pushinteger(L, (lua_Integer)st.lines);
+	 lua_setfield(L, -2, "lines");
+	 lua_pushinteger(L, (lua_Integer)st.bytes);
+	 lua_setfield(L, -2, "bytes");
+	return 1;
+}
+
+// _set_backlog_policy(max_age_ms, max_bytes, drop_echo, merge_state, drop_other)
+// _set_backlog_policy(nil) turns it off
+static int l_set_backlog_policy(lua_State *L) {
+	if (lua_isnoneornil(L, 1)) {
+		have_shed_policy = false;
+		return 0;
+	}
+	shed_policy = (struct shed_policy){
+		.max_age_ms = luaL_checknumber(L, 1),
+		.max_bytes = (size_t)luaL_optinteger(L, 2, 0),
+		.drop_echo = lua_toboolean(L, 3),
+		.merge_state = lua_toboolean(L, 4),
+		.drop_other = lua_toboolean(L, 5),
+	};
+	have_shed_policy = true;
+	return 0;
+}
+
+// _backlog_stats() -> table
+static int l_backlog_stats(lua_State *L) {
+	lua_createtable(L, 0, 5);
+	 lua_pushinteger(L, (lua_Integer)shed_stats.runs);
+	 lua_setfield(L, -2, "runs");
+	 lua_pushinteger(L, (lua_Integer)shed_stats.echo_dropped);
+	 lua_setfield(L, -2, "echo_dropped");
+	 lua_pushinteger(L, (lua_Integer)shed_stats.state_merged);
+	 lua_setfield(L, -2, "state_merged");
+	 lua_pushinteger(L, (lua_Integer)shed_stats.other_dropped);
+	 lua_setfield(L, -2, "other_dropped");
+	 lua_pushinteger(L, (lua_Integer)shed_stats.bytes);
+	 lua_setfield(L, -2, "bytes");
 	return 1;
 }
 
 const luaL_Reg l_buffers_fns[] = {
 	{"_init", l_init},
 	{"_buffer_is_empty", l_buffer_is_empty},
+	{"_buffer_pool_stats", l_buffer_pool_stats},
+	{"_get_lane", l_get_lane},
+	{"_set_lane", l_set_lane},
+	{"_buffer_lane_stats", l_buffer_lane_stats},
+	{"_set_coalescing", l_set_coalescing},
+	{"_coalesce_stats", l_coalesce_stats},
+	{"_set_backlog_policy", l_set_backlog_policy},
+	{"_backlog_stats", l_backlog_stats},
+	{"_set_cfg_size", l_set_cfg_size},
+	{"_set_cfg_size_adaptive", l_set_cfg_size_adaptive},
+	{"_cfg_size_overflow", l_cfg_size_overflow},
+	{"_cfg_size_stats", l_cfg_size_stats},
 	{NULL, NULL},
 };
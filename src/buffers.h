@@ -3,8 +3,30 @@
 #include <lauxlib.h>
 
 #include "buffer_list.h"
+#include "cfg.h"
 
-extern struct buffer_list buffers;
+// there are two lanes for output: urgent (keybinds) and bulk (everything
+//  else). cfgfs_read() returns the urgent one first
+extern struct buffer_list buffers; // bulk
+extern struct buffer_list urgent_buffers;
 extern struct buffer_list init_cfg;
 
+// the lane that cmd/cfg write to
+extern struct buffer_list *write_buffers;
+
+// commands from cfg_emit() count too, so that lua_unlock_state() clicks for
+//  them if the one from cfg_emit() was dropped
+static inline bool buffers_are_empty(void) {
+	return buffer_list_is_empty(&urgent_buffers) && buffer_list_is_empty(&buffers) &&
+	       !cfg_emit_pending();
+}
+
+static inline void buffers_reset_lane(void) {
+	write_buffers = &buffers;
+}
+
+void buffers_apply_backlog_policy(void);
+struct buffer *buffers_grab_for_read(char *out, struct buffer *fakebuf, size_t limit);
+void buffers_note_read(size_t read_size);
+
 extern const luaL_Reg l_buffers_fns[];
@@ -1,61 +1,22 @@
 #include "cfg.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <lauxlib.h>
 
 #include "buffers.h"
+#include "charclass.h"
 #include "cli_output.h"
+#include "click.h"
+#include "intern.h"
 #include "lua.h"
 #include "macros.h"
 
 // -----------------------------------------------------------------------------
 
-enum wordflags {
-	wf_none = 0,
-	wf_needs_quotes = 1,
-	// https://s2.desu-usergeneratedcontent.xyz/int/image/1461/31/1461314883561.jpg
-	wf_contains_evil_char = 2,
-};
-
-static unsigned char charflags[256];
-
-__attribute__((minsize))
-void cfg_init_badchars(void) {
-#define set_range(s, e, f) {.first = s, .length = (e-s)+1, .flags = f}
-#define set(n, f) set_range(n, n, f)
-	static const struct spec  {
-		unsigned char first, length, flags;
-	} s[] = {
-		set_range(0, 32, wf_needs_quotes),
-		set_range(39, 41, wf_needs_quotes),
-		set(47, wf_needs_quotes),
-		set_range(58, 59, wf_needs_quotes),
-		set(123, wf_needs_quotes),
-		set_range(125, 255, wf_needs_quotes),
-
-		// 0: null byte, game can't read this -> replaced with 0x7F (DEL)
-		// 1-31 excluding 9: game treats these as newlines -> replaced with 0x7F (DEL)
-		// 34: double quote, can't be quoted itself -> replaced with a single quote
-		set_range(0, 31, wf_needs_quotes|wf_contains_evil_char),
-		set(9, wf_needs_quotes),
-		set(34, wf_contains_evil_char),
-	};
-#undef set_range
-#undef set
-
-#define ARRAYEND(a) ((a)+(sizeof(a)/sizeof(*(a))))
-	const struct spec *p = s;
-	while (p != ARRAYEND(s)) {
-		memset(charflags+p->first, p->flags, p->length);
-		p++;
-	}
-#undef ARRAYEND
-}
-
-// ~
-
 struct worddata {
 	size_t len;
 	const char *s;
@@ -80,6 +41,7 @@ enum quoting_mode {
 	qm_echo = 2,
 };
 
+static void cmd_word_set(struct worddata *w, const char *s, size_t len);
 static size_t cmd_preparse(lua_State *L, int argc, struct worddata *words);
 static enum quoting_mode cmd_get_quoting_mode(int argc, const struct worddata *words);
 static size_t cmd_get_outsize(int argc, const struct worddata *words, size_t total_len, enum quoting_mode mode);
@@ -88,8 +50,32 @@ static size_t cmd_stringify(char *buf, int argc, const struct worddata *words, e
 static struct worddata g_words[max_argc];
 static char stringify_outbuf[max_line_length+1];
 
-static int l_cmd(lua_State *L) {
-	int argc = lua_gettop(L)-1; // ignore first arg (it's the cmd table)
+// what the command sets, for coalescing (see buffer_list.h)
+// returns 0 if it's not something that can be coalesced
+static enum line_key_kind cmd_get_key(int argc,
+                                      const struct worddata *words,
+                                      bool is_cvar_set,
+                                      const struct worddata **key) {
+	if (is_cvar_set) {
+		*key = &words[0];
+		return lk_cvar;
+	}
+	// "alias x" and "bind x" with no value print the current one
+	if (argc >= 3) {
+		if (words[0].len == 5 && memcmp(words[0].s, "alias", 5) == 0) {
+			*key = &words[1];
+			return lk_alias;
+		}
+		if (words[0].len == 4 && memcmp(words[0].s, "bind", 4) == 0) {
+			*key = &words[1];
+			return lk_bind;
+		}
+	}
+	return 0;
+}
+
+// writes the command made of the top argc values on the stack
+static int cmd_write(lua_State *L, int argc, bool is_cvar_set) {
 	if (unlikely(argc <= 0)) return 0;
 	if (unlikely(argc > max_argc)) goto err_toomany;
 	struct worddata *words = g_words;
@@ -98,11 +84,27 @@ static int l_cmd(lua_State *L) {
 	enum quoting_mode mode = cmd_get_quoting_mode(argc, words);
 	size_t outsize = cmd_get_outsize(argc, words, total_len, mode);
 	if (unlikely(outsize > max_line_length)) goto err_toolong;
-	char *buf = buffer_list_get_write_buffer(&buffers, outsize);
+	const struct worddata *key;
+	enum line_key_kind kind = 0;
+	if (unlikely(write_buffers->coalesce != NULL)) {
+		kind = cmd_get_key(argc, words, is_cvar_set, &key);
+	}
+	if (unlikely(intern_enabled) && kind == 0) {
+		// it might not be written as is, so it can't go in the buffer
+		//  directly
+		size_t wrote = cmd_stringify(stringify_outbuf, argc, words, mode);
+		intern_write_line(write_buffers, stringify_outbuf, wrote);
+		return 0;
+	}
+	char *buf = buffer_list_get_write_buffer(write_buffers, outsize);
 	size_t wrote = cmd_stringify(buf, argc, words, mode);
 	assert(wrote == outsize);
 	buf[wrote++] = '\n';
-	buffer_list_commit_write(&buffers, wrote);
+	if (unlikely(kind != 0)) {
+		buffer_list_commit_keyed_write(write_buffers, wrote, kind, key->s, key->len);
+	} else {
+		buffer_list_commit_write(write_buffers, wrote);
+	}
 	return 0;
 err_toomany:
 	return luaL_error(L, "cmd: too many arguments");
@@ -112,6 +114,18 @@ err_toolong:
 	return luaL_error(L, "cmd: command too long");
 }
 
+static int l_cmd(lua_State *L) {
+	return cmd_write(L, lua_gettop(L)-1, false); // ignore first arg (it's the cmd table)
+}
+
+// _cvar_set(name, value)
+// same as cmd(name, value) but tells coalescing that it's a cvar
+static int l_cvar_set(lua_State *L) {
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+	return cmd_write(L, 2, true);
+}
+
 static int l_cmd_stringify(lua_State *L) {
 	const char *errmsg;
 	int argc = lua_gettop(L);
@@ -146,6 +160,14 @@ error:
 	return 2;
 }
 
+static inline void cmd_word_set(struct worddata *restrict w,
+                                const char *s,
+                                size_t len) {
+	w->s = s;
+	w->len = len;
+	w->flags = likely(len > 0) ? charclass_scan(s, len) : wf_needs_quotes;
+}
+
 /*
  * gets the words from lua, finds out flags for each one and sums up their total lengths
  */
@@ -158,18 +180,7 @@ static size_t cmd_preparse(lua_State *restrict L,
 		size_t len;
 		const char *s = lua_tolstring(L, i-argc, &len);
 		if (unlikely(!s)) goto err;
-		enum wordflags flags;
-		if (likely(len > 0)) {
-			flags = 0;
-			for (const char *p = s; p != s+len; p++) {
-				flags |= charflags[(unsigned char)*p];
-			}
-		} else {
-			flags = wf_needs_quotes;
-		}
-		words->s = s;
-		words->len = len;
-		words->flags = flags;
+		cmd_word_set(words, s, len);
 		words++;
 		total_len += len;
 	}
@@ -231,21 +242,14 @@ static size_t cmd_get_outsize(int argc,
 	return total_len;
 }
 
-__attribute__((cold))
-__attribute__((noinline))
-static void cmd_replace_evil_chars(unsigned char *restrict buf,
-                                   size_t sz,
-                                   enum quoting_mode mode) {
-	unsafe_optimization_hint(sz != 0);
-	switch (mode) {
-	case qm_default:
-	case qm_echo:
-	case qm_say:
-		for (size_t i = 0; i < sz; i++) {
-			if (buf[i] < 32 && buf[i] != 9) buf[i] = /*DEL*/ 0x7f;
-			if (buf[i] == '"' && mode != qm_say) buf[i] = '\'';
-		}
-		break;
+// copies the word to buf and replaces any evil characters on the way
+static inline void cmd_copy_word(char *restrict buf,
+                                 const struct worddata *restrict w,
+                                 enum quoting_mode mode) {
+	if (likely(!(w->flags&wf_contains_evil_char))) {
+		memcpy(buf, w->s, w->len);
+	} else {
+		charclass_copy_replace(buf, w->s, w->len, (mode == qm_say));
 	}
 }
 
@@ -258,42 +262,28 @@ static size_t cmd_stringify(char *restrict buf,
 	switch (mode) {
 	case qm_default:
 		for (const struct worddata *w = words; w != words+argc; w++) {
-			const char *s = w->s;
 			if (!(w->flags&wf_needs_quotes)) {
 				if (w != words && *(buf-1) != '"') {
 					*buf++ = ' ';
 				}
-				memcpy(buf, s, w->len);
+				cmd_copy_word(buf, w, mode);
 				buf += w->len;
 			} else {
 				*buf++ = '"';
-				memcpy(buf, s, w->len);
+				cmd_copy_word(buf, w, mode);
 				buf += w->len;
 				if (w != words+(argc-1)) {
 					*buf++ = '"';
 				}
 			}
-			if (unlikely(w->flags&wf_contains_evil_char)) {
-				char *buf_ = buf-w->len;
-				if (w != words+(argc-1) && w->flags&wf_needs_quotes) {
-					buf_ -= 1; // closing quote
-				}
-				cmd_replace_evil_chars((unsigned char *)buf_, w->len, mode);
-			}
 		}
 		break;
 	case qm_say:
 	case qm_echo: {
 		for (const struct worddata *w = words; w != words+argc; w++) {
-			memcpy(buf, w->s, w->len);
+			cmd_copy_word(buf, w, mode);
 			buf += w->len;
 			*buf++ = (w == words) ? '"' : ' ';
-			if (unlikely(w->flags&wf_contains_evil_char)) {
-				cmd_replace_evil_chars(
-				    (unsigned char *)buf-(1+w->len),
-				    w->len,
-				    mode);
-			}
 		}
 		buf -= 1; // rewind to the last separator
 D		assert(mode == qm_say || mode == qm_echo);
@@ -310,7 +300,11 @@ D		assert(mode == qm_say || mode == qm_echo);
 static void cfg(lua_State *L, const char *s, size_t len) {
 	if (unlikely(len == 0)) return;
 	if (unlikely(len > max_line_length)) goto toolong;
-	buffer_list_write_line(&buffers, s, len);
+	if (unlikely(intern_enabled)) {
+		intern_write_line(write_buffers, s, len);
+	} else {
+		buffer_list_write_line(write_buffers, s, len);
+	}
 	return;
 toolong:
 	luaL_error(L, "cfg: line too long");
@@ -338,9 +332,272 @@ static int l_cfg(lua_State *L) {
 
 // -----------------------------------------------------------------------------
 
+// batches: the lines are put together here first and then written to the
+//  buffer in as few copies as possible. nothing gets written if one of them is
+//  bad
+
+static struct {
+	char  *data;
+	size_t size;
+	size_t cap;
+} batch;
+
+static char *batch_reserve(lua_State *L, size_t n) {
+	if (unlikely(batch.cap-batch.size < n)) {
+		size_t cap = (batch.cap != 0) ? batch.cap : 4096;
+		while (cap-batch.size < n) cap *= 2;
+		char *p = realloc(batch.data, cap);
+		if (unlikely(p == NULL)) luaL_error(L, "out of memory");
+		batch.data = p;
+		batch.cap = cap;
+	}
+	return batch.data+batch.size;
+}
+
+static void batch_add(lua_State *L, const char *s, size_t len) {
+	char *p = batch_reserve(L, len+1);
+	memcpy(p, s, len);
+	p[len] = '\n';
+	batch.size += len+1;
+}
+
+// adds the command made of the top argc values on the stack to the batch
+// returns an error message or NULL
+static const char *batch_add_cmd(lua_State *L, int argc) {
+	struct worddata *words = g_words;
+	size_t total_len = cmd_preparse(L, argc, words);
+	if (unlikely(total_len == (size_t)-1)) return "argument is not a string or number";
+	enum quoting_mode mode = cmd_get_quoting_mode(argc, words);
+	size_t outsize = cmd_get_outsize(argc, words, total_len, mode);
+	if (unlikely(outsize > max_line_length)) return "command too long";
+	char *buf = batch_reserve(L, outsize+1);
+	size_t wrote = cmd_stringify(buf, argc, words, mode);
+	assert(wrote == outsize);
+	buf[wrote++] = '\n';
+	batch.size += wrote;
+	return NULL;
+}
+
+static void batch_flush(void) {
+	if (likely(!intern_enabled)) {
+		buffer_list_write_lines(write_buffers, batch.data, batch.size);
+	} else {
+		// it has to see the lines one at a time
+		const char *s = batch.data;
+		const char *end = batch.data+batch.size;
+		while (s != end) {
+			const char *nl = memchr(s, '\n', (size_t)(end-s));
+			if (nl != s) intern_write_line(write_buffers, s, (size_t)(nl-s));
+			s = nl+1;
+		}
+	}
+	batch.size = 0;
+}
+
+// _cmd_batch({{cmd, args...}, ...})
+// same as calling cmd() for each one
+// note: with coalescing on, they're written one by one (it needs to know what
+//  each one sets) and the ones before a bad one are still written
+static int l_cmd_batch(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_Integer cnt = luaL_len(L, 1);
+	bool one_by_one = (write_buffers->coalesce != NULL);
+	lua_Integer i;
+	const char *err;
+	batch.size = 0;
+	batch_reserve(L, (size_t)cnt*32);
+	for (i = 1; i <= cnt; i++) {
+		lua_settop(L, 1);
+		if (unlikely(lua_geti(L, 1, i) != LUA_TTABLE)) {
+			err = "not a table";
+			goto error;
+		}
+		lua_Integer argc = luaL_len(L, 2);
+		if (unlikely(argc <= 0)) continue;
+		if (unlikely(argc > max_argc)) {
+			err = "too many arguments";
+			goto error;
+		}
+		luaL_checkstack(L, (int)argc, NULL);
+		for (lua_Integer j = 1; j <= argc; j++) lua_geti(L, 2, j);
+		if (unlikely(one_by_one)) {
+			cmd_write(L, (int)argc, false);
+			continue;
+		}
+		err = batch_add_cmd(L, (int)argc);
+		if (unlikely(err != NULL)) goto error;
+	}
+	batch_flush();
+	return 0;
+error:
+	batch.size = 0;
+	return luaL_error(L, "cmd.batch: command %d: %s", (int)i, err);
+}
+
+// _cfg_lines({line, ...})
+// same as calling cfg() for each one
+static int l_cfg_lines(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_Integer cnt = luaL_len(L, 1);
+	lua_Integer i;
+	const char *err;
+	batch.size = 0;
+	for (i = 1; i <= cnt; i++) {
+		lua_geti(L, 1, i);
+		size_t len;
+		const char *s = lua_tolstring(L, -1, &len);
+		if (unlikely(s == NULL)) {
+			err = "not a string";
+			goto error;
+		}
+		if (likely(len <= max_line_length)) {
+			if (likely(len != 0)) batch_add(L, s, len);
+		} else {
+			// doesn't fit, is it multiple lines?
+			const char *end = s+len;
+			for (;;) {
+				const char *nl = memchr(s, '\n', (size_t)(end-s));
+				if (nl == NULL) nl = end;
+				size_t linelen = (size_t)(nl-s);
+				if (unlikely(linelen > max_line_length)) {
+					err = "line too long";
+					goto error;
+				}
+				if (linelen != 0) batch_add(L, s, linelen);
+				if (nl == end) break;
+				s = nl+1;
+			}
+		}
+		lua_pop(L, 1);
+	}
+	batch_flush();
+	return 0;
+error:
+	batch.size = 0;
+	return luaL_error(L, "cfg_lines: line %d: %s", (int)i, err);
+}
+
+// -----------------------------------------------------------------------------
+
+// commands from other threads
+// each one is formatted by the thread that emits it (with its own copy of the
+//  scratch space) and pushed on a lock-free stack. cfgfs_read() takes the whole
+//  stack at once and puts it in the buffer in the order they were pushed
+
+#define EMIT_MAX_QUEUED 4096
+
+struct emit_node {
+	struct emit_node *next;
+	size_t len;
+	char line[];
+};
+
+static struct emit_node *_Atomic emit_head;
+_Atomic(size_t) cfg_emit_queued;
+
+static _Thread_local struct worddata tl_words[max_argc];
+
+bool cfg_emit(const char *const argv[], int argc) {
+	if (unlikely(argc <= 0 || argc > max_argc)) return false;
+	struct worddata *words = tl_words;
+	size_t total_len = 0;
+	for (int i = 0; i < argc; i++) {
+		size_t len = strlen(argv[i]);
+		cmd_word_set(&words[i], argv[i], len);
+		total_len += len;
+	}
+	enum quoting_mode mode = cmd_get_quoting_mode(argc, words);
+	size_t outsize = cmd_get_outsize(argc, words, total_len, mode);
+	if (unlikely(outsize > max_line_length)) return false;
+
+	if (unlikely(atomic_fetch_add_explicit(&cfg_emit_queued, 1, memory_order_relaxed) >= EMIT_MAX_QUEUED)) {
+		// the game isn't reading
+		atomic_fetch_sub_explicit(&cfg_emit_queued, 1, memory_order_relaxed);
+		return false;
+	}
+	struct emit_node *node = malloc(sizeof(struct emit_node)+outsize);
+	if (unlikely(node == NULL)) {
+		atomic_fetch_sub_explicit(&cfg_emit_queued, 1, memory_order_relaxed);
+		return false;
+	}
+	node->len = cmd_stringify(node->line, argc, words, mode);
+
+	struct emit_node *head = atomic_load_explicit(&emit_head, memory_order_relaxed);
+	do node->next = head;
+	while (!atomic_compare_exchange_weak_explicit(&emit_head, &head, node,
+	    memory_order_release, memory_order_relaxed));
+
+	// the first one gets the game to come and read it. if the click gets
+	//  dropped, the next lua_unlock_state() or cfgfs_read() tries again
+	if (head == NULL) do_click();
+	return true;
+}
+
+void cfg_emit_splice(void) {
+	if (likely(atomic_load_explicit(&emit_head, memory_order_relaxed) == NULL)) return;
+	struct emit_node *p = atomic_exchange_explicit(&emit_head, NULL, memory_order_acquire);
+
+	// newest first -> oldest first
+	struct emit_node *list = NULL;
+	while (p != NULL) {
+		struct emit_node *next = p->next;
+		p->next = list;
+		list = p;
+		p = next;
+	}
+
+	size_t n = 0;
+	while (list != NULL) {
+		struct emit_node *next = list->next;
+		if (unlikely(intern_enabled)) {
+			intern_write_line(&buffers, list->line, list->len);
+		} else {
+			buffer_list_write_line(&buffers, list->line, list->len);
+		}
+		free(list);
+		list = next;
+		n += 1;
+	}
+	atomic_fetch_sub_explicit(&cfg_emit_queued, n, memory_order_relaxed);
+}
+
+struct emit_test {
+	const char *argv[max_argc];
+	int argc;
+	bool ok;
+};
+
+static void *emit_test_main(void *ud) {
+	struct emit_test *t = ud;
+	t->ok = cfg_emit(t->argv, t->argc);
+	return NULL;
+}
+
+// _cfg_emit_test(word, ...) -> true or false
+// calls cfg_emit() from another thread and waits for it (test/script.lua uses
+//  it)
+static int l_cfg_emit_test(lua_State *L) {
+	struct emit_test t = {.argc = lua_gettop(L)};
+	luaL_argcheck(L, t.argc >= 1 && t.argc <= max_argc, 1, "wrong number of words");
+	for (int i = 0; i < t.argc; i++) t.argv[i] = luaL_checkstring(L, i+1);
+	pthread_t thread;
+	if (unlikely(pthread_create(&thread, NULL, emit_test_main, &t) != 0)) {
+		return luaL_error(L, "_cfg_emit_test: pthread_create failed");
+	}
+	pthread_join(thread, NULL);
+	lua_pushboolean(L, t.ok);
+	return 1;
+}
+
+// -----------------------------------------------------------------------------
+
 const luaL_Reg l_cfg_fns[] = {
 	{"_cfg", l_cfg},
 	{"_cmd", l_cmd},
+	{"_cvar_set", l_cvar_set},
+	{"_cmd_batch", l_cmd_batch},
+	{"_cfg_lines", l_cfg_lines},
+	{"_cfg_emit_test", l_cfg_emit_test},
 	{"cmd_stringify", l_cmd_stringify},
 	{NULL, NULL},
 };
@@ -1,11 +1,30 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 #include <lauxlib.h>
 
 #define max_line_length ((size_t)510)
 #define max_cfg_size    ((size_t)1048576)
 #define max_argc        (63)
 
-extern const luaL_Reg l_cfg_fns[];
+// formats a command the same way as cmd() and queues it for the next read of a
+//  config. it can be called from any thread without the lua lock
+// returns false if the command is bad or too much is queued already
+bool cfg_emit(const char *const argv[], int argc);
+
+// how many commands cfg_emit() has queued that haven't been moved to the buffer
+//  yet
+extern _Atomic(size_t) cfg_emit_queued;
 
-void cfg_init_badchars(void);
+static inline bool cfg_emit_pending(void) {
+	return atomic_load_explicit(&cfg_emit_queued, memory_order_relaxed) != 0;
+}
+
+// moves the queued commands to the bulk lane
+// needs the lua lock, cfgfs_read() calls it before lua runs
+void cfg_emit_splice(void);
+
+extern const luaL_Reg l_cfg_fns[];
@@ -0,0 +1,314 @@
+#include "charclass.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "cfg.h"
+#include "macros.h"
+
+// character classification for cmd_preparse() and cmd_stringify()
+// there's a table-driven version that works everywhere and vectorized ones for
+//  x86 (sse2 and avx2) that are picked at runtime. they must all give the same
+//  results, _charclass_check() compares them (test/script.lua uses it)
+
+#if defined(__GNUC__) && !defined(__TINYC__) && (defined(__x86_64__) || defined(__i386__))
+ #define HAVE_X86_KERNELS 1
+ #include <immintrin.h>
+#endif
+
+// -----------------------------------------------------------------------------
+
+static unsigned char charflags[256];
+
+__attribute__((minsize))
+static void init_charflags(void) {
+#define set_range(s, e, f) {.first = s, .length = (e-s)+1, .flags = f}
+#define set(n, f) set_range(n, n, f)
+	static const struct spec  {
+		unsigned char first, length, flags;
+	} s[] = {
+		set_range(0, 32, wf_needs_quotes),
+		set_range(39, 41, wf_needs_quotes),
+		set(47, wf_needs_quotes),
+		set_range(58, 59, wf_needs_quotes),
+		set(123, wf_needs_quotes),
+		set_range(125, 255, wf_needs_quotes),
+
+		// 0: null byte, game can't read this -> replaced with 0x7F (DEL)
+		// 1-31 excluding 9: game treats these as newlines -> replaced with 0x7F (DEL)
+		// 34: double quote, can't be quoted itself -> replaced with a single quote
+		set_range(0, 31, wf_needs_quotes|wf_contains_evil_char),
+		set(9, wf_needs_quotes),
+		set(34, wf_contains_evil_char),
+	};
+#undef set_range
+#undef set
+
+#define ARRAYEND(a) ((a)+(sizeof(a)/sizeof(*(a))))
+	const struct spec *p = s;
+	while (p != ARRAYEND(s)) {
+		memset(charflags+p->first, p->flags, p->length);
+		p++;
+	}
+#undef ARRAYEND
+}
+
+// ~
+
+static enum wordflags scan_scalar(const char *s, size_t len) {
+	unsigned flags = 0;
+	for (const char *p = s; p != s+len; p++) {
+		flags |= charflags[(unsigned char)*p];
+	}
+	return (enum wordflags)flags;
+}
+
+static void copy_replace_scalar(char *restrict dst,
+                                const char *restrict src,
+                                size_t len,
+                                bool keep_quotes) {
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)src[i];
+		if (c < 32 && c != 9) c = /*DEL*/ 0x7f;
+		if (c == '"' && !keep_quotes) c = '\'';
+		dst[i] = (char)c;
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+#if defined(HAVE_X86_KERNELS)
+
+// the same ranges as the table, with unsigned compares done as
+//  min/max(v, n) == v
+
+#define X86_KERNELS(suffix, tgt, vec, W, load, store, \
+                    set1, cmpeq, min, max, sub, or, and, andnot, xor, movemask) \
+\
+__attribute__((target(tgt))) \
+static inline vec needs_quotes_##suffix(vec v) { \
+	vec sp = set1(32), d39 = sub(v, set1(39)), d58 = sub(v, set1(58)); \
+	vec m = cmpeq(min(v, sp), v); \
+	m = or(m, cmpeq(max(v, set1((char)125)), v)); \
+	m = or(m, cmpeq(min(d39, set1(2)), d39)); \
+	m = or(m, cmpeq(min(d58, set1(1)), d58)); \
+	m = or(m, cmpeq(v, set1(47))); \
+	m = or(m, cmpeq(v, set1(123))); \
+	return m; \
+} \
+\
+__attribute__((target(tgt))) \
+static inline vec control_##suffix(vec v) { \
+	return andnot(cmpeq(v, set1(9)), cmpeq(min(v, set1(31)), v)); \
+} \
+\
+__attribute__((target(tgt))) \
+static enum wordflags scan_##suffix(const char *s, size_t len) { \
+	if (len < W) return scan_scalar(s, len); \
+	vec nq = set1(0), ev = set1(0); \
+	size_t i = 0; \
+	for (;;) { \
+		/* the last one overlaps the one before it, that's fine here */ \
+		if (i+W > len) i = len-W; \
+		vec v = load((const vec *)(const void *)(s+i)); \
+		nq = or(nq, needs_quotes_##suffix(v)); \
+		ev = or(ev, or(control_##suffix(v), cmpeq(v, set1('"')))); \
+		i += W; \
+		if (i >= len) break; \
+	} \
+	unsigned flags = 0; \
+	if (movemask(nq) != 0) flags |= wf_needs_quotes; \
+	if (movemask(ev) != 0) flags |= wf_contains_evil_char; \
+	return (enum wordflags)flags; \
+} \
+\
+__attribute__((target(tgt))) \
+static void copy_replace_##suffix(char *restrict dst, \
+                                  const char *restrict src, \
+                                  size_t len, \
+                                  bool keep_quotes) { \
+	if (len < W) { \
+		copy_replace_scalar(dst, src, len, keep_quotes); \
+		return; \
+	} \
+	vec del = set1(0x7f); \
+	vec swap = set1('"'^'\''); \
+	vec quote = keep_quotes ? set1(0) : set1('"'); \
+	size_t i = 0; \
+	for (;;) { \
+		/* same output for the overlapping part */ \
+		if (i+W > len) i = len-W; \
+		vec v = load((const vec *)(const void *)(src+i)); \
+		vec ctl = control_##suffix(v); \
+		v = or(andnot(ctl, v), and(ctl, del)); \
+		v = xor(v, and(cmpeq(v, quote), swap)); \
+		store((vec *)(void *)(dst+i), v); \
+		i += W; \
+		if (i >= len) break; \
+	} \
+}
+
+// quote is set to 0 when quotes are kept, but then the control characters
+//  have already been turned into DEL so there are no zeros left to match it
+
+X86_KERNELS(sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_storeu_si128,
+            _mm_set1_epi8, _mm_cmpeq_epi8, _mm_min_epu8, _mm_max_epu8,
+            _mm_sub_epi8, _mm_or_si128, _mm_and_si128, _mm_andnot_si128,
+            _mm_xor_si128, _mm_movemask_epi8)
+
+X86_KERNELS(avx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_storeu_si256,
+            _mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_min_epu8, _mm256_max_epu8,
+            _mm256_sub_epi8, _mm256_or_si256, _mm256_and_si256, _mm256_andnot_si256,
+            _mm256_xor_si256, _mm256_movemask_epi8)
+
+#undef X86_KERNELS
+
+static bool have_sse2(void) {
+#if defined(__x86_64__)
+	return true;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+static bool have_avx2(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+static bool have_scalar(void) {
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
+struct kernel {
+	const char *name;
+	bool (*supported)(void);
+	enum wordflags (*scan)(const char *s, size_t len);
+	void (*copy_replace)(char *restrict dst,
+	                     const char *restrict src,
+	                     size_t len,
+	                     bool keep_quotes);
+};
+
+// slowest first
+static const struct kernel kernels[] = {
+	{"scalar", have_scalar, scan_scalar, copy_replace_scalar},
+#if defined(HAVE_X86_KERNELS)
+	{"sse2", have_sse2, scan_sse2, copy_replace_sse2},
+	{"avx2", have_avx2, scan_avx2, copy_replace_avx2},
+#endif
+};
+#define NUM_KERNELS (sizeof(kernels)/sizeof(*kernels))
+
+enum wordflags (*charclass_scan)(const char *s, size_t len) = scan_scalar;
+void (*charclass_copy_replace)(char *restrict dst,
+                               const char *restrict src,
+                               size_t len,
+                               bool keep_quotes) = copy_replace_scalar;
+
+__attribute__((cold))
+void charclass_init(void) {
+	init_charflags();
+#if defined(HAVE_X86_KERNELS)
+	__builtin_cpu_init();
+#endif
+	for (size_t i = 0; i < NUM_KERNELS; i++) {
+		if (kernels[i].supported()) {
+			charclass_scan = kernels[i].scan;
+			charclass_copy_replace = kernels[i].copy_replace;
+		}
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+#define CHECK_MAX_LEN 4096
+#define CHECK_OFFSETS 32
+
+// _charclass_check(s) -> true or false, kernel name, what went wrong
+// runs every kernel that the cpu supports on s (at different alignments) and
+//  compares the results with the scalar one
+static int l_charclass_check(lua_State *L) {
+	size_t len;
+	const char *s = luaL_checklstring(L, 1, &len);
+	luaL_argcheck(L, len <= CHECK_MAX_LEN, 1, "string too long");
+
+	static char in[CHECK_MAX_LEN+CHECK_OFFSETS];
+	static char want[CHECK_MAX_LEN];
+	static char got[CHECK_MAX_LEN+CHECK_OFFSETS];
+	const struct kernel *kern;
+	const char *what;
+
+	for (size_t k = 1; k < NUM_KERNELS; k++) {
+		kern = &kernels[k];
+		if (!kern->supported()) continue;
+		for (size_t off = 0; off < CHECK_OFFSETS; off++) {
+			memcpy(in+off, s, len);
+			if (kern->scan(in+off, len) != scan_scalar(s, len)) {
+				what = "scan";
+				goto fail;
+			}
+			for (int keep = 0; keep <= 1; keep++) {
+				copy_replace_scalar(want, s, len, keep);
+				// the one byte after it must be left alone
+				got[off+len] = 'x';
+				kern->copy_replace(got+off, in+off, len, keep);
+				if (memcmp(want, got+off, len) != 0 || got[off+len] != 'x') {
+					what = keep ? "copy_replace (keep_quotes)" : "copy_replace";
+					goto fail;
+				}
+			}
+		}
+	}
+
+	lua_pushboolean(L, true);
+	return 1;
+fail:
+	lua_pushboolean(L, false);
+	lua_pushstring(L, kern->name);
+	lua_pushstring(L, what);
+	return 3;
+}
+
+// _charclass_bench(s, iterations) -> {kernel name = ns per call, ...}
+// one call is a scan and a copy_replace of s
+static int l_charclass_bench(lua_State *L) {
+	size_t len;
+	const char *s = luaL_checklstring(L, 1, &len);
+	lua_Integer n = luaL_optinteger(L, 2, 100000);
+	luaL_argcheck(L, len <= CHECK_MAX_LEN, 1, "string too long");
+	luaL_argcheck(L, n > 0, 2, "must be positive");
+
+	static char out[CHECK_MAX_LEN];
+	lua_createtable(L, 0, NUM_KERNELS);
+	for (size_t k = 0; k < NUM_KERNELS; k++) {
+		const struct kernel *kern = &kernels[k];
+		if (!kern->supported()) continue;
+		unsigned sink = 0;
+		double start = mono_ms();
+		for (lua_Integer i = 0; i < n; i++) {
+			// keep the compiler from hoisting anything out of the loop
+			__asm__ volatile("" : : "r"(s) : "memory");
+			sink |= kern->scan(s, len);
+			kern->copy_replace(out, s, len, false);
+		}
+		double elapsed = mono_ms()-start;
+		__asm__ volatile("" : : "r"(sink) : "memory");
+		lua_pushnumber(L, elapsed*1e6/(double)n);
+		lua_setfield(L, -2, kern->name);
+	}
+	return 1;
+}
+
+const luaL_Reg l_charclass_fns[] = {
+	{"_charclass_check", l_charclass_check},
+	{"_charclass_bench", l_charclass_bench},
+	{NULL, NULL},
+};
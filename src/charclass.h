@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lauxlib.h>
+
+enum wordflags {
+	wf_none = 0,
+	wf_needs_quotes = 1,
+	// https://s2.desu-usergeneratedcontent.xyz/int/image/1461/31/1461314883561.jpg
+	wf_contains_evil_char = 2,
+};
+
+// ORs together the flags of all the characters in s
+extern enum wordflags (*charclass_scan)(const char *s, size_t len);
+
+// copies len bytes from src to dst and replaces the evil characters on the way
+// double quotes are left alone if keep_quotes is true (for say)
+extern void (*charclass_copy_replace)(char *restrict dst,
+                                      const char *restrict src,
+                                      size_t len,
+                                      bool keep_quotes);
+
+// picks the fastest versions that the cpu supports
+void charclass_init(void);
+
+extern const luaL_Reg l_charclass_fns[];
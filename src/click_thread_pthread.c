@@ -4,83 +4,261 @@
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cli_output.h"
 #include "click.h"
 #include "macros.h"
 
-static pthread_attr_t thread_attr;
+// one thread that sleeps until the earliest pending click
+// pending clicks are kept in a binary min-heap ordered by deadline. the heap
+//  stores indexes into the "timers" slot table so that a click can be found
+//  and cancelled by its id without searching
+// id = (generation << SLOT_BITS) | slot index. the generation is bumped each
+//  time a slot is freed so that stale ids from clicks that already happened
+//  don't cancel an unrelated one
+
+struct timer {
+	double   deadline; // mono_ms()
+	uint32_t gen;
+	uint32_t heapidx; // position in heap, or the next free slot if unused
+};
+
+#define NOT_IN_HEAP UINT32_MAX
+
+// half of the id for the slot, half for the generation
+#define SLOT_BITS (sizeof(uintptr_t)*8/2)
+#define SLOT_MASK (((uintptr_t)1 << SLOT_BITS)-1)
+
+static struct timer *timers;
+static uint32_t      timers_cap;
+static uint32_t      timers_free = NOT_IN_HEAP; // head of the free slot list
+
+static uint32_t *heap;
+static uint32_t  heap_size;
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  timer_cond;
+static bool            timer_quit;
 
 // -----------------------------------------------------------------------------
 
-static void mono_ms_wait_until(double target) {
-	struct timespec ts;
-	ms2ts(ts, target);
+// heap helpers. timer_lock must be held
+
+static inline bool heap_less(uint32_t a, uint32_t b) {
+	return timers[heap[a]].deadline < timers[heap[b]].deadline;
+}
+
+static inline void heap_swap(uint32_t a, uint32_t b) {
+	uint32_t tmp = heap[a];
+	heap[a] = heap[b];
+	heap[b] = tmp;
+	timers[heap[a]].heapidx = a;
+	timers[heap[b]].heapidx = b;
+}
+
+static void heap_up(uint32_t i) {
+	while (i > 0) {
+		uint32_t parent = (i-1)/2;
+		if (!heap_less(i, parent)) break;
+		heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(uint32_t i) {
 	for (;;) {
-		int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
-		if (unlikely(err != 0)) {
-			if (likely(err == EINTR)) continue;
-			eprintln("click: clock_nanosleep: %s", strerror(err));
-			break;
+		uint32_t l = 2*i+1, r = 2*i+2, smallest = i;
+		if (l < heap_size && heap_less(l, smallest)) smallest = l;
+		if (r < heap_size && heap_less(r, smallest)) smallest = r;
+		if (smallest == i) break;
+		heap_swap(i, smallest);
+		i = smallest;
+	}
+}
+
+static void heap_remove(uint32_t i) {
+D	assert(i < heap_size);
+	uint32_t slot = heap[i];
+	heap_size -= 1;
+	if (i != heap_size) {
+		heap[i] = heap[heap_size];
+		timers[heap[i]].heapidx = i;
+		heap_down(i);
+		heap_up(i);
+	}
+	// put the slot on the free list
+	timers[slot].gen += 1;
+	timers[slot].heapidx = timers_free;
+	timers_free = slot;
+}
+
+// gets a free slot, growing the table (and heap) if needed
+static bool timer_alloc(uint32_t *slot_out) {
+	if (unlikely(timers_free == NOT_IN_HEAP)) {
+		uint32_t newcap = (timers_cap != 0) ? timers_cap*2 : 64;
+		if (unlikely(newcap-1 > SLOT_MASK)) return false;
+		struct timer *newtimers = realloc(timers, newcap*sizeof(struct timer));
+		if (unlikely(newtimers == NULL)) return false;
+		timers = newtimers;
+		uint32_t *newheap = realloc(heap, newcap*sizeof(uint32_t));
+		if (unlikely(newheap == NULL)) return false;
+		heap = newheap;
+		for (uint32_t i = newcap; i-- > timers_cap;) {
+			timers[i].gen = 1;
+			timers[i].heapidx = timers_free;
+			timers_free = i;
 		}
-		break;
+		timers_cap = newcap;
 	}
+	uint32_t slot = timers_free;
+	timers_free = timers[slot].heapidx;
+	*slot_out = slot;
+	return true;
 }
 
-static void *click_thread(void *msp) {
+// -----------------------------------------------------------------------------
+
+static void *click_main(void *ud) {
+	(void)ud;
 	set_thread_name("click");
 
-	double ms;
-	memcpy(&ms, &msp, sizeof(double));
+	pthread_mutex_lock(&timer_lock);
+	while (!timer_quit) {
+		if (heap_size == 0) {
+			pthread_cond_wait(&timer_cond, &timer_lock);
+			continue;
+		}
+
+		double now = mono_ms();
+		double first = timers[heap[0]].deadline;
+		if (first > now) {
+			struct timespec ts;
+			ms2ts(ts, first);
+			int err = pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+			if (unlikely(err != 0 && err != ETIMEDOUT)) {
+				eprintln("click: pthread_cond_timedwait: %s", strerror(err));
+			}
+			continue;
+		}
 
-	mono_ms_wait_until(ms);
+		// everything that's due gets the same click
+		// do_click() would ignore the rest anyway since they're inside
+		//  its 50 ms window
+		int cnt = 0;
+		while (heap_size != 0 && timers[heap[0]].deadline <= now) {
+			heap_remove(0);
+			cnt += 1;
+		}
 
-	// the wait is over and we weren't cancelled during that time.
-	// now disable cancellation for non-cancellation-safe do_click()
-	check_errcode(
-	    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL),
-	    "click: pthread_setcancelstate",
-	    goto end);
+		pthread_mutex_unlock(&timer_lock);
+V		eprintln("click: %d timer(s) expired", cnt);
+		do_click_internal_for_click_thread();
+		pthread_mutex_lock(&timer_lock);
+	}
+	pthread_mutex_unlock(&timer_lock);
 
-	do_click_internal_for_click_thread();
-end:
 	return NULL;
 }
 
 // -----------------------------------------------------------------------------
 
 _Bool click_thread_submit_click(long ms, uintptr_t *id_out) {
-	pthread_t thread;
+	double deadline = mono_ms()+(double)ms;
 
-	ms += (long)mono_ms();
-
-	void *msp;
-	_Static_assert(sizeof(msp) >= sizeof(ms), "double doesn't fit in a pointer");
-	memcpy(&msp, &ms, sizeof(double));
-
-	check_errcode(
-	    pthread_create(&thread, &thread_attr, click_thread, msp),
-	    "click: pthread_create",
-	    return false);
+	pthread_mutex_lock(&timer_lock);
+	uint32_t slot;
+	if (unlikely(!timer_alloc(&slot))) {
+		pthread_mutex_unlock(&timer_lock);
+		eprintln("click: failed to allocate timer");
+		return false;
+	}
+	struct timer *t = &timers[slot];
+	t->deadline = deadline;
+	t->heapidx = heap_size;
+	heap[heap_size++] = slot;
+	heap_up(t->heapidx);
+	// wake up the thread if this is the new earliest one
+	bool wake = (heap[0] == slot);
+	uintptr_t id = ((uintptr_t)t->gen << SLOT_BITS) | slot;
+	pthread_mutex_unlock(&timer_lock);
 
-	if (id_out) *id_out = (uintptr_t)thread;
+	if (wake) pthread_cond_signal(&timer_cond);
 
+	if (id_out) *id_out = id;
 	return true;
 }
 
 _Bool click_thread_cancel_click(uintptr_t id) {
-	return (0 == pthread_cancel((pthread_t)id));
+	uint32_t slot = (uint32_t)(id & SLOT_MASK);
+	uintptr_t gen = (id >> SLOT_BITS);
+	bool ok = false;
+
+	pthread_mutex_lock(&timer_lock);
+	if (likely(slot < timers_cap &&
+	           ((uintptr_t)timers[slot].gen & SLOT_MASK) == gen &&
+	           timers[slot].heapidx < heap_size &&
+	           heap[timers[slot].heapidx] == slot)) {
+		heap_remove(timers[slot].heapidx);
+		ok = true;
+	}
+	pthread_mutex_unlock(&timer_lock);
+
+	// no need to wake the thread. it just wakes up a bit early if this was
+	//  the first one
+	return ok;
 }
 
 // -----------------------------------------------------------------------------
 
+static pthread_t thread;
+
 void click_thread_init(void) {
-	pthread_attr_init(&thread_attr);
-	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
-	pthread_attr_setstacksize(&thread_attr, 0xffff); // glibc default: 8 MB
+	if (thread != 0) return;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timer_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	timer_quit = false;
+
+	check_errcode(
+	    pthread_create(&thread, NULL, click_main, NULL),
+	    "click: pthread_create",
+	    goto err);
+
+	return;
+err:
+	pthread_cond_destroy(&timer_cond);
+	thread = 0;
 }
 
 void click_thread_deinit(void) {
-	pthread_attr_destroy(&thread_attr);
+	if (thread == 0) return;
+
+	pthread_mutex_lock(&timer_lock);
+	 timer_quit = true;
+	pthread_mutex_unlock(&timer_lock);
+	pthread_cond_signal(&timer_cond);
+
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+	int err = pthread_timedjoin_np(thread, NULL, &ts);
+	if (err != 0) {
+		return;
+	}
+
+	pthread_cond_destroy(&timer_cond);
+
+	free(exchange(timers, NULL));
+	free(exchange(heap, NULL));
+	timers_cap = 0;
+	timers_free = NOT_IN_HEAP;
+	heap_size = 0;
+
+	thread = 0;
 }
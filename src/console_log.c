@@ -0,0 +1,454 @@
+#include "console_log.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+
+#include "cli_output.h"
+#include "cvar_query.h"
+#include "lua.h"
+#include "macros.h"
+#include "misc/string.h"
+
+// queue between cfgfs_write() and lua for writes to /console.log
+// the game's write() only has to copy the data into the ring. a separate thread
+//  takes the lua lock and calls _game_console_output() for a batch of writes at
+//  a time
+// the ring is a bounded mpmc queue (d. vyukov's) so writers don't need a lock.
+//  the consumer uses the same dequeue operation, and so does a writer that has
+//  to throw away the oldest entry when the ring is full
+// each entry is one write. console_log_handle_write() then sorts them into
+//  lines for lua (see below)
+
+#define CL_RING_SIZE 512 // must be a power of 2
+#define CL_RING_MASK (CL_RING_SIZE-1)
+#define CL_INLINE_SIZE 496 // longer writes are malloc'd
+#define CL_BATCH_MAX 64 // max writes processed per lock
+
+struct cl_slot {
+	_Atomic(size_t) seq;
+	uint32_t        len;
+	bool            complete;
+	char           *big; // not NULL if the data didn't fit in "data"
+	char            data[CL_INLINE_SIZE];
+};
+
+struct cl_item {
+	uint32_t len;
+	bool     complete;
+	char    *big;
+	char     data[CL_INLINE_SIZE];
+};
+
+static struct cl_slot ring[CL_RING_SIZE];
+static _Atomic(size_t) enqueue_pos;
+static _Atomic(size_t) dequeue_pos;
+
+enum cl_policy {
+	cl_policy_block,
+	cl_policy_drop_oldest,
+};
+
+static _Atomic(int) policy = cl_policy_block;
+
+// stats
+static _Atomic(size_t) cnt_written;
+static _Atomic(size_t) cnt_dropped;
+static _Atomic(size_t) cnt_batches;
+static _Atomic(size_t) high_water;
+
+// for sleeping and waking up
+static pthread_mutex_t cl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  data_cond;    // consumer waits for data
+static pthread_cond_t  space_cond;   // blocked writers wait for space
+static _Atomic(bool)   consumer_sleeping;
+static _Atomic(int)    writers_waiting;
+static bool            cl_quit;
+
+static _Atomic(bool) running;
+
+// -----------------------------------------------------------------------------
+
+static bool ring_try_push(const char *data, size_t len, char *big, bool complete) {
+	size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+	struct cl_slot *slot;
+	for (;;) {
+		slot = &ring[pos & CL_RING_MASK];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos+1,
+			    memory_order_relaxed, memory_order_relaxed)) break;
+		} else if (dif < 0) {
+			return false; // full
+		} else {
+			pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+		}
+	}
+	slot->len = (uint32_t)len;
+	slot->complete = complete;
+	slot->big = big;
+	if (big == NULL) memcpy(slot->data, data, len);
+	atomic_store_explicit(&slot->seq, pos+1, memory_order_release);
+	return true;
+}
+
+static bool ring_try_pop(struct cl_item *item) {
+	size_t pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+	struct cl_slot *slot;
+	for (;;) {
+		slot = &ring[pos & CL_RING_MASK];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&dequeue_pos, &pos, pos+1,
+			    memory_order_relaxed, memory_order_relaxed)) break;
+		} else if (dif < 0) {
+			return false; // empty
+		} else {
+			pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+		}
+	}
+	item->len = slot->len;
+	item->complete = slot->complete;
+	item->big = slot->big;
+	if (item->big == NULL) memcpy(item->data, slot->data, item->len);
+	atomic_store_explicit(&slot->seq, pos+CL_RING_MASK+1, memory_order_release);
+	return true;
+}
+
+static inline bool ring_is_empty(void) {
+	size_t pos = atomic_load(&dequeue_pos);
+	return atomic_load(&ring[pos & CL_RING_MASK].seq) != pos+1;
+}
+
+static inline size_t ring_used(void) {
+	size_t enq = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+	size_t deq = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+	return (enq > deq) ? enq-deq : 0;
+}
+
+static void update_high_water(void) {
+	size_t used = ring_used();
+	size_t old = atomic_load_explicit(&high_water, memory_order_relaxed);
+	while (used > old &&
+	       !atomic_compare_exchange_weak_explicit(&high_water, &old, used,
+	           memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+static void wake_consumer(void) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&consumer_sleeping)) {
+		pthread_mutex_lock(&cl_lock);
+		pthread_cond_signal(&data_cond);
+		pthread_mutex_unlock(&cl_lock);
+	}
+}
+
+static void wake_writers(void) {
+	if (unlikely(atomic_load(&writers_waiting) != 0)) {
+		pthread_mutex_lock(&cl_lock);
+		pthread_cond_broadcast(&space_cond);
+		pthread_mutex_unlock(&cl_lock);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+__attribute__((hot))
+bool console_log_push(const char *data, size_t len, bool complete) {
+	if (unlikely(!atomic_load_explicit(&running, memory_order_relaxed))) {
+		return false;
+	}
+
+	char *big = NULL;
+	if (unlikely(len > CL_INLINE_SIZE)) {
+		big = malloc(len);
+		if (unlikely(big == NULL)) return false;
+		memcpy(big, data, len);
+	}
+
+	while (unlikely(!ring_try_push(data, len, big, complete))) {
+		if (atomic_load_explicit(&policy, memory_order_relaxed) == cl_policy_drop_oldest) {
+			struct cl_item item;
+			if (ring_try_pop(&item)) {
+				free(item.big);
+				atomic_fetch_add_explicit(&cnt_dropped, 1, memory_order_relaxed);
+			}
+			continue;
+		}
+		// block until the consumer has made some room
+		pthread_mutex_lock(&cl_lock);
+		 atomic_fetch_add(&writers_waiting, 1);
+		 pthread_cond_signal(&data_cond);
+		 struct timespec ts;
+		 ms2ts(ts, mono_ms()+10.0);
+		 pthread_cond_timedwait(&space_cond, &cl_lock, &ts);
+		 atomic_fetch_sub(&writers_waiting, 1);
+		pthread_mutex_unlock(&cl_lock);
+	}
+
+	atomic_fetch_add_explicit(&cnt_written, 1, memory_order_relaxed);
+	update_high_water();
+	wake_consumer();
+	return true;
+}
+
+// lines from writes that didn't end in a newline
+// the game writes some things in pieces (like the output of "help") and those
+//  can end up mixed with other output if it comes from multiple threads
+// only touched with the lua lock held
+static struct string jumbled = {.autogrow = 1};
+
+// kind: "line", "jumbled", "echo" or "fragment"
+// returns what lua returned (only used for fragments)
+static bool call_lua(lua_State *L, const char *s, size_t len, const char *kind) {
+	 lua_pushvalue(L, GAME_CONSOLE_OUTPUT_IDX);
+	  lua_pushlstring(L, s, len);
+	   lua_pushstring(L, kind);
+	lua_call(L, 2, 1);
+	bool rv = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return rv;
+}
+
+static void flush_jumbled(lua_State *L) {
+	if (jumbled.length == 0) return;
+	// copy it first in case lua causes this to be called again
+	char *s = jumbled.data;
+	size_t len = jumbled.length;
+	jumbled = (struct string){.autogrow = 1};
+	if (likely(cvar_query_active == 0) || !cvar_query_handle_jumbled(L, s, len)) {
+		call_lua(L, s, len, "jumbled");
+	}
+	free(s);
+}
+
+// drops a trailing "\r"
+static inline size_t strip_cr(const char *s, size_t len) {
+	return (len != 0 && s[len-1] == '\r') ? len-1 : len;
+}
+
+// cmd.echo() output. cfg.c marks these by adding \x7f at the end, and the game
+//  adds a space (and \r on windows) after it
+static inline bool is_echo(const char *s, size_t len, size_t *contentlen_out) {
+	len = strip_cr(s, len);
+	if (len >= 2 && s[len-1] == ' ' && s[len-2] == '\x7f') {
+		*contentlen_out = len-2;
+		return true;
+	}
+	return false;
+}
+
+void console_log_handle_write(lua_State *L, const char *s, size_t len, bool complete) {
+	if (likely(complete)) {
+		len = strip_cr(s, len);
+		if (likely(cvar_query_active == 0) || !cvar_query_handle_line(L, s, len)) {
+			call_lua(L, s, len, "line");
+		}
+		// anything left over is probably not going to get its newline
+		//  anymore
+		flush_jumbled(L);
+		return;
+	}
+
+	size_t contentlen;
+	if ((len == 1 && s[0] == '\n') ||
+	    (len == 2 && s[0] == '\r' && s[1] == '\n')) {
+		// the newline for a line written in pieces
+		flush_jumbled(L);
+	} else if (is_echo(s, len, &contentlen)) {
+		if (unlikely(cvar_query_active != 0)) {
+			// the answers all came before this
+			flush_jumbled(L);
+			if (cvar_query_handle_echo(L, s, contentlen)) return;
+		}
+		call_lua(L, s, contentlen, "echo");
+	} else {
+		// some other partial write
+		// lua gets to see the piece itself first, and can return false
+		//  to leave it out of the line
+		if (!call_lua(L, s, len, "fragment")) return;
+
+		const char *end = s+len;
+		const char *nl;
+		while ((nl = memchr(s, '\n', (size_t)(end-s))) != NULL) {
+			string_append_from_buf(&jumbled, s, strip_cr(s, (size_t)(nl-s)));
+			flush_jumbled(L);
+			s = nl+1;
+		}
+		if (s != end) string_append_from_buf(&jumbled, s, (size_t)(end-s));
+	}
+}
+
+// lua lock must be held
+// yieldable: stop early if cfgfs_read() is waiting for the lock
+static int drain(lua_State *L, int max, bool yieldable) {
+	int cnt = 0;
+	struct cl_item item;
+	while (cnt < max &&
+	       !(yieldable && lua_lock_should_yield()) &&
+	       ring_try_pop(&item)) {
+		console_log_handle_write(L,
+		    (item.big != NULL) ? item.big : item.data,
+		    item.len,
+		    item.complete);
+		free(item.big);
+		cnt += 1;
+	}
+	if (cnt != 0) {
+		atomic_fetch_add_explicit(&cnt_batches, 1, memory_order_relaxed);
+		wake_writers();
+	}
+	return cnt;
+}
+
+void console_log_drain_locked(lua_State *L) {
+	if (likely(ring_is_empty())) return;
+	drain(L, CL_RING_SIZE, false);
+}
+
+// -----------------------------------------------------------------------------
+
+static void *console_log_main(void *ud) {
+	(void)ud;
+	set_thread_name("console_log");
+
+	for (;;) {
+		pthread_mutex_lock(&cl_lock);
+		atomic_store(&consumer_sleeping, true);
+		while (!cl_quit && ring_is_empty()) {
+			pthread_cond_wait(&data_cond, &cl_lock);
+		}
+		atomic_store(&consumer_sleeping, false);
+		bool quit = cl_quit;
+		pthread_mutex_unlock(&cl_lock);
+
+		if (!ring_is_empty()) {
+			lua_State *L = lua_get_state("console_log");
+			if (likely(L != NULL)) {
+				int cnt = drain(L, quit ? CL_RING_SIZE : CL_BATCH_MAX, !quit);
+				lua_release_state(L);
+VV				eprintln("console_log: processed %d write(s)", cnt);
+			} else if (!quit) {
+				// lua is being reloaded or something. try again later
+				struct timespec ts = {.tv_nsec = 10*1000*1000};
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		if (quit) break;
+	}
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+static int l_console_log_stats(lua_State *L) {
+	lua_createtable(L, 0, 7);
+	 lua_pushinteger(L, CL_RING_SIZE);
+	 lua_setfield(L, -2, "capacity");
+	 lua_pushinteger(L, (lua_Integer)ring_used());
+	 lua_setfield(L, -2, "queued");
+	 lua_pushinteger(L, (lua_Integer)atomic_load(&high_water));
+	 lua_setfield(L, -2, "high_water");
+	 lua_pushinteger(L, (lua_Integer)atomic_load(&cnt_written));
+	 lua_setfield(L, -2, "written");
+	 lua_pushinteger(L, (lua_Integer)atomic_load(&cnt_dropped));
+	 lua_setfield(L, -2, "dropped");
+	 lua_pushinteger(L, (lua_Integer)atomic_load(&cnt_batches));
+	 lua_setfield(L, -2, "batches");
+	 lua_pushstring(L, (atomic_load(&policy) == cl_policy_drop_oldest) ? "drop_oldest" : "block");
+	 lua_setfield(L, -2, "policy");
+	return 1;
+}
+
+// _console_log_set_policy('block' or 'drop_oldest')
+static int l_console_log_set_policy(lua_State *L) {
+	static const char *const names[] = {"block", "drop_oldest", NULL};
+	int p = luaL_checkoption(L, 1, NULL, names);
+	atomic_store(&policy, (p == 1) ? cl_policy_drop_oldest : cl_policy_block);
+	return 0;
+}
+
+const luaL_Reg l_console_log_fns[] = {
+	{"_console_log_stats", l_console_log_stats},
+	{"_console_log_set_policy", l_console_log_set_policy},
+	{NULL, NULL},
+};
+
+// -----------------------------------------------------------------------------
+
+static pthread_t thread;
+
+void console_log_init(void) {
+	if (thread != 0) return;
+
+	for (size_t i = 0; i < CL_RING_SIZE; i++) {
+		atomic_init(&ring[i].seq, i);
+	}
+	atomic_store(&enqueue_pos, 0);
+	atomic_store(&dequeue_pos, 0);
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&data_cond, &attr);
+	pthread_cond_init(&space_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	cl_quit = false;
+
+	check_errcode(
+	    pthread_create(&thread, NULL, console_log_main, NULL),
+	    "console_log: pthread_create",
+	    goto err);
+
+	atomic_store(&running, true);
+
+	return;
+err:
+	pthread_cond_destroy(&data_cond);
+	pthread_cond_destroy(&space_cond);
+	thread = 0;
+}
+
+// anything still in the ring is passed to lua before this returns
+void console_log_deinit(void) {
+	if (thread == 0) return;
+
+	atomic_store(&running, false);
+
+	pthread_mutex_lock(&cl_lock);
+	 cl_quit = true;
+	 pthread_cond_signal(&data_cond);
+	pthread_mutex_unlock(&cl_lock);
+
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+	int err = pthread_timedjoin_np(thread, NULL, &ts);
+	if (err != 0) {
+		return;
+	}
+
+	// only left if lua wasn't available
+	struct cl_item item;
+	while (ring_try_pop(&item)) {
+		free(item.big);
+		atomic_fetch_add(&cnt_dropped, 1);
+	}
+
+	pthread_cond_destroy(&data_cond);
+	pthread_cond_destroy(&space_cond);
+
+	thread = 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lauxlib.h>
+
+// queues a write to /console.log to be passed to _game_console_output()
+// returns false if the queue isn't running (the caller should call lua itself)
+bool console_log_push(const char *data, size_t len, bool complete);
+
+// splits a write into lines and passes them to _game_console_output() with
+//  their kind ("line", "jumbled", "echo" or "fragment")
+// the lua lock must be held
+void console_log_handle_write(lua_State *L, const char *s, size_t len, bool complete);
+
+// passes any queued writes to lua. the lua lock must be held
+void console_log_drain_locked(lua_State *L);
+
+void console_log_init(void);
+void console_log_deinit(void);
+
+extern const luaL_Reg l_console_log_fns[];
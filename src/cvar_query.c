@@ -0,0 +1,270 @@
+#include "cvar_query.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "macros.h"
+
+// reading many cvars in one go
+// get_cvars() in builtin.lua writes "help <name>" for each cvar and then echoes
+//  a sentinel, all in one batch. the answers are picked out here as
+//  console.log is read, by looking the names up in a hash table of the ones
+//  each query is still waiting for. once the sentinel comes back, the game has
+//  run all of it and _cvar_query_done() gets the values
+// the answers and the sentinel don't go to _game_console_output(), other lines
+//  do as usual
+// everything here is only touched with the lua lock held
+
+#define CVQ_MAX_QUERIES 16
+#define CVQ_MAX_NAMES 512
+#define SENTINEL_PREFIX "cfgfs_cvar_query_"
+#define UNKNOWN_PREFIX "help:  no cvar or command named "
+
+struct cvq_name {
+	char  *name;
+	size_t len;
+	char  *value;
+	size_t value_len;
+	bool   answered;
+	bool   exists;
+};
+
+struct cvar_query {
+	uint32_t         id; // 0: free
+	size_t           cnt;
+	size_t           answered;
+	struct cvq_name *names;
+	uint16_t        *table; // index+1 into names, 0: empty
+	size_t           mask;
+	char             sentinel[sizeof(SENTINEL_PREFIX)+10];
+	size_t           sentinel_len;
+};
+
+static struct cvar_query queries[CVQ_MAX_QUERIES];
+size_t cvar_query_active;
+static uint32_t next_id = 1;
+
+// -----------------------------------------------------------------------------
+
+static inline uint64_t hash_name(const char *s, size_t len) {
+	uint64_t h = 0xcbf29ce484222325u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3u;
+	}
+	return h;
+}
+
+// returns the slot in q->table where name is or would go
+static size_t find_slot(const struct cvar_query *q, const char *name, size_t len) {
+	size_t i = (size_t)hash_name(name, len) & q->mask;
+	for (;;) {
+		uint16_t ent = q->table[i];
+		if (ent == 0) return i;
+		const struct cvq_name *n = &q->names[ent-1];
+		if (n->len == len && memcmp(n->name, name, len) == 0) return i;
+		i = (i+1) & q->mask;
+	}
+}
+
+static struct cvq_name *lookup(const struct cvar_query *q, const char *name, size_t len) {
+	uint16_t ent = q->table[find_slot(q, name, len)];
+	return (ent != 0) ? &q->names[ent-1] : NULL;
+}
+
+static void query_free(struct cvar_query *q) {
+	for (size_t i = 0; i < q->cnt; i++) {
+		free(q->names[i].name);
+		free(q->names[i].value);
+	}
+	free(q->names);
+	free(q->table);
+	memset(q, 0, sizeof(*q));
+	cvar_query_active -= 1;
+}
+
+// {name = value}, unknown cvars are left out and ones without an answer
+//  are false
+static void push_values(lua_State *L, const struct cvar_query *q) {
+	lua_createtable(L, 0, (int)q->cnt);
+	for (size_t i = 0; i < q->cnt; i++) {
+		const struct cvq_name *n = &q->names[i];
+		if (n->answered && !n->exists) continue;
+		lua_pushlstring(L, n->name, n->len);
+		if (n->exists) {
+			lua_pushlstring(L, n->value, n->value_len);
+		} else {
+			lua_pushboolean(L, false);
+		}
+		lua_rawset(L, -3);
+	}
+}
+
+// value is NULL for "no such cvar"
+static bool answer(const char *name, size_t len, const char *value, size_t value_len) {
+	bool matched = false;
+	for (size_t i = 0; i < CVQ_MAX_QUERIES; i++) {
+		struct cvar_query *q = &queries[i];
+		if (q->id == 0) continue;
+		struct cvq_name *n = lookup(q, name, len);
+		if (n == NULL || n->answered) continue;
+		if (value != NULL) {
+			char *copy = malloc(value_len+1);
+			if (unlikely(copy == NULL)) continue;
+			memcpy(copy, value, value_len);
+			copy[value_len] = '\0';
+			n->value = copy;
+			n->value_len = value_len;
+			n->exists = true;
+		}
+		n->answered = true;
+		q->answered += 1;
+		matched = true;
+	}
+	return matched;
+}
+
+// -----------------------------------------------------------------------------
+
+// "name" = "value"
+bool cvar_query_handle_jumbled(lua_State *L, const char *s, size_t len) {
+	(void)L;
+	if (len < strlen("\"x\" = \"\"") || s[0] != '"' || s[len-1] != '"') return false;
+	const char *name = s+1;
+	const char *name_end = memchr(name, '"', len-1);
+	if (name_end == NULL || name_end == name) return false;
+	const char *value = name_end+strlen("\" = \"");
+	if (value > s+len-1 || memcmp(name_end, "\" = \"", strlen("\" = \"")) != 0) return false;
+	return answer(name, (size_t)(name_end-name), value, (size_t)((s+len-1)-value));
+}
+
+// help:  no cvar or command named name
+bool cvar_query_handle_line(lua_State *L, const char *s, size_t len) {
+	(void)L;
+	size_t plen = strlen(UNKNOWN_PREFIX);
+	if (len <= plen || memcmp(s, UNKNOWN_PREFIX, plen) != 0) return false;
+	return answer(s+plen, len-plen, NULL, 0);
+}
+
+bool cvar_query_handle_echo(lua_State *L, const char *s, size_t len) {
+	size_t plen = strlen(SENTINEL_PREFIX);
+	if (len <= plen || memcmp(s, SENTINEL_PREFIX, plen) != 0) return false;
+	for (size_t i = 0; i < CVQ_MAX_QUERIES; i++) {
+		struct cvar_query *q = &queries[i];
+		if (q->id == 0 || q->sentinel_len != len || memcmp(q->sentinel, s, len) != 0) continue;
+		 lua_getglobal(L, "_cvar_query_done");
+		  lua_pushinteger(L, (lua_Integer)q->id);
+		   push_values(L, q);
+		    lua_pushinteger(L, (lua_Integer)q->answered);
+		     lua_pushinteger(L, (lua_Integer)q->cnt);
+		// free it first, lua might start another one
+		query_free(q);
+		lua_call(L, 4, 0);
+		return true;
+	}
+	// from one that was cancelled (timed out or reloaded)
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+
+// _cvar_query_begin({name, ...}) -> id, sentinel
+// duplicate names are only asked for once
+static int l_cvar_query_begin(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_Integer cnt = luaL_len(L, 1);
+	luaL_argcheck(L, cnt > 0 && cnt <= CVQ_MAX_NAMES, 1, "wrong number of names");
+
+	struct cvar_query *q = NULL;
+	for (size_t i = 0; i < CVQ_MAX_QUERIES; i++) {
+		if (queries[i].id == 0) {
+			q = &queries[i];
+			break;
+		}
+	}
+	if (q == NULL) return luaL_error(L, "too many cvar queries at once");
+
+	size_t size = 8;
+	while (size < (size_t)cnt*2) size *= 2;
+	q->names = calloc((size_t)cnt, sizeof(*q->names));
+	q->table = calloc(size, sizeof(*q->table));
+	q->mask = size-1;
+	q->id = next_id++;
+	if (next_id == 0) next_id = 1;
+	cvar_query_active += 1;
+	if (unlikely(q->names == NULL || q->table == NULL)) {
+		query_free(q);
+		return luaL_error(L, "out of memory");
+	}
+
+	for (lua_Integer i = 1; i <= cnt; i++) {
+		lua_rawgeti(L, 1, i);
+		size_t len;
+		const char *name = lua_tolstring(L, -1, &len);
+		if (name == NULL || len == 0 || memchr(name, '"', len) != NULL) {
+			lua_pop(L, 1);
+			query_free(q);
+			return luaL_error(L, "bad cvar name at index %d", (int)i);
+		}
+		size_t slot = find_slot(q, name, len);
+		if (q->table[slot] == 0) {
+			struct cvq_name *n = &q->names[q->cnt];
+			n->name = malloc(len+1);
+			if (unlikely(n->name == NULL)) {
+				lua_pop(L, 1);
+				query_free(q);
+				return luaL_error(L, "out of memory");
+			}
+			memcpy(n->name, name, len+1);
+			n->len = len;
+			q->cnt += 1;
+			q->table[slot] = (uint16_t)q->cnt;
+		}
+		lua_pop(L, 1);
+	}
+
+	q->sentinel_len = (size_t)snprintf(q->sentinel, sizeof(q->sentinel),
+	    SENTINEL_PREFIX "%u", q->id);
+
+	lua_pushinteger(L, (lua_Integer)q->id);
+	lua_pushlstring(L, q->sentinel, q->sentinel_len);
+	return 2;
+}
+
+// _cvar_query_cancel(id) -> values, answered, count
+// gives up on a query and returns what it got so far (nothing if it's
+//  already done)
+static int l_cvar_query_cancel(lua_State *L) {
+	lua_Integer id = luaL_checkinteger(L, 1);
+	for (size_t i = 0; i < CVQ_MAX_QUERIES; i++) {
+		struct cvar_query *q = &queries[i];
+		if (q->id == 0 || (lua_Integer)q->id != id) continue;
+		push_values(L, q);
+		lua_pushinteger(L, (lua_Integer)q->answered);
+		lua_pushinteger(L, (lua_Integer)q->cnt);
+		query_free(q);
+		return 3;
+	}
+	return 0;
+}
+
+// _cvar_query_reset()
+static int l_cvar_query_reset(lua_State *L) {
+	(void)L;
+	for (size_t i = 0; i < CVQ_MAX_QUERIES; i++) {
+		if (queries[i].id != 0) query_free(&queries[i]);
+	}
+	return 0;
+}
+
+const luaL_Reg l_cvar_query_fns[] = {
+	{"_cvar_query_begin", l_cvar_query_begin},
+	{"_cvar_query_cancel", l_cvar_query_cancel},
+	{"_cvar_query_reset", l_cvar_query_reset},
+	{NULL, NULL},
+};
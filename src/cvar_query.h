@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lauxlib.h>
+
+// number of queries waiting for answers. the functions below only need to be
+//  called if it's not 0
+extern size_t cvar_query_active;
+
+// these are called by console_log.c with the lua lock held. they return true
+//  if the line was an answer to a query and shouldn't go to lua
+
+// a line put together from pieces: the value of a cvar from "help"
+bool cvar_query_handle_jumbled(lua_State *L, const char *s, size_t len);
+
+// a complete line: "help" about something that isn't a cvar or command
+bool cvar_query_handle_line(lua_State *L, const char *s, size_t len);
+
+// cmd.echo() output: the end of a batch
+bool cvar_query_handle_echo(lua_State *L, const char *s, size_t len);
+
+extern const luaL_Reg l_cvar_query_fns[];
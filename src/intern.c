@@ -0,0 +1,226 @@
+#include "intern.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "buffers.h"
+#include "cfg.h"
+#include "macros.h"
+
+// output compressor for lines that keep getting written over and over
+// once a line has been seen enough times, it's put in a generated alias
+//  (alias _c17 "...") and after that only "_c17" is written. this gets more
+//  commands through each read of cfgfs/buffer
+// lines with double quotes in them can't go inside an alias and are left alone
+// when they run out, the least used alias is reused (uses are halved each time
+//  so old ones fade out). the game gets each definition before the first line
+//  that uses it since it's all in one lane
+
+#define INTERN_ALIASES 64
+#define INTERN_SEEN 1024 // lines being counted (by hash, newer replaces older)
+
+#define alias_prefix "_c"
+#define alias_prefix_len (sizeof(alias_prefix)-1)
+// alias_prefix N "..."
+#define define_overhead (strlen("alias " alias_prefix "NN \"\""))
+
+struct seen_ent {
+	uint64_t hash;
+	uint32_t count;
+	int16_t  alias; // -1 if none
+};
+
+struct alias_ent {
+	uint64_t hash;
+	uint32_t uses;
+	bool     used;
+	uint16_t len;
+	char     line[max_line_length];
+};
+
+bool intern_enabled;
+
+static size_t min_len = 32;
+static uint32_t threshold = 3;
+
+static struct seen_ent seen[INTERN_SEEN];
+static struct alias_ent aliases[INTERN_ALIASES];
+
+static struct {
+	size_t hits;
+	size_t defines;
+	size_t evictions;
+	ptrdiff_t bytes_saved; // negative until the aliases get used enough
+} stats;
+
+_Static_assert(INTERN_ALIASES <= 100, "alias names are up to 2 digits");
+_Static_assert((INTERN_SEEN & (INTERN_SEEN-1)) == 0, "INTERN_SEEN must be a power of 2");
+
+// -----------------------------------------------------------------------------
+
+static inline uint64_t hash_line(const char *s, size_t len) {
+	// fnv-1a
+	uint64_t h = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3;
+	}
+	return h;
+}
+
+static inline size_t alias_name(char *buf, int i) {
+	memcpy(buf, alias_prefix, alias_prefix_len);
+	if (i < 10) {
+		buf[alias_prefix_len] = (char)('0'+i);
+		return alias_prefix_len+1;
+	}
+	buf[alias_prefix_len] = (char)('0'+i/10);
+	buf[alias_prefix_len+1] = (char)('0'+i%10);
+	return alias_prefix_len+2;
+}
+
+// picks an unused alias or the least used one
+static int alias_pick(void) {
+	int best = 0;
+	for (int i = 0; i < INTERN_ALIASES; i++) {
+		if (!aliases[i].used) return i;
+		if (aliases[i].uses < aliases[best].uses) best = i;
+	}
+	for (int i = 0; i < INTERN_ALIASES; i++) aliases[i].uses /= 2;
+	// the line has to be seen threshold times again to get an alias back
+	struct seen_ent *old = &seen[aliases[best].hash & (INTERN_SEEN-1)];
+	if (old->hash == aliases[best].hash && old->alias == best) {
+		old->alias = -1;
+		old->count = 0;
+	}
+	stats.evictions += 1;
+	return best;
+}
+
+// returns the length of the alias name
+static size_t write_alias(struct buffer_list *bl, int i) {
+	char name[alias_prefix_len+2];
+	size_t namelen = alias_name(name, i);
+	buffer_list_write_line(bl, name, namelen);
+	stats.hits += 1;
+	return namelen;
+}
+
+// returns the length of the line
+static size_t write_define(struct buffer_list *bl, int i, const char *s, size_t len) {
+	char line[max_line_length];
+	size_t off = 0;
+	memcpy(line, "alias ", 6); off += 6;
+	off += alias_name(line+off, i);
+	line[off++] = ' ';
+	line[off++] = '"';
+	memcpy(line+off, s, len); off += len;
+	line[off++] = '"';
+	buffer_list_write_line(bl, line, off);
+	stats.defines += 1;
+	return off;
+}
+
+__attribute__((hot))
+void intern_write_line(struct buffer_list *bl, const char *s, size_t len) {
+	if (unlikely(bl != &buffers) ||
+	    len < min_len ||
+	    len > max_line_length-define_overhead ||
+	    memchr(s, '"', len) != NULL ||
+	    memchr(s, '\n', len) != NULL) {
+		goto plain;
+	}
+
+	uint64_t h = hash_line(s, len);
+	struct seen_ent *e = &seen[h & (INTERN_SEEN-1)];
+	if (e->hash != h) {
+		*e = (struct seen_ent){.hash = h, .count = 1, .alias = -1};
+		goto plain;
+	}
+
+	if (e->alias >= 0) {
+		struct alias_ent *a = &aliases[e->alias];
+		if (likely(a->len == len && memcmp(a->line, s, len) == 0)) {
+			a->uses += 1;
+			size_t namelen = write_alias(bl, e->alias);
+			stats.bytes_saved += (ptrdiff_t)len-(ptrdiff_t)namelen;
+			return;
+		}
+		// hash collision, leave it be
+		goto plain;
+	}
+
+	if (++e->count < threshold) goto plain;
+
+	int i = alias_pick();
+	struct alias_ent *a = &aliases[i];
+	a->hash = h;
+	a->uses = 1;
+	a->used = true;
+	a->len = (uint16_t)len;
+	memcpy(a->line, s, len);
+	e->alias = (int16_t)i;
+	size_t deflen = write_define(bl, i, s, len);
+	size_t namelen = write_alias(bl, i);
+	// the first time costs more than just writing the line
+	stats.bytes_saved -= (ptrdiff_t)(deflen+1+namelen)-(ptrdiff_t)len;
+	return;
+plain:
+	buffer_list_write_line(bl, s, len);
+}
+
+void intern_reset(void) {
+	memset(seen, 0, sizeof(seen));
+	for (size_t i = 0; i < INTERN_ALIASES; i++) aliases[i].used = false;
+}
+
+// -----------------------------------------------------------------------------
+
+// _set_interning(enabled, min_len, threshold)
+// turning it on or off forgets the generated aliases
+static int l_set_interning(lua_State *L) {
+	bool enabled = lua_toboolean(L, 1);
+	lua_Integer ml = luaL_optinteger(L, 2, 32);
+	lua_Integer th = luaL_optinteger(L, 3, 3);
+	luaL_argcheck(L, ml >= 1 && ml <= (lua_Integer)max_line_length, 2, "out of range");
+	luaL_argcheck(L, th >= 2 && th <= 1000000, 3, "out of range");
+	// the alias name has to be shorter than the line
+	if (ml <= (lua_Integer)alias_prefix_len+2) ml = alias_prefix_len+3;
+	intern_enabled = enabled;
+	min_len = (size_t)ml;
+	threshold = (uint32_t)th;
+	intern_reset();
+	return 0;
+}
+
+// _interning_stats() -> table
+static int l_interning_stats(lua_State *L) {
+	size_t live = 0;
+	for (size_t i = 0; i < INTERN_ALIASES; i++) {
+		if (aliases[i].used) live += 1;
+	}
+	lua_createtable(L, 0, 6);
+	 lua_pushboolean(L, intern_enabled);
+	 lua_setfield(L, -2, "enabled");
+	 lua_pushinteger(L, (lua_Integer)live);
+	 lua_setfield(L, -2, "aliases");
+	 lua_pushinteger(L, (lua_Integer)stats.hits);
+	 lua_setfield(L, -2, "hits");
+	 lua_pushinteger(L, (lua_Integer)stats.defines);
+	 lua_setfield(L, -2, "defines");
+	 lua_pushinteger(L, (lua_Integer)stats.evictions);
+	 lua_setfield(L, -2, "evictions");
+	 lua_pushinteger(L, (lua_Integer)stats.bytes_saved);
+	 lua_setfield(L, -2, "bytes_saved");
+	return 1;
+}
+
+const luaL_Reg l_intern_fns[] = {
+	{"_set_interning", l_set_interning},
+	{"_interning_stats", l_interning_stats},
+	{NULL, NULL},
+};
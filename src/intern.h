@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lauxlib.h>
+
+#include "buffer_list.h"
+
+extern bool intern_enabled;
+
+// writes the line to bl, or the name of a generated alias for it if it's been
+//  written a lot
+// only lines going to the bulk lane are interned
+void intern_write_line(struct buffer_list *bl, const char *s, size_t len);
+
+// forgets all the generated aliases (the game doesn't have them anymore)
+void intern_reset(void);
+
+extern const luaL_Reg l_intern_fns[];
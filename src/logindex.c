@@ -0,0 +1,729 @@
+#include "logindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "cli_output.h"
+#include "logwriter.h"
+#include "lua.h"
+#include "macros.h"
+
+// index of a log file, for grep() and time range queries
+// the file is split into segments of about SEG_SIZE bytes (always at a line
+//  boundary). for each segment we keep:
+// - the offset and time of every line
+// - a bloom filter of the trigrams in it
+// a search only reads the segments whose bloom filter has every trigram from
+//  the literal parts of the pattern, and the scanning is done by worker threads
+//  without the lua lock
+// the index only lives in memory and covers what was written since cfgfs
+//  started (same as what grep() used to look at)
+
+#define SEG_SIZE (1024*1024)
+#define SEG_BLOOM_BITS (1u<<18)
+#define SEG_BLOOM_WORDS (SEG_BLOOM_BITS/64)
+
+#define SEARCH_WORKERS 2
+#define SEARCH_BATCH 256 // lines per call to _log_search_result()
+
+struct segment {
+	off_t     start; // file offset of the first line
+	off_t     end;   // file offset after the last line
+	uint32_t  nlines;
+	uint32_t  cap;
+	uint32_t *line_off; // relative to start
+	double   *line_time; // mono_ms()
+	uint64_t *bloom;
+};
+
+struct logindex {
+	pthread_mutex_t  lock;
+	char            *path;
+	struct segment  *segs;
+	size_t           nsegs;
+	size_t           segcap;
+};
+
+// -----------------------------------------------------------------------------
+
+static inline uint64_t trigram_hash(uint8_t a, uint8_t b, uint8_t c) {
+	uint64_t x = ((uint64_t)a << 16) | ((uint64_t)b << 8) | c;
+	return (x+1) * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+// two bits per trigram from different parts of the hash
+#define bloom_bit1(h) ((uint32_t)((h) >> 40) & (SEG_BLOOM_BITS-1))
+#define bloom_bit2(h) ((uint32_t)((h) >> 14) & (SEG_BLOOM_BITS-1))
+
+static inline void bloom_add(uint64_t *bloom, uint64_t h) {
+	uint32_t b1 = bloom_bit1(h), b2 = bloom_bit2(h);
+	bloom[b1/64] |= UINT64_C(1) << (b1%64);
+	bloom[b2/64] |= UINT64_C(1) << (b2%64);
+}
+
+static inline bool bloom_has(const uint64_t *bloom, uint64_t h) {
+	uint32_t b1 = bloom_bit1(h), b2 = bloom_bit2(h);
+	return ((bloom[b1/64] >> (b1%64)) & 1) &&
+	       ((bloom[b2/64] >> (b2%64)) & 1);
+}
+
+// -----------------------------------------------------------------------------
+
+struct logindex *logindex_new(const char *path) {
+	struct logindex *idx = calloc(1, sizeof(struct logindex));
+	if (unlikely(idx == NULL)) return NULL;
+	idx->path = strdup(path);
+	if (unlikely(idx->path == NULL)) {
+		free(idx);
+		return NULL;
+	}
+	pthread_mutex_init(&idx->lock, NULL);
+	return idx;
+}
+
+void logindex_free(struct logindex *idx) {
+	if (idx == NULL) return;
+	for (size_t i = 0; i < idx->nsegs; i++) {
+		free(idx->segs[i].line_off);
+		free(idx->segs[i].line_time);
+		free(idx->segs[i].bloom);
+	}
+	free(idx->segs);
+	free(idx->path);
+	pthread_mutex_destroy(&idx->lock);
+	free(idx);
+}
+
+// returns the segment that a line at "off" should go in
+// idx->lock must be held
+static struct segment *get_segment_for(struct logindex *idx, off_t off) {
+	if (likely(idx->nsegs != 0)) {
+		struct segment *seg = &idx->segs[idx->nsegs-1];
+		if (likely(seg->end-seg->start < SEG_SIZE)) return seg;
+	}
+	if (idx->nsegs == idx->segcap) {
+		size_t newcap = (idx->segcap != 0) ? idx->segcap*2 : 16;
+		struct segment *segs = realloc(idx->segs, newcap*sizeof(struct segment));
+		if (unlikely(segs == NULL)) return NULL;
+		idx->segs = segs;
+		idx->segcap = newcap;
+	}
+	uint64_t *bloom = calloc(SEG_BLOOM_WORDS, sizeof(uint64_t));
+	if (unlikely(bloom == NULL)) return NULL;
+	struct segment *seg = &idx->segs[idx->nsegs++];
+	*seg = (struct segment){
+		.start = off,
+		.end = off,
+		.bloom = bloom,
+	};
+	return seg;
+}
+
+__attribute__((hot))
+void logindex_add(struct logindex *idx,
+                  off_t off,
+                  const struct iovec *iov,
+                  int iovcnt,
+                  double now) {
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+	if (unlikely(len == 0)) return;
+
+	pthread_mutex_lock(&idx->lock);
+
+	struct segment *seg = get_segment_for(idx, off);
+	if (unlikely(seg == NULL)) goto out;
+	if (unlikely(seg->end != off)) {
+		// lines written around the index? shouldn't happen
+		eprintln("warning: logindex: %s: expected offset %lld, got %lld",
+		    idx->path, (long long)seg->end, (long long)off);
+		seg->end = off;
+	}
+
+	if (seg->nlines == seg->cap) {
+		uint32_t newcap = (seg->cap != 0) ? seg->cap*2 : 1024;
+		uint32_t *line_off = realloc(seg->line_off, newcap*sizeof(uint32_t));
+		if (unlikely(line_off == NULL)) goto out;
+		seg->line_off = line_off;
+		double *line_time = realloc(seg->line_time, newcap*sizeof(double));
+		if (unlikely(line_time == NULL)) goto out;
+		seg->line_time = line_time;
+		seg->cap = newcap;
+	}
+	seg->line_off[seg->nlines] = (uint32_t)(off-seg->start);
+	seg->line_time[seg->nlines] = now;
+	seg->nlines += 1;
+	seg->end = off+(off_t)len;
+
+	// trigrams (across the pieces too)
+	uint8_t a = 0, b = 0;
+	size_t have = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *p = iov[i].iov_base;
+		for (size_t j = 0; j < iov[i].iov_len; j++) {
+			uint8_t c = p[j];
+			if (++have >= 3) bloom_add(seg->bloom, trigram_hash(a, b, c));
+			a = b;
+			b = c;
+		}
+	}
+out:
+	pthread_mutex_unlock(&idx->lock);
+}
+
+// -----------------------------------------------------------------------------
+
+// collects the literal runs of a lua pattern that any match has to contain
+// calls cb for each run of 3 or more characters
+// this only has to be conservative: skipping something is always fine
+static void pattern_literals(const char *p,
+                             size_t len,
+                             void (*cb)(const char *, size_t, void *),
+                             void *ud) {
+	char run[256];
+	size_t runlen = 0;
+	const char *end = p+len;
+#define END_RUN() ({ if (runlen >= 3) cb(run, runlen, ud); runlen = 0; })
+
+	if (p < end && *p == '^') p++;
+	while (p < end) {
+		bool literal = false;
+		char c = 0;
+		switch (*p) {
+		case '(':
+		case ')':
+			// captures don't match anything themselves
+			p++;
+			continue;
+		case '.':
+			p++;
+			break;
+		case '$':
+			p++;
+			if (p == end) continue; // anchor
+			literal = true;
+			c = '$';
+			break;
+		case '%':
+			if (p+1 == end) goto out;
+			c = p[1];
+			p += 2;
+			if (c == 'b') {
+				p = (end-p > 2) ? p+2 : end;
+				END_RUN();
+				continue;
+			} else if (c == 'f') {
+				// frontier: skip the set
+				if (p < end && *p == '[') goto set;
+				END_RUN();
+				continue;
+			}
+			literal = !((c >= 'a' && c <= 'z') ||
+			            (c >= 'A' && c <= 'Z') ||
+			            (c >= '0' && c <= '9'));
+			break;
+		case '[':
+		set:
+			p++;
+			if (p < end && *p == '^') p++;
+			// "]" right at the start is part of the set
+			if (p < end && *p == ']') p++;
+			while (p < end && *p != ']') {
+				if (*p == '%') p++;
+				p++;
+			}
+			p = (p < end) ? p+1 : end;
+			break;
+		default:
+			literal = true;
+			c = *p++;
+			break;
+		}
+
+		// quantifier?
+		char q = (p < end) ? *p : 0;
+		if (q == '*' || q == '-' || q == '?') {
+			p++;
+			END_RUN();
+			continue;
+		}
+		if (!literal) {
+			if (q == '+') p++;
+			END_RUN();
+			continue;
+		}
+		if (runlen == sizeof(run)) END_RUN();
+		run[runlen++] = c;
+		if (q == '+') {
+			// one of it is required, the rest might be repeats
+			p++;
+			END_RUN();
+			run[runlen++] = c;
+		}
+	}
+out:
+	END_RUN();
+#undef END_RUN
+}
+
+struct trigram_list {
+	uint64_t *h;
+	size_t    cnt;
+	size_t    cap;
+};
+
+static void add_trigrams(const char *s, size_t len, void *ud) {
+	struct trigram_list *tl = ud;
+	for (size_t i = 0; i+3 <= len; i++) {
+		if (tl->cnt == tl->cap) {
+			size_t newcap = (tl->cap != 0) ? tl->cap*2 : 16;
+			uint64_t *h = realloc(tl->h, newcap*sizeof(uint64_t));
+			if (unlikely(h == NULL)) return;
+			tl->h = h;
+			tl->cap = newcap;
+		}
+		tl->h[tl->cnt++] = trigram_hash((uint8_t)s[i], (uint8_t)s[i+1], (uint8_t)s[i+2]);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+// part of the file to scan
+struct range {
+	off_t start;
+	off_t end;
+};
+
+// first line in the segment at or after "since"
+// idx->lock must be held
+static off_t segment_offset_since(const struct segment *seg, double since) {
+	uint32_t lo = 0, hi = seg->nlines;
+	while (lo < hi) {
+		uint32_t mid = lo+(hi-lo)/2;
+		if (seg->line_time[mid] < since) lo = mid+1;
+		else hi = mid;
+	}
+	return (lo < seg->nlines) ? seg->start+(off_t)seg->line_off[lo] : seg->end;
+}
+
+// finds the parts of the file that can contain a match
+// returns the number of ranges (*out must be freed), or -1
+static ssize_t find_ranges(struct logindex *idx,
+                           const struct trigram_list *tl,
+                           double since,
+                           struct range **out,
+                           size_t *skipped_out) {
+	size_t skipped = 0;
+	pthread_mutex_lock(&idx->lock);
+	struct range *ranges = malloc((idx->nsegs+1)*sizeof(struct range));
+	if (unlikely(ranges == NULL)) {
+		pthread_mutex_unlock(&idx->lock);
+		return -1;
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < idx->nsegs; i++) {
+		const struct segment *seg = &idx->segs[i];
+		if (seg->nlines == 0) continue;
+		if (seg->line_time[seg->nlines-1] < since) {
+			skipped++;
+			continue;
+		}
+		bool maybe = true;
+		for (size_t j = 0; j < tl->cnt && maybe; j++) {
+			maybe = bloom_has(seg->bloom, tl->h[j]);
+		}
+		if (!maybe) {
+			skipped++;
+			continue;
+		}
+		off_t start = (seg->line_time[0] < since)
+		    ? segment_offset_since(seg, since)
+		    : seg->start;
+		// merge with the previous one if they touch
+		if (n != 0 && ranges[n-1].end == start) {
+			ranges[n-1].end = seg->end;
+		} else {
+			ranges[n++] = (struct range){start, seg->end};
+		}
+	}
+	pthread_mutex_unlock(&idx->lock);
+	*out = ranges;
+	*skipped_out = skipped;
+	return (ssize_t)n;
+}
+
+// reads [start, end) of the file into a malloc'd buffer
+static char *read_range(int fd, off_t start, off_t end, size_t *len_out) {
+	size_t len = (size_t)(end-start);
+	char *buf = malloc(len+1);
+	if (unlikely(buf == NULL)) return NULL;
+	size_t got = 0;
+	while (got < len) {
+		ssize_t rv = pread(fd, buf+got, len-got, start+(off_t)got);
+		if (rv == -1 && errno == EINTR) continue;
+		if (rv <= 0) break;
+		got += (size_t)rv;
+	}
+	*len_out = got;
+	return buf;
+}
+
+// -----------------------------------------------------------------------------
+
+// search jobs
+
+struct search_job {
+	struct search_job *next;
+	struct logindex   *idx;
+	char              *pat;
+	size_t             patlen;
+	double             since;
+	lua_Integer        sid;
+};
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct search_job *jobs_head;
+static struct search_job *jobs_tail;
+static bool jobs_quit;
+
+// stats
+static _Atomic(size_t) searches_done;
+static _Atomic(size_t) segments_scanned;
+static _Atomic(size_t) segments_skipped;
+
+static bool jobs_quitting(void) {
+	pthread_mutex_lock(&jobs_lock);
+	 bool quit = jobs_quit;
+	pthread_mutex_unlock(&jobs_lock);
+	return quit;
+}
+
+// keeps trying until it gets the lua state, unless cfgfs is exiting
+// (the nil at the end is what removes the log_search.N listener, so it
+//  mustn't get lost because something held the lock for too long)
+static lua_State *deliver_get_state(void) {
+	for (;;) {
+		lua_State *L = lua_get_state("log_search");
+		if (likely(L != NULL)) return L;
+		if (jobs_quitting()) return NULL;
+		// didn't wait for the lock, try again in a bit
+		if (errno != ETIMEDOUT) usleep(100*1000);
+	}
+}
+
+// gives a batch of lines (or nil when done) to lua
+// the lines are taken from the table on top of Lw's stack
+static void deliver(lua_State *Lw, lua_Integer sid, bool done) {
+	lua_State *L = deliver_get_state();
+	if (unlikely(L == NULL)) {
+		if (!done) lua_pop(Lw, 1);
+		return;
+	}
+	 lua_getglobal(L, "_log_search_result");
+	  lua_pushinteger(L, sid);
+	if (!done) {
+		// separate states, so the strings have to be copied over
+		size_t n = lua_rawlen(Lw, -1);
+		lua_createtable(L, (int)n, 0);
+		for (size_t i = 1; i <= n; i++) {
+			size_t len;
+			lua_rawgeti(Lw, -1, (lua_Integer)i);
+			const char *s = lua_tolstring(Lw, -1, &len);
+			lua_pushlstring(L, s, len);
+			lua_rawseti(L, -2, (lua_Integer)i);
+			lua_pop(Lw, 1);
+		}
+		lua_pop(Lw, 1);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_call(L, 2, 0);
+	lua_release_state(L);
+}
+
+static void run_search(lua_State *Lw, struct search_job *job) {
+	struct trigram_list tl = {0};
+	pattern_literals(job->pat, job->patlen, add_trigrams, &tl);
+
+	// make sure everything logged so far is in the file
+	logwriter_sync(false, 1000.0);
+
+	struct range *ranges = NULL;
+	size_t skipped = 0;
+	ssize_t nranges = find_ranges(job->idx, &tl, job->since, &ranges, &skipped);
+	free(tl.h);
+	atomic_fetch_add(&segments_skipped, skipped);
+	if (nranges <= 0) goto done;
+
+	int fd = open(job->idx->path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		eprintln("warning: log search: %s: %s", job->idx->path, strerror(errno));
+		goto done;
+	}
+
+	int base = lua_gettop(Lw);
+	 lua_getglobal(Lw, "string");
+	 lua_getfield(Lw, -1, "find");
+	 lua_remove(Lw, -2);
+	 lua_pushlstring(Lw, job->pat, job->patlen);
+	  lua_createtable(Lw, SEARCH_BATCH, 0);
+	int find_idx = base+1, pat_idx = base+2, batch_idx = base+3;
+	lua_Integer batchcnt = 0;
+
+	for (ssize_t r = 0; r < nranges; r++) {
+		size_t len;
+		char *buf = read_range(fd, ranges[r].start, ranges[r].end, &len);
+		if (buf == NULL) continue;
+		atomic_fetch_add(&segments_scanned, 1);
+		char *p = buf, *end = buf+len;
+		while (p < end) {
+			char *nl = memchr(p, '\n', (size_t)(end-p));
+			size_t linelen = (nl != NULL) ? (size_t)(nl-p) : (size_t)(end-p);
+			lua_pushvalue(Lw, find_idx);
+			 lua_pushlstring(Lw, p, linelen);
+			  lua_pushvalue(Lw, pat_idx);
+			if (unlikely(LUA_OK != lua_pcall(Lw, 2, 1, 0))) {
+				eprintln("warning: log search: %s", lua_tostring(Lw, -1));
+				lua_pop(Lw, 1);
+				free(buf);
+				goto scan_done;
+			}
+			bool match = !lua_isnil(Lw, -1);
+			lua_pop(Lw, 1);
+			if (match) {
+				lua_pushlstring(Lw, p, linelen);
+				lua_rawseti(Lw, batch_idx, ++batchcnt);
+				if (batchcnt == SEARCH_BATCH) {
+					deliver(Lw, job->sid, false);
+					lua_createtable(Lw, SEARCH_BATCH, 0);
+					batchcnt = 0;
+				}
+			}
+			p += linelen+1;
+		}
+		free(buf);
+	}
+scan_done:
+	if (batchcnt != 0) {
+		deliver(Lw, job->sid, false);
+	} else {
+		lua_pop(Lw, 1);
+	}
+	lua_settop(Lw, base);
+	close(fd);
+done:
+	free(ranges);
+	atomic_fetch_add(&searches_done, 1);
+	deliver(Lw, job->sid, true);
+}
+
+static void *search_main(void *ud) {
+	(void)ud;
+	set_thread_name("log_search");
+
+	// private lua state just for string.find()
+	lua_State *Lw = luaL_newstate();
+	if (unlikely(Lw == NULL)) return NULL;
+	luaL_requiref(Lw, LUA_STRLIBNAME, luaopen_string, 1);
+	lua_pop(Lw, 1);
+
+	pthread_mutex_lock(&jobs_lock);
+	for (;;) {
+		while (!jobs_quit && jobs_head == NULL) {
+			pthread_cond_wait(&jobs_cond, &jobs_lock);
+		}
+		if (jobs_quit) break;
+		struct search_job *job = jobs_head;
+		jobs_head = job->next;
+		if (jobs_head == NULL) jobs_tail = NULL;
+		pthread_mutex_unlock(&jobs_lock);
+
+		run_search(Lw, job);
+		free(job->pat);
+		free(job);
+
+		pthread_mutex_lock(&jobs_lock);
+	}
+	pthread_mutex_unlock(&jobs_lock);
+
+	lua_close(Lw);
+	return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+static struct logindex *check_indexed_log(lua_State *L, int arg) {
+	lua_Integer id = luaL_checkinteger(L, arg);
+	struct logindex *idx = logwriter_get_index((int)id-1);
+	if (unlikely(idx == NULL)) {
+		luaL_error(L, "log %d doesn't exist or isn't indexed", (int)id);
+	}
+	return idx;
+}
+
+// _log_search(log id, pattern, since_ms or nil, search id)
+// matching lines are passed to _log_search_result(search id, lines) in batches,
+//  and then it's called with nil when the search is done
+static int l_log_search(lua_State *L) {
+	struct logindex *idx = check_indexed_log(L, 1);
+	size_t patlen;
+	const char *pat = luaL_checklstring(L, 2, &patlen);
+	double since = -INFINITY;
+	if (!lua_isnoneornil(L, 3)) since = mono_ms()-luaL_checknumber(L, 3);
+	lua_Integer sid = luaL_checkinteger(L, 4);
+
+	struct search_job *job = calloc(1, sizeof(struct search_job));
+	char *patcopy = malloc(patlen+1);
+	if (unlikely(job == NULL || patcopy == NULL)) {
+		free(job);
+		free(patcopy);
+		return luaL_error(L, "_log_search: out of memory");
+	}
+	memcpy(patcopy, pat, patlen+1);
+	job->idx = idx;
+	job->pat = patcopy;
+	job->patlen = patlen;
+	job->since = since;
+	job->sid = sid;
+
+	pthread_mutex_lock(&jobs_lock);
+	 if (jobs_tail != NULL) {
+		jobs_tail->next = job;
+	 } else {
+		jobs_head = job;
+	 }
+	 jobs_tail = job;
+	 pthread_cond_signal(&jobs_cond);
+	pthread_mutex_unlock(&jobs_lock);
+
+	return 0;
+}
+
+// _log_lines_since(log id, ms) -> array of the lines logged in the last "ms"
+//  milliseconds
+// this is answered from the index, only the lines themselves are read
+static int l_log_lines_since(lua_State *L) {
+	struct logindex *idx = check_indexed_log(L, 1);
+	double since = mono_ms()-luaL_checknumber(L, 2);
+
+	logwriter_sync(false, 1000.0);
+
+	off_t start = -1, end = -1;
+	pthread_mutex_lock(&idx->lock);
+	for (size_t i = idx->nsegs; i-- > 0;) {
+		const struct segment *seg = &idx->segs[i];
+		if (seg->nlines == 0) continue;
+		if (end == -1) end = seg->end;
+		if (seg->line_time[seg->nlines-1] < since) break;
+		start = segment_offset_since(seg, since);
+		if (seg->line_time[0] < since) break;
+	}
+	pthread_mutex_unlock(&idx->lock);
+
+	lua_newtable(L);
+	if (start == -1 || start >= end) return 1;
+
+	int fd = open(idx->path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) return luaL_error(L, "%s: %s", idx->path, strerror(errno));
+	size_t len;
+	char *buf = read_range(fd, start, end, &len);
+	close(fd);
+	if (buf == NULL) return luaL_error(L, "_log_lines_since: out of memory");
+
+	lua_Integer n = 0;
+	char *p = buf, *bufend = buf+len;
+	while (p < bufend) {
+		char *nl = memchr(p, '\n', (size_t)(bufend-p));
+		size_t linelen = (nl != NULL) ? (size_t)(nl-p) : (size_t)(bufend-p);
+		lua_pushlstring(L, p, linelen);
+		lua_rawseti(L, -2, ++n);
+		p += linelen+1;
+	}
+	free(buf);
+	return 1;
+}
+
+// _log_index_stats(log id) -> table
+static int l_log_index_stats(lua_State *L) {
+	struct logindex *idx = check_indexed_log(L, 1);
+	size_t nsegs, nlines = 0;
+	pthread_mutex_lock(&idx->lock);
+	 nsegs = idx->nsegs;
+	 for (size_t i = 0; i < nsegs; i++) nlines += idx->segs[i].nlines;
+	pthread_mutex_unlock(&idx->lock);
+	lua_createtable(L, 0, 5);
+	 lua_pushinteger(L, (lua_Integer)nsegs);
+	 lua_setfield(L, -2, "segments");
+	 lua_pushinteger(L, (lua_Integer)nlines);
+	 lua_setfield(L, -2, "lines");
+	 lua_pushinteger(L, (lua_Integer)atomic_load(&searches_done));
+	 lua_setfield(L, -2, "searches");
+	 lua_pushinteger(L, (lua_Integer)atomic_load(&segments_scanned));
+	 lua_setfield(L, -2, "ranges_scanned");
+	 lua_pushinteger(L, (lua_Integer)atomic_load(&segments_skipped));
+	 lua_setfield(L, -2, "segments_skipped");
+	return 1;
+}
+
+const luaL_Reg l_logindex_fns[] = {
+	{"_log_search", l_log_search},
+	{"_log_lines_since", l_log_lines_since},
+	{"_log_index_stats", l_log_index_stats},
+	{NULL, NULL},
+};
+
+// -----------------------------------------------------------------------------
+
+static pthread_t threads[SEARCH_WORKERS];
+
+void logindex_init(void) {
+	jobs_quit = false;
+	for (int i = 0; i < SEARCH_WORKERS; i++) {
+		if (threads[i] != 0) continue;
+		check_errcode(
+		    pthread_create(&threads[i], NULL, search_main, NULL),
+		    "logindex: pthread_create",
+		    threads[i] = 0);
+	}
+}
+
+void logindex_deinit(void) {
+	pthread_mutex_lock(&jobs_lock);
+	 jobs_quit = true;
+	 pthread_cond_broadcast(&jobs_cond);
+	pthread_mutex_unlock(&jobs_lock);
+
+	for (int i = 0; i < SEARCH_WORKERS; i++) {
+		if (threads[i] == 0) continue;
+		struct timespec ts = {0};
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		if (0 == pthread_timedjoin_np(threads[i], NULL, &ts)) {
+			threads[i] = 0;
+		}
+	}
+
+	// drop any searches that didn't get to run
+	pthread_mutex_lock(&jobs_lock);
+	while (jobs_head != NULL) {
+		struct search_job *job = jobs_head;
+		jobs_head = job->next;
+		free(job->pat);
+		free(job);
+	}
+	jobs_tail = NULL;
+	pthread_mutex_unlock(&jobs_lock);
+}
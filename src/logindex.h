@@ -0,0 +1,24 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <lauxlib.h>
+
+struct logindex;
+
+struct logindex *logindex_new(const char *path);
+void logindex_free(struct logindex *idx);
+
+// records a line written at file offset "off"
+// lines must be added in the order they're written to the file
+void logindex_add(struct logindex *idx,
+                  off_t off,
+                  const struct iovec *iov,
+                  int iovcnt,
+                  double now);
+
+void logindex_init(void);
+void logindex_deinit(void);
+
+extern const luaL_Reg l_logindex_fns[];
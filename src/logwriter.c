@@ -0,0 +1,504 @@
+#include "logwriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <lua.h>
+
+#include "cli_output.h"
+#include "logindex.h"
+#include "macros.h"
+
+// log files written from a background thread
+// lua copies the data into a ring buffer and returns. the writer thread picks
+//  it up with writev() a little later, so that many lines end up in one call
+// if the ring is full (the disk can't keep up), _log_write() waits for the
+//  writer for up to LOG_FULL_WAIT_MS and then drops the record. it's called
+//  with the lua lock held, so it mustn't wait for long. after a drop, records
+//  are dropped without waiting until there's room again
+// each log's ring has one producer at a time since _log_write() is only called
+//  with the lua lock held, and one consumer (the writer thread). so head and
+//  tail are all the synchronization they need
+
+#define MAX_LOGS 8
+#define LOG_RING_SIZE (256*1024) // must be a power of 2
+#define LOG_RING_MASK (LOG_RING_SIZE-1)
+#define LOG_FLUSH_MS 20.0 // max time data sits in the ring (unless it's full)
+#define LOG_FULL_WAIT_MS 10.0
+
+struct log {
+	int   fd;
+	char *path;
+	char *ring;
+	off_t base; // file size when it was opened
+	struct logindex *index; // NULL if not indexed
+	_Atomic(size_t) head; // total bytes added
+	_Atomic(size_t) tail; // total bytes written out
+	bool  failed; // write error was already reported
+	bool  overflowing; // the last record was dropped (only used by the producer)
+
+	// stats
+	_Atomic(size_t) records;
+	_Atomic(size_t) writes; // writev() calls
+	_Atomic(size_t) blocked; // times the producer had to wait for space
+	_Atomic(size_t) dropped; // records that didn't fit in time
+	_Atomic(size_t) high_water;
+};
+
+static struct log logs[MAX_LOGS];
+static _Atomic(int) nlogs;
+
+static pthread_mutex_t lw_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work_cond;  // writer waits for data or a sync request
+static pthread_cond_t  space_cond; // producers wait for room in the ring
+static pthread_cond_t  done_cond;  // sync() waits for the writer
+static _Atomic(bool)   writer_idle;
+static _Atomic(int)    producers_waiting;
+static unsigned int    sync_req;
+static unsigned int    sync_done;
+static bool            sync_fsync;
+static bool            lw_quit;
+
+static _Atomic(bool) running;
+
+// -----------------------------------------------------------------------------
+
+static inline size_t log_used(struct log *lg) {
+	return atomic_load_explicit(&lg->head, memory_order_relaxed) -
+	       atomic_load_explicit(&lg->tail, memory_order_relaxed);
+}
+
+static bool any_log_has_data(bool over_half) {
+	int n = atomic_load_explicit(&nlogs, memory_order_acquire);
+	for (int i = 0; i < n; i++) {
+		size_t used = log_used(&logs[i]);
+		if (over_half ? (used >= LOG_RING_SIZE/2) : (used != 0)) return true;
+	}
+	return false;
+}
+
+// writes out everything that's in the ring
+// only called by the writer thread (or when it's not running)
+static void flush_log(struct log *lg) {
+	size_t tail = atomic_load_explicit(&lg->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&lg->head, memory_order_acquire);
+	while (tail != head) {
+		size_t off = tail & LOG_RING_MASK;
+		size_t len = head-tail;
+		struct iovec iov[2];
+		int iovcnt = 1;
+		iov[0].iov_base = lg->ring+off;
+		iov[0].iov_len = len;
+		if (off+len > LOG_RING_SIZE) {
+			iov[0].iov_len = LOG_RING_SIZE-off;
+			iov[1].iov_base = lg->ring;
+			iov[1].iov_len = len-iov[0].iov_len;
+			iovcnt = 2;
+		}
+		ssize_t rv = writev(lg->fd, iov, iovcnt);
+		atomic_fetch_add_explicit(&lg->writes, 1, memory_order_relaxed);
+		if (unlikely(rv < 0)) {
+			if (errno == EINTR) continue;
+			if (!lg->failed) {
+				eprintln("warning: failed to write to %s: %s",
+				    lg->path, strerror(errno));
+				lg->failed = true;
+			}
+			// lose it. there isn't much else to do
+			rv = (ssize_t)len;
+		}
+		tail += (size_t)rv;
+		atomic_store_explicit(&lg->tail, tail, memory_order_release);
+		head = atomic_load_explicit(&lg->head, memory_order_acquire);
+	}
+}
+
+static void flush_all(bool do_fsync) {
+	int n = atomic_load_explicit(&nlogs, memory_order_acquire);
+	for (int i = 0; i < n; i++) {
+		flush_log(&logs[i]);
+		if (do_fsync) fsync(logs[i].fd);
+	}
+}
+
+static void wake_writer(bool urgent) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (urgent || atomic_load(&writer_idle)) {
+		pthread_mutex_lock(&lw_lock);
+		pthread_cond_signal(&work_cond);
+		pthread_mutex_unlock(&lw_lock);
+	}
+}
+
+// -----------------------------------------------------------------------------
+
+static void *logwriter_main(void *ud) {
+	(void)ud;
+	set_thread_name("logwriter");
+
+	for (;;) {
+		pthread_mutex_lock(&lw_lock);
+		atomic_store(&writer_idle, true);
+		while (!lw_quit && sync_req == sync_done && !any_log_has_data(false)) {
+			pthread_cond_wait(&work_cond, &lw_lock);
+		}
+		atomic_store(&writer_idle, false);
+
+		// give it a moment to collect more lines
+		if (!lw_quit && sync_req == sync_done) {
+			struct timespec ts;
+			ms2ts(ts, mono_ms()+LOG_FLUSH_MS);
+			while (!lw_quit && sync_req == sync_done && !any_log_has_data(true)) {
+				if (ETIMEDOUT == pthread_cond_timedwait(&work_cond, &lw_lock, &ts)) break;
+			}
+		}
+
+		bool quit = lw_quit;
+		unsigned int req = sync_req;
+		bool do_fsync = exchange(sync_fsync, false);
+		pthread_mutex_unlock(&lw_lock);
+
+		flush_all(do_fsync && req != sync_done);
+
+		pthread_mutex_lock(&lw_lock);
+		 if (req != sync_done) {
+			sync_done = req;
+			pthread_cond_broadcast(&done_cond);
+		 }
+		 if (atomic_load(&producers_waiting) != 0) {
+			pthread_cond_broadcast(&space_cond);
+		 }
+		pthread_mutex_unlock(&lw_lock);
+
+		if (quit) break;
+	}
+
+	return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+int logwriter_open(const char *path, bool indexed) {
+	int n = atomic_load(&nlogs);
+	for (int i = 0; i < n; i++) {
+		if (0 == strcmp(logs[i].path, path)) {
+			if (indexed && logs[i].index == NULL) {
+				// offsets before this won't be in it, which is fine
+				logs[i].index = logindex_new(path);
+			}
+			return i;
+		}
+	}
+	if (unlikely(n == MAX_LOGS)) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	struct log *lg = &logs[n];
+	int fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+	if (unlikely(fd == -1)) return -1;
+	struct stat stbuf;
+	if (unlikely(fstat(fd, &stbuf) == -1)) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	char *ring = malloc(LOG_RING_SIZE);
+	char *pathcopy = strdup(path);
+	struct logindex *index = indexed ? logindex_new(path) : NULL;
+	if (unlikely(ring == NULL || pathcopy == NULL || (indexed && index == NULL))) {
+		free(ring);
+		free(pathcopy);
+		logindex_free(index);
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	lg->fd = fd;
+	lg->path = pathcopy;
+	lg->ring = ring;
+	lg->base = stbuf.st_size;
+	lg->index = index;
+	atomic_store(&lg->head, 0);
+	atomic_store(&lg->tail, 0);
+	lg->failed = false;
+	lg->overflowing = false;
+
+	atomic_store_explicit(&nlogs, n+1, memory_order_release);
+	return n;
+}
+
+// waits a little for room for len bytes in the ring
+// returns false if there still isn't enough
+static bool log_wait_for_space(struct log *lg, size_t len) {
+	if (unlikely(len > LOG_RING_SIZE)) return false;
+	size_t head = atomic_load_explicit(&lg->head, memory_order_relaxed);
+	double deadline = 0.0;
+	while (LOG_RING_SIZE-(head-atomic_load_explicit(&lg->tail, memory_order_acquire)) < len) {
+		if (lg->overflowing) return false;
+		double now = mono_ms();
+		if (deadline == 0.0) {
+			deadline = now+LOG_FULL_WAIT_MS;
+			atomic_fetch_add_explicit(&lg->blocked, 1, memory_order_relaxed);
+		} else if (now >= deadline) {
+			lg->overflowing = true;
+			return false;
+		}
+		pthread_mutex_lock(&lw_lock);
+		 atomic_fetch_add(&producers_waiting, 1);
+		 pthread_cond_signal(&work_cond);
+		 struct timespec ts;
+		 ms2ts(ts, deadline);
+		 pthread_cond_timedwait(&space_cond, &lw_lock, &ts);
+		 atomic_fetch_sub(&producers_waiting, 1);
+		pthread_mutex_unlock(&lw_lock);
+	}
+	lg->overflowing = false;
+	return true;
+}
+
+// copies one piece into the ring, there must be room for it
+static void log_push(struct log *lg, const char *s, size_t len) {
+	size_t head = atomic_load_explicit(&lg->head, memory_order_relaxed);
+	size_t off = head & LOG_RING_MASK;
+	size_t first = LOG_RING_SIZE-off;
+	if (len <= first) {
+		memcpy(lg->ring+off, s, len);
+	} else {
+		memcpy(lg->ring+off, s, first);
+		memcpy(lg->ring, s+first, len-first);
+	}
+	atomic_store_explicit(&lg->head, head+len, memory_order_release);
+}
+
+void logwriter_write(int id, const struct iovec *iov, int iovcnt) {
+D	assert(id >= 0 && id < atomic_load(&nlogs));
+	struct log *lg = &logs[id];
+
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+
+	bool direct = !atomic_load_explicit(&running, memory_order_relaxed);
+	if (likely(!direct) && unlikely(!log_wait_for_space(lg, len))) {
+		// not in the index either, so that its offsets stay right
+		atomic_fetch_add_explicit(&lg->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	if (lg->index != NULL) {
+		size_t head = atomic_load_explicit(&lg->head, memory_order_relaxed);
+		logindex_add(lg->index, lg->base+(off_t)head, iov, iovcnt, mono_ms());
+	}
+
+	if (unlikely(direct)) {
+		// no thread, just write it now
+		ssize_t rv;
+		do rv = writev(lg->fd, iov, iovcnt);
+		while (rv == -1 && errno == EINTR);
+		// keep the offsets right for the index
+		atomic_fetch_add_explicit(&lg->head, len, memory_order_relaxed);
+		atomic_fetch_add_explicit(&lg->tail, len, memory_order_relaxed);
+		atomic_fetch_add_explicit(&lg->records, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&lg->writes, 1, memory_order_relaxed);
+		return;
+	}
+
+	for (int i = 0; i < iovcnt; i++) {
+		log_push(lg, iov[i].iov_base, iov[i].iov_len);
+	}
+	atomic_fetch_add_explicit(&lg->records, 1, memory_order_relaxed);
+
+	size_t used = log_used(lg);
+	size_t old = atomic_load_explicit(&lg->high_water, memory_order_relaxed);
+	if (used > old) atomic_store_explicit(&lg->high_water, used, memory_order_relaxed);
+
+	wake_writer(used >= LOG_RING_SIZE/2);
+}
+
+void logwriter_sync(bool do_fsync, double timeout_ms) {
+	if (!atomic_load(&running)) {
+		flush_all(do_fsync);
+		return;
+	}
+	struct timespec ts;
+	ms2ts(ts, mono_ms()+timeout_ms);
+	pthread_mutex_lock(&lw_lock);
+	 unsigned int my = ++sync_req;
+	 sync_fsync |= do_fsync;
+	 pthread_cond_signal(&work_cond);
+	 while ((int)(sync_done-my) < 0) {
+		if (ETIMEDOUT == pthread_cond_timedwait(&done_cond, &lw_lock, &ts)) {
+			eprintln("warning: log writer didn't finish in %.0f ms", timeout_ms);
+			break;
+		}
+	 }
+	pthread_mutex_unlock(&lw_lock);
+}
+
+// -----------------------------------------------------------------------------
+
+static int check_log_id(lua_State *L, int idx) {
+	lua_Integer id = luaL_checkinteger(L, idx);
+	if (unlikely(id < 1 || id > atomic_load(&nlogs))) {
+		return luaL_error(L, "bad log id %d", (int)id);
+	}
+	return (int)id-1;
+}
+
+struct logindex *logwriter_get_index(int id) {
+	if (id < 0 || id >= atomic_load(&nlogs)) return NULL;
+	return logs[id].index;
+}
+
+// _log_open(path, [indexed]) -> id or nil, error
+// an indexed log can be searched with _log_search()
+static int l_log_open(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	int id = logwriter_open(path, lua_toboolean(L, 2));
+	if (id == -1) {
+		luaL_pushfail(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	lua_pushinteger(L, id+1);
+	return 1;
+}
+
+// _log_write(id, ...)
+// like file:write(...) but the strings are written as one record
+// the record is dropped if the log can't keep up (see above)
+__attribute__((hot))
+static int l_log_write(lua_State *L) {
+	int id = check_log_id(L, 1);
+	int n = lua_gettop(L)-1;
+	struct iovec iov[8];
+	if (unlikely(n > 8)) return luaL_error(L, "_log_write: too many arguments");
+	for (int i = 0; i < n; i++) {
+		size_t len;
+		const char *s = luaL_checklstring(L, i+2, &len);
+		iov[i].iov_base = (void *)s;
+		iov[i].iov_len = len;
+	}
+	logwriter_write(id, iov, n);
+	return 0;
+}
+
+// _log_sync([fsync]) -> waits until everything has been written
+static int l_log_sync(lua_State *L) {
+	logwriter_sync(lua_toboolean(L, 1), 1000.0);
+	return 0;
+}
+
+// _log_stats() -> array of tables with the stats of each log
+static int l_log_stats(lua_State *L) {
+	int n = atomic_load(&nlogs);
+	lua_createtable(L, n, 0);
+	for (int i = 0; i < n; i++) {
+		struct log *lg = &logs[i];
+		lua_createtable(L, 0, 9);
+		 lua_pushstring(L, lg->path);
+		 lua_setfield(L, -2, "path");
+		 lua_pushinteger(L, (lua_Integer)log_used(lg));
+		 lua_setfield(L, -2, "queued");
+		 lua_pushinteger(L, (lua_Integer)atomic_load(&lg->high_water));
+		 lua_setfield(L, -2, "high_water");
+		 lua_pushinteger(L, (lua_Integer)atomic_load(&lg->tail));
+		 lua_setfield(L, -2, "bytes");
+		 lua_pushinteger(L, (lua_Integer)atomic_load(&lg->records));
+		 lua_setfield(L, -2, "records");
+		 lua_pushinteger(L, (lua_Integer)atomic_load(&lg->writes));
+		 lua_setfield(L, -2, "writes");
+		 lua_pushinteger(L, (lua_Integer)atomic_load(&lg->blocked));
+		 lua_setfield(L, -2, "blocked");
+		 lua_pushinteger(L, (lua_Integer)atomic_load(&lg->dropped));
+		 lua_setfield(L, -2, "dropped");
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
+const luaL_Reg l_logwriter_fns[] = {
+	{"_log_open", l_log_open},
+	{"_log_write", l_log_write},
+	{"_log_sync", l_log_sync},
+	{"_log_stats", l_log_stats},
+	{NULL, NULL},
+};
+
+// -----------------------------------------------------------------------------
+
+static pthread_t thread;
+
+void logwriter_init(void) {
+	if (thread != 0) return;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&work_cond, &attr);
+	pthread_cond_init(&space_cond, &attr);
+	pthread_cond_init(&done_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	lw_quit = false;
+
+	check_errcode(
+	    pthread_create(&thread, NULL, logwriter_main, NULL),
+	    "logwriter: pthread_create",
+	    goto err);
+
+	atomic_store(&running, true);
+
+	return;
+err:
+	pthread_cond_destroy(&work_cond);
+	pthread_cond_destroy(&space_cond);
+	pthread_cond_destroy(&done_cond);
+	thread = 0;
+}
+
+void logwriter_deinit(void) {
+	if (thread != 0) {
+		pthread_mutex_lock(&lw_lock);
+		 lw_quit = true;
+		 pthread_cond_signal(&work_cond);
+		pthread_mutex_unlock(&lw_lock);
+
+		struct timespec ts = {0};
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		int err = pthread_timedjoin_np(thread, NULL, &ts);
+		if (err != 0) {
+			return;
+		}
+		atomic_store(&running, false);
+
+		pthread_cond_destroy(&work_cond);
+		pthread_cond_destroy(&space_cond);
+		pthread_cond_destroy(&done_cond);
+
+		thread = 0;
+	}
+
+	int n = atomic_load(&nlogs);
+	for (int i = 0; i < n; i++) {
+		flush_log(&logs[i]);
+		fsync(logs[i].fd);
+		close(logs[i].fd);
+		free(exchange(logs[i].path, NULL));
+		free(exchange(logs[i].ring, NULL));
+		logindex_free(exchange(logs[i].index, NULL));
+	}
+	atomic_store(&nlogs, 0);
+}
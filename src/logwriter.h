@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include <lauxlib.h>
+
+struct logindex;
+
+// opens a log file for appending. returns its id or -1 and sets errno
+// opening the same path again returns the same id
+// if indexed, the lines written from now on are added to a logindex
+int logwriter_open(const char *path, bool indexed);
+
+// returns the index of the log, or NULL if it's not indexed
+struct logindex *logwriter_get_index(int id);
+
+// queues the data to be written as one record
+// if there's no room for it after a short wait, it's dropped and counted
+// only one thread may write to the same log at a time (lua lock)
+void logwriter_write(int id, const struct iovec *iov, int iovcnt);
+
+// waits until everything queued so far has been written (and fsync'd)
+void logwriter_sync(bool do_fsync, double timeout_ms);
+
+void logwriter_init(void);
+void logwriter_deinit(void);
+
+extern const luaL_Reg l_logwriter_fns[];
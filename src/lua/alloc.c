@@ -0,0 +1,283 @@
+#include "alloc.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "../cli_output.h"
+#include "../macros.h"
+
+// allocator for the main lua state
+// small objects (most of what lua allocates: strings, tables, closures,
+//  upvalues) come from per-size-class slabs, bigger ones from malloc
+// slabs are carved out of an arena that's allocated and faulted in at startup
+//  (main() has mlockall() so it stays in ram), and from malloc once that's
+//  used up. slab memory is never given back, freed objects go on a free list
+//  for their size class
+// lua passes the old size when freeing or resizing so there are no headers
+// there's no locking: everything that touches the lua state holds the lua
+//  lock. the states made by logindex.c for its threads use plain malloc
+
+#if !defined(LUA_ARENA_SIZE)
+ #define LUA_ARENA_SIZE (8*1024*1024)
+#endif
+
+#define SLAB_SIZE (16*1024)
+#define MAX_SMALL 512
+#define GRANULE 16
+
+static const uint16_t class_sizes[] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+};
+#define NUM_CLASSES (sizeof(class_sizes)/sizeof(*class_sizes))
+#define LARGE NUM_CLASSES
+
+// (size+GRANULE-1)/GRANULE -> size class
+static uint8_t class_of[MAX_SMALL/GRANULE+1];
+
+struct free_block {
+	struct free_block *next;
+};
+
+struct size_class {
+	struct free_block *free;
+	char              *bump;
+	char              *bump_end;
+	size_t             in_use;
+	size_t             slabs;
+	size_t             allocs;
+};
+
+// malloc'd slabs are linked through this so they can be freed at the end
+struct extra_slab {
+	struct extra_slab *next;
+	char               pad[GRANULE-sizeof(struct extra_slab *)];
+	char               data[];
+};
+
+static struct {
+	char              *arena;
+	size_t             arena_size;
+	size_t             arena_used;
+	struct size_class  classes[NUM_CLASSES];
+	struct extra_slab *extra_slabs;
+	size_t             extra_slab_cnt;
+	size_t             small_bytes; // what lua asked for, not the rounded up sizes
+	size_t             large_cnt;
+	size_t             large_bytes;
+	size_t             large_allocs;
+} A;
+
+// -----------------------------------------------------------------------------
+
+static inline size_t size_class(size_t size) {
+	if (size > MAX_SMALL) return LARGE;
+	return class_of[(size+GRANULE-1)/GRANULE];
+}
+
+__attribute__((noinline))
+static bool refill(struct size_class *c) {
+	char *slab;
+	if (A.arena != NULL && A.arena_size-A.arena_used >= SLAB_SIZE) {
+		slab = A.arena+A.arena_used;
+		A.arena_used += SLAB_SIZE;
+	} else {
+		struct extra_slab *es = malloc(sizeof(struct extra_slab)+SLAB_SIZE);
+		if (unlikely(es == NULL)) return false;
+		es->next = A.extra_slabs;
+		A.extra_slabs = es;
+		A.extra_slab_cnt += 1;
+		slab = es->data;
+	}
+	c->bump = slab;
+	c->bump_end = slab+SLAB_SIZE;
+	c->slabs += 1;
+	return true;
+}
+
+static inline void *small_alloc(size_t cls) {
+	struct size_class *c = &A.classes[cls];
+	size_t size = class_sizes[cls];
+	void *p;
+	if (likely(c->free != NULL)) {
+		p = c->free;
+		c->free = c->free->next;
+	} else {
+		if (unlikely((size_t)(c->bump_end-c->bump) < size) && !refill(c)) return NULL;
+		p = c->bump;
+		c->bump += size;
+	}
+	c->in_use += 1;
+	c->allocs += 1;
+	return p;
+}
+
+static inline void small_free(void *p, size_t cls) {
+	struct size_class *c = &A.classes[cls];
+	struct free_block *b = p;
+	b->next = c->free;
+	c->free = b;
+	c->in_use -= 1;
+}
+
+static void *l_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	(void)ud;
+	// osize is the type of the new object when ptr is NULL
+	if (ptr == NULL) osize = 0;
+	size_t ocls = size_class(osize);
+	size_t ncls = size_class(nsize);
+
+	if (nsize == 0) {
+		if (ptr == NULL) return NULL;
+		if (ocls == LARGE) {
+			A.large_cnt -= 1;
+			A.large_bytes -= osize;
+			free(ptr);
+		} else {
+			A.small_bytes -= osize;
+			small_free(ptr, ocls);
+		}
+		return NULL;
+	}
+
+	// fits where it is?
+	if (ptr != NULL && ocls == ncls) {
+		if (ocls == LARGE) {
+			void *p = realloc(ptr, nsize);
+			if (unlikely(p == NULL)) return NULL;
+			A.large_bytes += nsize-osize;
+			return p;
+		}
+		A.small_bytes += nsize-osize;
+		return ptr;
+	}
+
+	void *p;
+	if (ncls == LARGE) {
+		p = malloc(nsize);
+		if (unlikely(p == NULL)) return NULL;
+		A.large_cnt += 1;
+		A.large_bytes += nsize;
+		A.large_allocs += 1;
+	} else {
+		p = small_alloc(ncls);
+		if (unlikely(p == NULL)) return NULL;
+		A.small_bytes += nsize;
+	}
+
+	if (ptr != NULL) {
+		memcpy(p, ptr, (osize < nsize) ? osize : nsize);
+		l_alloc(ud, ptr, osize, 0);
+	}
+	return p;
+}
+
+// -----------------------------------------------------------------------------
+
+static void init_class_of(void) {
+	size_t cls = 0;
+	for (size_t i = 0; i <= MAX_SMALL/GRANULE; i++) {
+		while (class_sizes[cls] < i*GRANULE) cls++;
+		class_of[i] = (uint8_t)cls;
+	}
+}
+
+__attribute__((cold))
+lua_State *lua_alloc_newstate(void) {
+#if defined(SANITIZER)
+	// let the sanitizer see every object
+	return luaL_newstate();
+#else
+	init_class_of();
+
+	void *arena = mmap(NULL, LUA_ARENA_SIZE,
+	                   PROT_READ|PROT_WRITE,
+	                   MAP_PRIVATE|MAP_ANONYMOUS,
+	                   -1, 0);
+	if (arena != MAP_FAILED) {
+		// fault it in now instead of in the middle of something
+		memset(arena, 0, LUA_ARENA_SIZE);
+		A.arena = arena;
+		A.arena_size = LUA_ARENA_SIZE;
+	} else {
+		eprintln("warning: couldn't map the lua arena, using malloc: %s",
+		    strerror(errno));
+	}
+
+	return lua_newstate(l_alloc, NULL);
+#endif
+}
+
+__attribute__((cold))
+void lua_alloc_deinit(void) {
+	if (A.arena != NULL) munmap(A.arena, A.arena_size);
+	struct extra_slab *es = A.extra_slabs;
+	while (es != NULL) {
+		struct extra_slab *next = es->next;
+		free(es);
+		es = next;
+	}
+	memset(&A, 0, sizeof(A));
+}
+
+// -----------------------------------------------------------------------------
+
+// _mem_stats() -> {
+//   used = bytes lua has asked for,
+//   small = bytes in small objects, large = bytes in malloc'd ones,
+//   large_count = n, large_allocs = n,
+//   arena = bytes, arena_used = bytes, extra_slabs = n,
+//   classes = {{size = n, in_use = n, free = n, slabs = n, allocs = n}, ...},
+// }
+// free is how many more fit in the slabs that class already has
+static int l_mem_stats(lua_State *L) {
+	lua_createtable(L, 0, 9);
+	 lua_pushinteger(L, (lua_Integer)(A.small_bytes+A.large_bytes));
+	 lua_setfield(L, -2, "used");
+	 lua_pushinteger(L, (lua_Integer)A.small_bytes);
+	 lua_setfield(L, -2, "small");
+	 lua_pushinteger(L, (lua_Integer)A.large_bytes);
+	 lua_setfield(L, -2, "large");
+	 lua_pushinteger(L, (lua_Integer)A.large_cnt);
+	 lua_setfield(L, -2, "large_count");
+	 lua_pushinteger(L, (lua_Integer)A.large_allocs);
+	 lua_setfield(L, -2, "large_allocs");
+	 lua_pushinteger(L, (lua_Integer)A.arena_size);
+	 lua_setfield(L, -2, "arena");
+	 lua_pushinteger(L, (lua_Integer)A.arena_used);
+	 lua_setfield(L, -2, "arena_used");
+	 lua_pushinteger(L, (lua_Integer)A.extra_slab_cnt);
+	 lua_setfield(L, -2, "extra_slabs");
+	 lua_createtable(L, NUM_CLASSES, 0);
+	 for (size_t i = 0; i < NUM_CLASSES; i++) {
+	 	const struct size_class *c = &A.classes[i];
+	 	size_t per_slab = SLAB_SIZE/class_sizes[i];
+	 	lua_createtable(L, 0, 5);
+	 	 lua_pushinteger(L, class_sizes[i]);
+	 	 lua_setfield(L, -2, "size");
+	 	 lua_pushinteger(L, (lua_Integer)c->in_use);
+	 	 lua_setfield(L, -2, "in_use");
+	 	 lua_pushinteger(L, (lua_Integer)(c->slabs*per_slab-c->in_use));
+	 	 lua_setfield(L, -2, "free");
+	 	 lua_pushinteger(L, (lua_Integer)c->slabs);
+	 	 lua_setfield(L, -2, "slabs");
+	 	 lua_pushinteger(L, (lua_Integer)c->allocs);
+	 	 lua_setfield(L, -2, "allocs");
+	 	lua_rawseti(L, -2, (lua_Integer)i+1);
+	 }
+	 lua_setfield(L, -2, "classes");
+	return 1;
+}
+
+const luaL_Reg l_alloc_fns[] = {
+	{"_mem_stats", l_mem_stats},
+	{NULL, NULL},
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <lauxlib.h>
+
+// creates the main lua state with the allocator from alloc.c
+lua_State *lua_alloc_newstate(void);
+
+// frees the arena and slabs, after lua_close()
+void lua_alloc_deinit(void);
+
+extern const luaL_Reg l_alloc_fns[];
@@ -13,20 +13,30 @@
 #include <lauxlib.h>
 
 #include "../attention.h"
+#include "../binds.h"
 #include "../buffers.h"
 #include "../cfg.h"
+#include "../charclass.h"
 #include "../cli_input.h"
 #include "../cli_output.h"
 #include "../cli_scrollback.h"
 #include "../click.h"
+#include "../console_log.h"
+#include "../cvar_query.h"
+#include "../intern.h"
 #include "../keys.h"
+#include "../logindex.h"
+#include "../logwriter.h"
 #include "../lua.h"
 #include "../macros.h"
 #include "../main.h"
 #include "../misc/string.h"
 #include "../reloader.h"
 
+#include "alloc.h"
+#include "filters.h"
 #include "rcon.h"
+#include "timeouts.h"
 
 // -----------------------------------------------------------------------------
 
@@ -296,6 +306,12 @@ static const luaL_Reg fns_g[] = {
 	{"eprintv", l_eprintv},
 	{"_ms", l_ms},
 	{"_get_locker", l_get_locker},
+	{"_lock_stats", l_lock_stats},
+	{"_lock_stats_text", l_lock_stats_text},
+	{"_set_lock_stats_file", l_set_lock_stats_file},
+	{"_gc_soon", l_gc_soon},
+	{"_set_gc", l_set_gc},
+	{"_gc_stats", l_gc_stats},
 	{"_ensure_cfg_exists", l_ensure_cfg_exists},
 	{"_cfgfs_unmount", l_cfgfs_unmount},
 	// main.c
@@ -322,11 +338,21 @@ void lua_define_builtins(void *L) {
 
 	 lua_getglobal(L, "_G");
 	 luaL_setfuncs(L, fns_g, 0);
+	 luaL_setfuncs(L, l_alloc_fns, 0);
+	 luaL_setfuncs(L, l_binds_fns, 0);
 	 luaL_setfuncs(L, l_buffers_fns, 0);
 	 luaL_setfuncs(L, l_cfg_fns, 0);
+	 luaL_setfuncs(L, l_charclass_fns, 0);
 	 luaL_setfuncs(L, l_cli_input_fns, 0);
 	 luaL_setfuncs(L, l_click_fns, 0);
+	 luaL_setfuncs(L, l_console_log_fns, 0);
+	 luaL_setfuncs(L, l_cvar_query_fns, 0);
+	 luaL_setfuncs(L, l_filters_fns, 0);
+	 luaL_setfuncs(L, l_intern_fns, 0);
+	 luaL_setfuncs(L, l_logindex_fns, 0);
+	 luaL_setfuncs(L, l_logwriter_fns, 0);
 	 luaL_setfuncs(L, l_rcon_fns, 0);
+	 luaL_setfuncs(L, l_timeouts_fns, 0);
 	lua_pop(L, 1);
 
 #if defined(__linux__) || defined(__FreeBSD__)
@@ -363,10 +389,11 @@ void lua_define_builtins(void *L) {
 		local up     = string.format('/cfgfs/keys/-%d.cfg', n)\
 		local toggle = string.format('/cfgfs/keys/^%d.cfg', n)\
 		local once   = string.format('/cfgfs/keys/@%d.cfg', n)\
-		bindfilenames[down]   = {name = key, type = 'down'}\
-		bindfilenames[up]     = {name = key, type = 'up'}\
-		bindfilenames[toggle] = {name = key, type = 'toggle'}\
-		bindfilenames[once]   = {name = key, type = 'once'}\
+		local down_event, up_event = '+'..key, '-'..key\
+		bindfilenames[down]   = {name = key, num = n, type = 'down', down_event = down_event, up_event = up_event}\
+		bindfilenames[up]     = {name = key, num = n, type = 'up', down_event = down_event, up_event = up_event}\
+		bindfilenames[toggle] = {name = key, num = n, type = 'toggle', down_event = down_event, up_event = up_event}\
+		bindfilenames[once]   = {name = key, num = n, type = 'once', down_event = down_event, up_event = up_event}\
 		key2num[key] = n\
 	end\
 	")) lua_error(L);
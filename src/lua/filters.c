@@ -0,0 +1,342 @@
+#include "filters.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../macros.h"
+
+// matcher for lists of console line patterns (is_spam() and friends)
+//
+// pattern syntax (always anchored at both ends):
+//   *   any text (also empty)
+//   #   an integer: optional minus sign and one or more digits. it always takes
+//       all the digits there are
+//   %x  the character x (for matching a literal *, # or %)
+//   anything else matches itself
+//
+// the literal part at the start of each pattern goes in a trie so that one walk
+//  over the beginning of the line finds every pattern that could match. only
+//  those are checked against the rest of the line
+
+#define FILTERS_MT "cfgfs_filters"
+
+#define NO_NODE UINT32_MAX
+#define NO_PAT UINT32_MAX
+
+struct trie_node {
+	uint32_t first_child;
+	uint32_t next_sibling;
+	uint32_t first_pat; // patterns whose prefix ends here
+	uint8_t  ch;
+};
+
+struct pat {
+	char    *rest;   // compiled: what's left after the prefix
+	size_t   restlen;
+	size_t   minlen; // shortest line this can match
+	uint32_t next;   // next pattern with the same prefix
+};
+
+struct filters {
+	struct trie_node *nodes;
+	uint32_t          nodecnt;
+	uint32_t          nodecap;
+	uint32_t          root_children[256]; // direct table for the first char
+	uint32_t          root_pats; // patterns with no literal prefix
+	struct pat       *pats;
+	uint32_t          patcnt;
+};
+
+// -----------------------------------------------------------------------------
+
+// the compiled form uses these bytes for the special tokens. literal bytes
+//  with these values are escaped with tok_lit
+enum {
+	tok_star = 1,
+	tok_int = 2,
+	tok_lit = 3,
+};
+
+static inline bool is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+// matches the compiled pattern p against s
+// classic glob matching where only the most recent * is backtracked. this is
+//  fine since # never gives up digits once it has taken them
+__attribute__((hot))
+static bool glob_match(const char *p, const char *pe, const char *s, const char *se) {
+	const char *star_p = NULL;
+	const char *star_s = NULL;
+	while (s < se) {
+		if (p < pe) {
+			switch (*p) {
+			case tok_star:
+				star_p = ++p;
+				star_s = s;
+				continue;
+			case tok_int: {
+				const char *t = s;
+				if (*t == '-') t++;
+				if (t < se && is_digit(*t)) {
+					do t++; while (t < se && is_digit(*t));
+					s = t;
+					p++;
+					continue;
+				}
+				break;
+			}
+			case tok_lit:
+				if (p[1] == *s) {
+					p += 2;
+					s++;
+					continue;
+				}
+				break;
+			default:
+				if (*p == *s) {
+					p++;
+					s++;
+					continue;
+				}
+				break;
+			}
+		}
+		if (star_p == NULL) return false;
+		p = star_p;
+		s = ++star_s;
+	}
+	while (p < pe && *p == tok_star) p++;
+	return p == pe;
+}
+
+// -----------------------------------------------------------------------------
+
+static uint32_t node_new(struct filters *f, uint8_t ch) {
+	if (f->nodecnt == f->nodecap) {
+		uint32_t newcap = (f->nodecap != 0) ? f->nodecap*2 : 64;
+		struct trie_node *nodes = realloc(f->nodes, newcap*sizeof(struct trie_node));
+		if (unlikely(nodes == NULL)) return NO_NODE;
+		f->nodes = nodes;
+		f->nodecap = newcap;
+	}
+	uint32_t i = f->nodecnt++;
+	f->nodes[i] = (struct trie_node){
+		.first_child = NO_NODE,
+		.next_sibling = NO_NODE,
+		.first_pat = NO_PAT,
+		.ch = ch,
+	};
+	return i;
+}
+
+// finds or creates the child of "parent" for ch
+// parent == NO_NODE means the root
+static uint32_t node_child(struct filters *f, uint32_t parent, uint8_t ch) {
+	uint32_t *link = (parent == NO_NODE)
+	    ? &f->root_children[ch]
+	    : &f->nodes[parent].first_child;
+	for (uint32_t i = *link; i != NO_NODE; i = f->nodes[i].next_sibling) {
+		if (f->nodes[i].ch == ch) return i;
+	}
+	uint32_t i = node_new(f, ch);
+	if (unlikely(i == NO_NODE)) return NO_NODE;
+	// re-get the link since node_new() may have moved the nodes
+	link = (parent == NO_NODE)
+	    ? &f->root_children[ch]
+	    : &f->nodes[parent].first_child;
+	if (parent != NO_NODE) f->nodes[i].next_sibling = *link;
+	*link = i;
+	return i;
+}
+
+// adds the pattern to the end of the list for its prefix so that lower ids
+//  come first
+static void add_pat_to_list(struct filters *f, uint32_t *head, uint32_t id) {
+	while (*head != NO_PAT) head = &f->pats[*head].next;
+	*head = id;
+}
+
+// parses "pattern" into the trie and f->pats[id]
+// returns an error message or NULL
+static const char *compile_one(struct filters *f,
+                               uint32_t id,
+                               const char *s,
+                               size_t len) {
+	struct pat *pat = &f->pats[id];
+	pat->next = NO_PAT;
+	pat->minlen = 0;
+	pat->rest = malloc(len*2+1);
+	pat->restlen = 0;
+	if (unlikely(pat->rest == NULL)) return "out of memory";
+
+	uint32_t node = NO_NODE;
+	bool in_prefix = true;
+	for (size_t i = 0; i < len; i++) {
+		char c = s[i];
+		if (c == '*' || c == '#') {
+			in_prefix = false;
+			pat->rest[pat->restlen++] = (c == '*') ? tok_star : tok_int;
+			if (c == '#') pat->minlen += 1;
+			continue;
+		}
+		if (c == '%') {
+			if (unlikely(++i == len)) return "pattern ends with '%'";
+			c = s[i];
+		}
+		pat->minlen += 1;
+		if (in_prefix) {
+			node = node_child(f, node, (uint8_t)c);
+			if (unlikely(node == NO_NODE)) return "out of memory";
+		} else {
+			if (c == tok_star || c == tok_int || c == tok_lit) {
+				pat->rest[pat->restlen++] = tok_lit;
+			}
+			pat->rest[pat->restlen++] = c;
+		}
+	}
+
+	if (node == NO_NODE) {
+		add_pat_to_list(f, &f->root_pats, id);
+	} else {
+		add_pat_to_list(f, &f->nodes[node].first_pat, id);
+	}
+	return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+static void filters_free(struct filters *f) {
+	for (uint32_t i = 0; i < f->patcnt; i++) {
+		free(f->pats[i].rest);
+	}
+	free(exchange(f->pats, NULL));
+	free(exchange(f->nodes, NULL));
+	f->patcnt = 0;
+	f->nodecnt = 0;
+	f->nodecap = 0;
+}
+
+static inline uint32_t check_pats(const struct filters *f,
+                                  uint32_t id,
+                                  const char *s,
+                                  size_t len,
+                                  size_t off,
+                                  uint32_t best) {
+	for (; id != NO_PAT && id < best; id = f->pats[id].next) {
+		const struct pat *pat = &f->pats[id];
+		if (len < pat->minlen) continue;
+		if (glob_match(pat->rest, pat->rest+pat->restlen, s+off, s+len)) {
+			return id;
+		}
+	}
+	return best;
+}
+
+// returns the lowest matching pattern index or NO_PAT
+__attribute__((hot))
+static uint32_t filters_match(const struct filters *f, const char *s, size_t len) {
+	uint32_t best = check_pats(f, f->root_pats, s, len, 0, NO_PAT);
+	if (len == 0) return best;
+	uint32_t node = f->root_children[(uint8_t)s[0]];
+	size_t off = 1;
+	while (node != NO_NODE) {
+		best = check_pats(f, f->nodes[node].first_pat, s, len, off, best);
+		if (off == len) break;
+		uint8_t ch = (uint8_t)s[off++];
+		uint32_t i;
+		for (i = f->nodes[node].first_child; i != NO_NODE; i = f->nodes[i].next_sibling) {
+			if (f->nodes[i].ch == ch) break;
+		}
+		node = i;
+	}
+	return best;
+}
+
+// -----------------------------------------------------------------------------
+
+static struct filters *check_filters(lua_State *L) {
+	return luaL_checkudata(L, 1, FILTERS_MT);
+}
+
+// filter:match(line) -> index of the first matching pattern, or nil
+static int l_filters_match(lua_State *L) {
+	struct filters *f = check_filters(L);
+	size_t len;
+	const char *s = luaL_checklstring(L, 2, &len);
+	uint32_t id = filters_match(f, s, len);
+	if (id != NO_PAT) {
+		lua_pushinteger(L, (lua_Integer)id+1);
+	} else {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int l_filters_len(lua_State *L) {
+	struct filters *f = check_filters(L);
+	lua_pushinteger(L, (lua_Integer)f->patcnt);
+	return 1;
+}
+
+static int l_filters_gc(lua_State *L) {
+	struct filters *f = check_filters(L);
+	filters_free(f);
+	return 0;
+}
+
+static const luaL_Reg filters_methods[] = {
+	{"match", l_filters_match},
+	{NULL, NULL},
+};
+
+// compile_filters{pattern, ...} -> filter
+static int l_compile_filters(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_Integer cnt = luaL_len(L, 1);
+	luaL_argcheck(L, cnt >= 0 && cnt < (lua_Integer)NO_PAT, 1, "too many patterns");
+
+	struct filters *f = lua_newuserdatauv(L, sizeof(struct filters), 0);
+	memset(f, 0, sizeof(struct filters));
+	for (size_t i = 0; i < 256; i++) f->root_children[i] = NO_NODE;
+	f->root_pats = NO_PAT;
+
+	if (luaL_newmetatable(L, FILTERS_MT)) {
+		luaL_newlib(L, filters_methods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, l_filters_len);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, l_filters_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	if (cnt == 0) return 1;
+
+	f->pats = calloc((size_t)cnt, sizeof(struct pat));
+	if (unlikely(f->pats == NULL)) return luaL_error(L, "compile_filters: out of memory");
+
+	for (lua_Integer i = 1; i <= cnt; i++) {
+		lua_geti(L, 1, i);
+		size_t len;
+		const char *s = lua_tolstring(L, -1, &len);
+		if (unlikely(s == NULL)) {
+			return luaL_error(L, "compile_filters: pattern %d is not a string", (int)i);
+		}
+		f->patcnt = (uint32_t)i;
+		const char *err = compile_one(f, (uint32_t)(i-1), s, len);
+		if (unlikely(err != NULL)) {
+			return luaL_error(L, "compile_filters: pattern %d: %s", (int)i, err);
+		}
+		lua_pop(L, 1);
+	}
+
+	return 1;
+}
+
+const luaL_Reg l_filters_fns[] = {
+	{"compile_filters", l_compile_filters},
+	{NULL, NULL},
+};
@@ -12,9 +12,11 @@
 #include "../buffers.h"
 #include "../cli_output.h"
 #include "../error.h"
+#include "../logwriter.h"
 #include "../lua.h"
 #include "../macros.h"
 
+#include "alloc.h"
 #include "builtins.h"
 #include "state_priv.h"
 
@@ -29,6 +31,12 @@ static struct reqval {
 	// cli_input.c
 	{"_cli_input", LUA_TFUNCTION},
 
+	// cvar_query.c
+	{"_cvar_query_done", LUA_TFUNCTION},
+
+	// logindex.c
+	{"_log_search_result", LUA_TFUNCTION},
+
 	// lua/init.c
 	{"_fire_startup", LUA_TFUNCTION},
 	{"_fire_unload", LUA_TFUNCTION},
@@ -62,6 +70,8 @@ int l_panic(void *L) {
 	}
 	lua_print_backtrace(L);
 	print_c_backtrace_unlocked();
+	// don't lose the end of the log
+	logwriter_sync(true, 500.0);
 	abort();
 	cfgfs_noreturn();
 }
@@ -84,7 +94,7 @@ static void lua_print_backtrace(lua_State *L) {
 static void check_required_globals(lua_State *L);
 
 bool lua_init(void) {
-	lua_State *L = luaL_newstate();
+	lua_State *L = lua_alloc_newstate();
 	luaL_openlibs(L);
 
 	lua_atpanic(L, (lua_CFunction)l_panic);
@@ -127,10 +137,13 @@ D	   assert(lua_type(L, MESSAGE_IDX) == LUA_TFUNCTION);
 
 	assert(stack_is_clean(L));
 
+	lua_gc_init();
+
 	return true;
 err:
 	lua_set_state_unchecked(NULL);
 	lua_close(L);
+	lua_alloc_deinit();
 	return false;
 
 }
@@ -163,6 +176,8 @@ static void check_required_globals(lua_State *L) {
 }
 
 void lua_deinit(void) {
+	lua_gc_deinit();
+	lock_stats_file_deinit();
 	if (lua_lock_state_unchecked()) {
 		lua_State *L = lua_get_state_unchecked();
 		if (L != NULL) {
@@ -170,6 +185,7 @@ void lua_deinit(void) {
 			  lua_pushboolean(L, 1);
 			lua_call(L, 1, 0);
 			lua_close(L);
+			lua_alloc_deinit();
 			lua_set_state_unchecked(NULL);
 		}
 		lua_unlock_state_unchecked();
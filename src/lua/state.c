@@ -5,6 +5,8 @@
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,7 +20,19 @@
 #include "../macros.h"
 
 static lua_State *g_L;
-static pthread_mutex_t lua_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the lua lock
+// game-facing lockers (the game is blocked until they're done) go first: while
+//  one of them is waiting, the lock isn't given to anyone else. background
+//  lockers can check lua_lock_should_yield() between pieces of work to let it
+//  in sooner
+// lock_mutex only protects the fields here, it's never held for long
+static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  high_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  low_cond = PTHREAD_COND_INITIALIZER;
+static bool            lock_held;
+static unsigned        low_waiting;
+static _Atomic(unsigned) high_waiting;
 
 static const char *prev_locked_by = NULL;
 static double      prev_locked_dur = 0.0;
@@ -26,6 +40,40 @@ static double      prev_locked_dur = 0.0;
 static const char *locked_by = NULL;
 static double      locked_at = 0.0;
 
+// log-linear histogram of times in microseconds: exact below 16, then 8
+//  buckets per power of two (so within 12.5%), anything over ~71 minutes goes
+//  in the last one
+#define HIST_LINEAR 16
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (HIST_LINEAR+(32-4)*(1<<HIST_SUB_BITS))
+struct histogram {
+	uint32_t buckets[HIST_BUCKETS];
+	uint32_t total;
+};
+
+#define MAX_LOCKERS 24
+
+// per-locker stats, updated with the lua lock held
+struct locker_stats {
+	const char *name;
+	size_t      count;
+	size_t      contended; // had to wait
+	size_t      timeouts;
+	double      wait_total;
+	double      wait_max;
+	double      hold_total;
+	double      hold_max;
+	struct histogram wait_hist;
+	struct histogram hold_hist;
+	// how many times each locker (by index) was holding the lock when this
+	//  one had to wait
+	uint32_t    blocked_by[MAX_LOCKERS];
+};
+static struct locker_stats locker_stats[MAX_LOCKERS];
+static size_t              locker_stats_cnt;
+static struct locker_stats *locked_stats;
+static struct locker_stats *prev_locked_stats;
+
 // note: string comparisons here are done with ==
 // it works if the compiler de-duplicates string constants (clang and gcc do,
 //  tcc doesn't)
@@ -51,6 +99,10 @@ static inline void check_locker_name(const char *s) {
 	    CHEAP_COMPARE(s, "cfgfs_write/sft_console_log") ||
 	    CHEAP_COMPARE(s, "cfgfs_write/sft_message") ||
 	    CHEAP_COMPARE(s, "cli_input") ||
+	    CHEAP_COMPARE(s, "console_log") ||
+	    CHEAP_COMPARE(s, "lock_stats") ||
+	    CHEAP_COMPARE(s, "log_search") ||
+	    CHEAP_COMPARE(s, "lua_gc") ||
 	    CHEAP_COMPARE(s, "rcon_reader") ||
 	    CHEAP_COMPARE(s, "reloader")) {
 		return;
@@ -89,8 +141,126 @@ static inline bool should_warn_for_contention(const char *me,
 	return block_dur >= 16.67;
 }
 
+// cfgfs_read and cfgfs_readdir block the game until they're done
+static inline bool locker_is_game_facing(const char *me) {
+	return CHEAP_COMPARE(me, "cfgfs_read") ||
+	       CHEAP_COMPARE(me, "cfgfs_readdir");
+}
+
+// finds the stats for a locker name or adds them
+// lock_mutex must be held (the lua lock might not be, for timeouts)
+static struct locker_stats *get_locker_stats(const char *me) {
+	for (size_t i = 0; i < locker_stats_cnt; i++) {
+		if (CHEAP_COMPARE(locker_stats[i].name, me)) return &locker_stats[i];
+	}
+	if (unlikely(locker_stats_cnt == MAX_LOCKERS)) {
+		// shouldn't happen, there's a fixed set of names
+		return &locker_stats[MAX_LOCKERS-1];
+	}
+	struct locker_stats *st = &locker_stats[locker_stats_cnt++];
+	st->name = me;
+	return st;
+}
+
 #undef CHEAP_COMPARE
 
+// -----------------------------------------------------------------------------
+
+static inline size_t hist_index(double ms) {
+	uint64_t us = (ms > 0.0) ? (uint64_t)(ms*1000.0) : 0;
+	if (us < HIST_LINEAR) return (size_t)us;
+	if (us > UINT32_MAX) us = UINT32_MAX;
+	unsigned e = 63u-(unsigned)__builtin_clzll(us); // >= 4
+	size_t sub = (size_t)(us >> (e-HIST_SUB_BITS)) & ((1u<<HIST_SUB_BITS)-1);
+	return HIST_LINEAR+(size_t)(e-4)*(1u<<HIST_SUB_BITS)+sub;
+}
+
+// the highest value (in ms) that would go in bucket i
+static double hist_bucket_max(size_t i) {
+	if (i < HIST_LINEAR) return (double)i/1000.0;
+	size_t e = 4+(i-HIST_LINEAR)/(1u<<HIST_SUB_BITS);
+	uint64_t sub = (i-HIST_LINEAR)%(1u<<HIST_SUB_BITS);
+	uint64_t upper = (((1u<<HIST_SUB_BITS)+sub+1) << (e-HIST_SUB_BITS))-1;
+	return (double)upper/1000.0;
+}
+
+static inline void hist_add(struct histogram *h, double ms) {
+	h->buckets[hist_index(ms)] += 1;
+	h->total += 1;
+}
+
+// p is 0-1. never more than max (the real largest value)
+static double hist_percentile(const struct histogram *h, double p, double max) {
+	if (h->total == 0) return 0.0;
+	uint64_t want = (uint64_t)ceil(p*(double)h->total);
+	if (want == 0) want = 1;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want) {
+			double v = hist_bucket_max(i);
+			return (v < max) ? v : max;
+		}
+	}
+	return max;
+}
+
+// -----------------------------------------------------------------------------
+
+// takes the lock. abstime is a CLOCK_REALTIME deadline or NULL to wait forever
+// returns 0, ETIMEDOUT or some other error from pthread
+static int prio_lock(bool high, const struct timespec *abstime, bool *contested) {
+	int err = pthread_mutex_lock(&lock_mutex);
+	if (unlikely(err != 0)) return err;
+	if (high) {
+		if (unlikely(lock_held)) {
+			*contested = true;
+			atomic_fetch_add_explicit(&high_waiting, 1, memory_order_relaxed);
+			while (lock_held && err == 0) {
+				err = (abstime != NULL)
+				    ? pthread_cond_timedwait(&high_cond, &lock_mutex, abstime)
+				    : pthread_cond_wait(&high_cond, &lock_mutex);
+			}
+			atomic_fetch_sub_explicit(&high_waiting, 1, memory_order_relaxed);
+		}
+	} else {
+		if (unlikely(lock_held || atomic_load_explicit(&high_waiting, memory_order_relaxed) != 0)) {
+			*contested = true;
+			low_waiting += 1;
+			while ((lock_held || atomic_load_explicit(&high_waiting, memory_order_relaxed) != 0) && err == 0) {
+				err = (abstime != NULL)
+				    ? pthread_cond_timedwait(&low_cond, &lock_mutex, abstime)
+				    : pthread_cond_wait(&low_cond, &lock_mutex);
+			}
+			low_waiting -= 1;
+		}
+	}
+	if (!lock_held && (high || atomic_load_explicit(&high_waiting, memory_order_relaxed) == 0)) {
+		// (it might have become free right as the wait timed out)
+		lock_held = true;
+		err = 0;
+	}
+	pthread_mutex_unlock(&lock_mutex);
+	return err;
+}
+
+static void prio_unlock(void) {
+	pthread_mutex_lock(&lock_mutex);
+	lock_held = false;
+	if (atomic_load_explicit(&high_waiting, memory_order_relaxed) != 0) {
+		pthread_cond_signal(&high_cond);
+	} else if (low_waiting != 0) {
+		pthread_cond_signal(&low_cond);
+	}
+	pthread_mutex_unlock(&lock_mutex);
+}
+
+bool lua_lock_should_yield(void) {
+	return unlikely(atomic_load_explicit(&high_waiting, memory_order_relaxed) != 0);
+}
+
+// -----------------------------------------------------------------------------
+
 lua_State *lua_get_state_real(const char *who) {
 	if (unlikely(!lua_lock_state_real(who))) {
 		return NULL;
@@ -111,19 +281,18 @@ bool lua_lock_state_real(const char *who) {
 D	check_locker_name(who);
 	double lock_start = mono_ms();
 	bool contested = false;
-	int err = pthread_mutex_trylock(&lua_mutex);
-	if (unlikely(err == EBUSY)) {
-		contested = true;
-		struct timespec ts = {0};
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += LOCK_TIMEOUT_SEC;
-		err = pthread_mutex_timedlock(&lua_mutex, &ts);
-	}
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += LOCK_TIMEOUT_SEC;
+	int err = prio_lock(locker_is_game_facing(who), &ts, &contested);
 	double lock_end = mono_ms();
 	double lock_dur = lock_end-lock_start;
 
 	if (unlikely(err != 0)) {
 		if (err == ETIMEDOUT) {
+			pthread_mutex_lock(&lock_mutex);
+			get_locker_stats(who)->timeouts += 1;
+			pthread_mutex_unlock(&lock_mutex);
 			eprintln("warning: %s couldn't get lua access after %ds",
 			    who, LOCK_TIMEOUT_SEC);
 		} else V {
@@ -140,7 +309,7 @@ V			eprintln("lua_lock_state: %s couldn't get lock: %s",
 	}
 
 	if (unlikely(g_L == NULL)) {
-		pthread_mutex_unlock(&lua_mutex);
+		prio_unlock();
 V		eprintln("lua_lock_state: %s couldn't get lock: g_L == NULL",
 		    who);
 		errno = EIO;
@@ -152,11 +321,26 @@ D	assert(stack_is_clean(g_L));
 	locked_by = who;
 	locked_at = lock_end;
 
+	pthread_mutex_lock(&lock_mutex);
+	struct locker_stats *st = get_locker_stats(who);
+	pthread_mutex_unlock(&lock_mutex);
+	st->count += 1;
+	if (contested) {
+		st->contended += 1;
+		if (prev_locked_stats != NULL) {
+			st->blocked_by[prev_locked_stats-locker_stats] += 1;
+		}
+	}
+	st->wait_total += lock_dur;
+	if (lock_dur > st->wait_max) st->wait_max = lock_dur;
+	hist_add(&st->wait_hist, lock_dur);
+	locked_stats = st;
+
 	return true;
 }
 
 void lua_unlock_state(void) {
-	bool click = (!buffer_list_is_empty(&buffers));
+	bool click = (!buffers_are_empty());
 	lua_unlock_state_no_click();
 	if (click) do_click();
 }
@@ -176,12 +360,20 @@ else	assert(stack_is_clean_quick(g_L));
 		    locked_by, locked_for);
 	}
 
+	struct locker_stats *st = exchange(locked_stats, NULL);
+	if (likely(st != NULL)) {
+		st->hold_total += locked_for;
+		if (locked_for > st->hold_max) st->hold_max = locked_for;
+		hist_add(&st->hold_hist, locked_for);
+	}
+	prev_locked_stats = st;
+
 	prev_locked_by  = locked_by;
 	prev_locked_dur = locked_for;
 	locked_by       = NULL;
 	locked_at       = 0.0;
 
-	pthread_mutex_unlock(&lua_mutex);
+	prio_unlock();
 }
 
 void lua_unlock_state_and_click(void) {
@@ -202,7 +394,8 @@ void *lua_get_state_unchecked(void) {
 }
 
 _Bool lua_lock_state_unchecked(void) {
-	int err = pthread_mutex_lock(&lua_mutex);
+	bool contested = false;
+	int err = prio_lock(false, NULL, &contested);
 	if (unlikely(err != 0)) {
 		errno = err;
 		return false;
@@ -211,7 +404,7 @@ _Bool lua_lock_state_unchecked(void) {
 }
 
 void lua_unlock_state_unchecked(void) {
-	pthread_mutex_unlock(&lua_mutex);
+	prio_unlock();
 }
 
 // -----------------------------------------------------------------------------
@@ -221,6 +414,459 @@ int l_get_locker(lua_State *L) {
 	return 1;
 }
 
+static void push_hist(lua_State *L, const struct histogram *h, double max) {
+	lua_createtable(L, 0, 5);
+	 lua_pushinteger(L, (lua_Integer)h->total);
+	 lua_setfield(L, -2, "count");
+	 lua_pushnumber(L, hist_percentile(h, 0.50, max));
+	 lua_setfield(L, -2, "p50");
+	 lua_pushnumber(L, hist_percentile(h, 0.90, max));
+	 lua_setfield(L, -2, "p90");
+	 lua_pushnumber(L, hist_percentile(h, 0.99, max));
+	 lua_setfield(L, -2, "p99");
+	 lua_pushnumber(L, max);
+	 lua_setfield(L, -2, "max");
+}
+
+// _lock_stats() -> {[locker name] = {count = n, contended = n, ...}, ...}
+// wait and hold are {count = n, p50 = ms, p90 = ms, p99 = ms, max = ms}
+// blocked_by is {[locker name] = n}: who was holding the lock when this one
+//  had to wait
+// times are in ms
+int l_lock_stats(lua_State *L) {
+	pthread_mutex_lock(&lock_mutex);
+	size_t cnt = locker_stats_cnt;
+	pthread_mutex_unlock(&lock_mutex);
+	lua_createtable(L, 0, (int)cnt);
+	for (size_t i = 0; i < cnt; i++) {
+		const struct locker_stats *st = &locker_stats[i];
+		lua_createtable(L, 0, 10);
+		 lua_pushinteger(L, (lua_Integer)st->count);
+		 lua_setfield(L, -2, "count");
+		 lua_pushinteger(L, (lua_Integer)st->contended);
+		 lua_setfield(L, -2, "contended");
+		 lua_pushinteger(L, (lua_Integer)st->timeouts);
+		 lua_setfield(L, -2, "timeouts");
+		 lua_pushnumber(L, st->wait_total);
+		 lua_setfield(L, -2, "wait_total");
+		 lua_pushnumber(L, st->wait_max);
+		 lua_setfield(L, -2, "wait_max");
+		 lua_pushnumber(L, st->hold_total);
+		 lua_setfield(L, -2, "hold_total");
+		 lua_pushnumber(L, st->hold_max);
+		 lua_setfield(L, -2, "hold_max");
+		 push_hist(L, &st->wait_hist, st->wait_max);
+		 lua_setfield(L, -2, "wait");
+		 push_hist(L, &st->hold_hist, st->hold_max);
+		 lua_setfield(L, -2, "hold");
+		 lua_createtable(L, 0, 0);
+		 for (size_t j = 0; j < cnt; j++) {
+		 	if (st->blocked_by[j] == 0) continue;
+		 	lua_pushinteger(L, (lua_Integer)st->blocked_by[j]);
+		 	lua_setfield(L, -2, locker_stats[j].name);
+		 }
+		 lua_setfield(L, -2, "blocked_by");
+		lua_setfield(L, -2, st->name);
+	}
+	return 1;
+}
+
+// the same as a table for people to read
+static void write_lock_stats(FILE *f, const struct locker_stats *sts, size_t cnt) {
+	fprintf(f, "%-27s %8s %8s %8s  %31s  %31s\n",
+	    "locker", "count", "waited", "timeouts",
+	    "wait ms p50/p90/p99/max", "hold ms p50/p90/p99/max");
+	for (size_t i = 0; i < cnt; i++) {
+		const struct locker_stats *st = &sts[i];
+		const struct histogram *w = &st->wait_hist, *h = &st->hold_hist;
+		fprintf(f, "%-27s %8zu %8zu %8zu "
+		    " %7.2f %7.2f %7.2f %7.2f "
+		    " %7.2f %7.2f %7.2f %7.2f\n",
+		    st->name, st->count, st->contended, st->timeouts,
+		    hist_percentile(w, 0.50, st->wait_max),
+		    hist_percentile(w, 0.90, st->wait_max),
+		    hist_percentile(w, 0.99, st->wait_max),
+		    st->wait_max,
+		    hist_percentile(h, 0.50, st->hold_max),
+		    hist_percentile(h, 0.90, st->hold_max),
+		    hist_percentile(h, 0.99, st->hold_max),
+		    st->hold_max);
+	}
+	bool header = false;
+	for (size_t i = 0; i < cnt; i++) {
+		for (size_t j = 0; j < cnt; j++) {
+			if (sts[i].blocked_by[j] == 0) continue;
+			if (!header) {
+				fprintf(f, "\nblocked (holder -> waiter):\n");
+				header = true;
+			}
+			fprintf(f, "  %s -> %s: %u\n",
+			    sts[j].name, sts[i].name, sts[i].blocked_by[j]);
+		}
+	}
+}
+
+// _lock_stats_text() -> string
+int l_lock_stats_text(lua_State *L) {
+	pthread_mutex_lock(&lock_mutex);
+	size_t cnt = locker_stats_cnt;
+	pthread_mutex_unlock(&lock_mutex);
+	char *s = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&s, &len);
+	if (unlikely(f == NULL)) return luaL_error(L, "open_memstream: %s", strerror(errno));
+	write_lock_stats(f, locker_stats, cnt);
+	fclose(f);
+	lua_pushlstring(L, s, len);
+	free(s);
+	return 1;
+}
+
+// -----------------------------------------------------------------------------
+
+// writing the stats to a file every so often
+// the thread takes the lua lock only to copy the stats and writes the file
+//  after letting go of it
+
+static pthread_mutex_t stats_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  stats_file_cond = PTHREAD_COND_INITIALIZER;
+static char           *stats_file_path; // NULL: off
+static double          stats_file_interval;
+static bool            stats_file_quit;
+static pthread_t       stats_file_thread;
+
+static void write_lock_stats_file(const char *path) {
+	static struct locker_stats snapshot[MAX_LOCKERS];
+	size_t cnt;
+
+	if (!lua_lock_state("lock_stats")) return;
+	pthread_mutex_lock(&lock_mutex);
+	cnt = locker_stats_cnt;
+	pthread_mutex_unlock(&lock_mutex);
+	memcpy(snapshot, locker_stats, cnt*sizeof(*snapshot));
+	lua_unlock_state_no_click();
+
+	char tmp[4096];
+	if (unlikely((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))) return;
+	FILE *f = fopen(tmp, "w");
+	if (unlikely(f == NULL)) {
+V		eprintln("lock_stats: %s: %s", tmp, strerror(errno));
+		return;
+	}
+	write_lock_stats(f, snapshot, cnt);
+	if (unlikely(fclose(f) != 0 || rename(tmp, path) != 0)) {
+V		eprintln("lock_stats: %s: %s", path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+static void *stats_file_main(void *ud) {
+	(void)ud;
+	set_thread_name("lock_stats");
+
+	pthread_mutex_lock(&stats_file_mutex);
+	while (!stats_file_quit) {
+		if (stats_file_path == NULL) {
+			pthread_cond_wait(&stats_file_cond, &stats_file_mutex);
+			continue;
+		}
+		struct timespec ts = {0};
+		clock_gettime(CLOCK_REALTIME, &ts);
+		double end = (double)ts.tv_nsec/1e9+stats_file_interval/1000.0;
+		ts.tv_sec += (time_t)end;
+		ts.tv_nsec = (long)((end-floor(end))*1e9);
+		int err = pthread_cond_timedwait(&stats_file_cond, &stats_file_mutex, &ts);
+		// woken up early -> the settings changed, start over
+		if (err != ETIMEDOUT || stats_file_quit || stats_file_path == NULL) continue;
+		char *path = strdup(stats_file_path);
+		pthread_mutex_unlock(&stats_file_mutex);
+		if (likely(path != NULL)) {
+			write_lock_stats_file(path);
+			free(path);
+		}
+		pthread_mutex_lock(&stats_file_mutex);
+	}
+	pthread_mutex_unlock(&stats_file_mutex);
+
+	return NULL;
+}
+
+// _set_lock_stats_file(path or nil, interval_ms)
+// the thread is started the first time and then kept around
+int l_set_lock_stats_file(lua_State *L) {
+	const char *path = luaL_optstring(L, 1, NULL);
+	double interval = luaL_optnumber(L, 2, 5000.0);
+	luaL_argcheck(L, interval >= 100.0, 2, "must be at least 100 ms");
+
+	char *copy = NULL;
+	if (path != NULL) {
+		copy = strdup(path);
+		if (unlikely(copy == NULL)) return luaL_error(L, "out of memory");
+	}
+
+	pthread_mutex_lock(&stats_file_mutex);
+	free(exchange(stats_file_path, copy));
+	stats_file_interval = interval;
+	if (stats_file_thread == 0 && copy != NULL && !stats_file_quit) {
+		int err = pthread_create(&stats_file_thread, NULL, stats_file_main, NULL);
+		if (unlikely(err != 0)) {
+			stats_file_thread = 0;
+			free(exchange(stats_file_path, NULL));
+			pthread_mutex_unlock(&stats_file_mutex);
+			return luaL_error(L, "pthread_create: %s", strerror(err));
+		}
+	}
+	pthread_cond_signal(&stats_file_cond);
+	pthread_mutex_unlock(&stats_file_mutex);
+	return 0;
+}
+
+// called by lua_deinit() before it takes the lock
+void lock_stats_file_deinit(void) {
+	pthread_mutex_lock(&stats_file_mutex);
+	stats_file_quit = true;
+	pthread_cond_signal(&stats_file_cond);
+	pthread_t thread = exchange(stats_file_thread, 0);
+	pthread_mutex_unlock(&stats_file_mutex);
+	if (thread == 0) return;
+
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += LOCK_TIMEOUT_SEC+1;
+	if (pthread_timedjoin_np(thread, NULL, &ts) != 0) return;
+
+	free(exchange(stats_file_path, NULL));
+}
+
+// -----------------------------------------------------------------------------
+
+// garbage collection in the background
+// lua's own collector still runs as things are allocated, this thread does
+//  extra work in small slices while the lock isn't wanted by anyone else so
+//  that there's less of it left to do in the middle of a cfgfs_read
+// builtin.lua asks for a cycle (_gc_soon()) where it used to call
+//  collectgarbage(). a full collection is only started when no game-facing
+//  locker is waiting, until then it's done in slices like the rest
+
+static pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gc_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       gc_thread;
+static bool            gc_quit;
+
+// requests, protected by gc_mutex
+static bool gc_want_cycle;
+static bool gc_want_full;
+
+// settings, protected by gc_mutex
+#define GC_DEFAULT_BUDGET_MS 1.0
+#define GC_DEFAULT_INTERVAL_MS 250.0
+#define GC_DEFAULT_STEP_KB 16
+static double gc_budget_ms = GC_DEFAULT_BUDGET_MS;
+static double gc_interval_ms = GC_DEFAULT_INTERVAL_MS; // 0: only on request
+static int    gc_step_kb = GC_DEFAULT_STEP_KB;
+
+// protected by the lua lock
+static bool gc_generational;
+
+// stats, updated with the lua lock held
+static struct {
+	size_t slices;
+	size_t yielded; // slices cut short for a game-facing locker
+	size_t cycles;
+	size_t full;
+	double total;
+	double max;
+	struct histogram pauses;
+} gc_stats;
+
+static void gc_note_pause(double ms) {
+	gc_stats.total += ms;
+	if (ms > gc_stats.max) gc_stats.max = ms;
+	hist_add(&gc_stats.pauses, ms);
+}
+
+// does one slice with the lua lock held
+// requested: finish the current cycle (or start one) within the budget
+// otherwise: one step, as if step_kb more had been allocated
+// returns true if the cycle that was asked for is done
+static bool gc_slice(bool requested, bool full, double budget, int step_kb) {
+	double start = mono_ms();
+	bool done = false;
+
+	if (!requested) {
+		if (lua_gc(g_L, LUA_GCSTEP, step_kb)) gc_stats.cycles += 1;
+	} else if (full && !lua_lock_should_yield()) {
+		lua_gc(g_L, LUA_GCCOLLECT);
+		gc_stats.full += 1;
+		gc_stats.cycles += 1;
+		done = true;
+	} else if (gc_generational) {
+		// one young collection is all there is to do
+		lua_gc(g_L, LUA_GCSTEP, 0);
+		gc_stats.cycles += 1;
+		done = !full;
+	} else {
+		while (mono_ms()-start < budget) {
+			if (lua_lock_should_yield()) {
+				gc_stats.yielded += 1;
+				break;
+			}
+			// 0: do a step now whatever the debt is. returns 1 at the
+			//  end of a cycle
+			if (lua_gc(g_L, LUA_GCSTEP, 0)) {
+				gc_stats.cycles += 1;
+				done = !full;
+				break;
+			}
+		}
+	}
+
+	gc_stats.slices += 1;
+	gc_note_pause(mono_ms()-start);
+	return done;
+}
+
+static void *gc_main(void *ud) {
+	(void)ud;
+	set_thread_name("lua_gc");
+
+	pthread_mutex_lock(&gc_mutex);
+	while (!gc_quit) {
+		bool requested = (gc_want_cycle || gc_want_full);
+		if (!requested) {
+			if (gc_interval_ms <= 0.0) {
+				pthread_cond_wait(&gc_cond, &gc_mutex);
+				continue;
+			}
+			struct timespec ts = {0};
+			clock_gettime(CLOCK_REALTIME, &ts);
+			double end = (double)ts.tv_nsec/1e9+gc_interval_ms/1000.0;
+			ts.tv_sec += (time_t)end;
+			ts.tv_nsec = (long)((end-floor(end))*1e9);
+			int err = pthread_cond_timedwait(&gc_cond, &gc_mutex, &ts);
+			// woken up -> something was asked for or the settings changed
+			if (err != ETIMEDOUT) continue;
+		}
+
+		bool full = gc_want_full;
+		double budget = gc_budget_ms;
+		int step_kb = gc_step_kb;
+		pthread_mutex_unlock(&gc_mutex);
+
+		bool done = false;
+		if (lua_lock_state("lua_gc")) {
+			done = gc_slice(requested, full, budget, step_kb);
+			lua_unlock_state();
+		}
+
+		pthread_mutex_lock(&gc_mutex);
+		if (done) {
+			gc_want_cycle = false;
+			if (full) gc_want_full = false;
+		}
+		if (requested && !done && !gc_quit) {
+			// give the others a turn before the next slice
+			pthread_mutex_unlock(&gc_mutex);
+			usleep((useconds_t)(budget*1000.0));
+			pthread_mutex_lock(&gc_mutex);
+		}
+	}
+	pthread_mutex_unlock(&gc_mutex);
+
+	return NULL;
+}
+
+void lua_gc_init(void) {
+	if (gc_thread != 0) return;
+	int err = pthread_create(&gc_thread, NULL, gc_main, NULL);
+	if (unlikely(err != 0)) {
+		eprintln("lua_gc: pthread_create: %s", strerror(err));
+		gc_thread = 0;
+	}
+}
+
+// called by lua_deinit() before it takes the lock
+void lua_gc_deinit(void) {
+	pthread_mutex_lock(&gc_mutex);
+	gc_quit = true;
+	pthread_cond_signal(&gc_cond);
+	pthread_t thread = exchange(gc_thread, 0);
+	pthread_mutex_unlock(&gc_mutex);
+	if (thread == 0) return;
+
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += LOCK_TIMEOUT_SEC+1;
+	pthread_timedjoin_np(thread, NULL, &ts);
+}
+
+// _gc_soon(full)
+// asks for a collection cycle to be done in slices, or a full collection once
+//  nothing game-facing is waiting for the lock
+int l_gc_soon(lua_State *L) {
+	bool full = lua_toboolean(L, 1);
+	pthread_mutex_lock(&gc_mutex);
+	gc_want_cycle = true;
+	if (full) gc_want_full = true;
+	pthread_cond_signal(&gc_cond);
+	pthread_mutex_unlock(&gc_mutex);
+	return 0;
+}
+
+// _set_gc(mode, budget_ms, interval_ms, step_kb)
+// mode is "incremental" or "generational" (nil: incremental), the rest go
+//  back to the defaults when nil
+int l_set_gc(lua_State *L) {
+	static const char *const modes[] = {"incremental", "generational", NULL};
+	int mode = luaL_checkoption(L, 1, "incremental", modes);
+	double budget = luaL_optnumber(L, 2, GC_DEFAULT_BUDGET_MS);
+	double interval = luaL_optnumber(L, 3, GC_DEFAULT_INTERVAL_MS);
+	lua_Integer step_kb = luaL_optinteger(L, 4, GC_DEFAULT_STEP_KB);
+	luaL_argcheck(L, budget > 0.0 && budget <= 16.0, 2, "must be between 0 and 16 ms");
+	luaL_argcheck(L, interval == 0.0 || interval >= 10.0, 3, "must be 0 or at least 10 ms");
+	luaL_argcheck(L, step_kb > 0 && step_kb <= 1024*1024, 4, "out of range");
+
+	// 0 for the other arguments: keep lua's current values
+	if (mode == 0) {
+		lua_gc(L, LUA_GCINC, 0, 0, 0);
+	} else {
+		lua_gc(L, LUA_GCGEN, 0, 0);
+	}
+	gc_generational = (mode == 1);
+
+	pthread_mutex_lock(&gc_mutex);
+	gc_budget_ms = budget;
+	gc_interval_ms = interval;
+	gc_step_kb = (int)step_kb;
+	pthread_cond_signal(&gc_cond);
+	pthread_mutex_unlock(&gc_mutex);
+	return 0;
+}
+
+// _gc_stats() -> {slices = n, yielded = n, cycles = n, full = n, total = ms,
+//                 pause = {count = n, p50 = ms, p90 = ms, p99 = ms, max = ms},
+//                 kb = heap size}
+int l_gc_stats(lua_State *L) {
+	lua_createtable(L, 0, 7);
+	 lua_pushinteger(L, (lua_Integer)gc_stats.slices);
+	 lua_setfield(L, -2, "slices");
+	 lua_pushinteger(L, (lua_Integer)gc_stats.yielded);
+	 lua_setfield(L, -2, "yielded");
+	 lua_pushinteger(L, (lua_Integer)gc_stats.cycles);
+	 lua_setfield(L, -2, "cycles");
+	 lua_pushinteger(L, (lua_Integer)gc_stats.full);
+	 lua_setfield(L, -2, "full");
+	 lua_pushnumber(L, gc_stats.total);
+	 lua_setfield(L, -2, "total");
+	 push_hist(L, &gc_stats.pauses, gc_stats.max);
+	 lua_setfield(L, -2, "pause");
+	 lua_pushnumber(L, (lua_Number)lua_gc(L, LUA_GCCOUNT)+(lua_Number)lua_gc(L, LUA_GCCOUNTB)/1024.0);
+	 lua_setfield(L, -2, "kb");
+	return 1;
+}
+
+// -----------------------------------------------------------------------------
+
 const char *lua_get_locker(lua_State *L) {
 	// note: L may be the lua_State of a different coroutine here
 D	assert(L != NULL);
@@ -33,5 +33,15 @@ void lua_unlock_state_and_click(void);
 #define lua_release_state_and_click(L) ({ (void)(L); lua_unlock_state_and_click(); })
 #define lua_release_state_no_click(L) ({ (void)(L); lua_unlock_state_no_click(); })
 
+// true if a game-facing locker is waiting for the lock
+// background lockers can check this between pieces of work and let go early
+bool lua_lock_should_yield(void);
+
 int l_get_locker(lua_State *L);
+int l_lock_stats(lua_State *L);
+int l_lock_stats_text(lua_State *L);
+int l_set_lock_stats_file(lua_State *L);
+int l_gc_soon(lua_State *L);
+int l_set_gc(lua_State *L);
+int l_gc_stats(lua_State *L);
 const char *lua_get_locker(lua_State *L);
@@ -5,3 +5,8 @@ void *lua_get_state_unchecked(void);
 
 _Bool lua_lock_state_unchecked(void);
 void lua_unlock_state_unchecked(void);
+
+void lock_stats_file_deinit(void);
+
+void lua_gc_init(void);
+void lua_gc_deinit(void);
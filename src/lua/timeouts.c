@@ -0,0 +1,370 @@
+#include "timeouts.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../macros.h"
+
+// timer queue for wait() in builtin.lua
+// entries are kept in a binary min-heap ordered by (target, gen, insertion
+//  order). the waiting coroutines themselves are stored in the userdata's
+//  user value table (slot -> coroutine) so that lua can collect them normally
+// handle = (generation << 32) | slot. the generation changes every time a slot
+//  is reused so a stale handle can't cancel someone else's timeout
+
+#define TQ_MT "cfgfs_timeout_queue"
+
+enum slot_state {
+	st_free = 0,
+	st_heap = 1,
+	st_deferred = 2,
+};
+
+struct tq_slot {
+	double      target;
+	double      delay; // for _list_timeouts()
+	lua_Integer gen;
+	lua_Integer ticket; // which use of the coroutine this is for
+	uint64_t    seq;
+	uint32_t    slotgen;
+	uint32_t    state;
+	uint32_t    idx; // position in heap/deferred, or next free slot
+};
+
+struct timeout_queue {
+	struct tq_slot *slots;
+	uint32_t        cap;
+	uint32_t        free_head;
+
+	uint32_t *heap;
+	uint32_t  heap_size;
+
+	// expired entries that were too new to pop during the current round
+	// they're put back in the heap when the round ends
+	uint32_t   *deferred;
+	uint32_t    deferred_size;
+	lua_Integer deferred_maxgen;
+
+	uint64_t seq;
+};
+
+#define NO_SLOT UINT32_MAX
+
+// -----------------------------------------------------------------------------
+
+// heap helpers
+
+static inline bool tq_less(const struct timeout_queue *q, uint32_t a, uint32_t b) {
+	const struct tq_slot *sa = &q->slots[q->heap[a]];
+	const struct tq_slot *sb = &q->slots[q->heap[b]];
+	if (sa->target != sb->target) return sa->target < sb->target;
+	if (sa->gen != sb->gen) return sa->gen < sb->gen;
+	return sa->seq < sb->seq;
+}
+
+static inline void tq_swap(struct timeout_queue *q, uint32_t a, uint32_t b) {
+	uint32_t tmp = q->heap[a];
+	q->heap[a] = q->heap[b];
+	q->heap[b] = tmp;
+	q->slots[q->heap[a]].idx = a;
+	q->slots[q->heap[b]].idx = b;
+}
+
+static void tq_up(struct timeout_queue *q, uint32_t i) {
+	while (i > 0) {
+		uint32_t parent = (i-1)/2;
+		if (!tq_less(q, i, parent)) break;
+		tq_swap(q, i, parent);
+		i = parent;
+	}
+}
+
+static void tq_down(struct timeout_queue *q, uint32_t i) {
+	for (;;) {
+		uint32_t l = 2*i+1, r = 2*i+2, smallest = i;
+		if (l < q->heap_size && tq_less(q, l, smallest)) smallest = l;
+		if (r < q->heap_size && tq_less(q, r, smallest)) smallest = r;
+		if (smallest == i) break;
+		tq_swap(q, i, smallest);
+		i = smallest;
+	}
+}
+
+static void tq_heap_push(struct timeout_queue *q, uint32_t slot) {
+	q->slots[slot].state = st_heap;
+	q->slots[slot].idx = q->heap_size;
+	q->heap[q->heap_size++] = slot;
+	tq_up(q, q->heap_size-1);
+}
+
+// takes the slot out of the heap or the deferred list (doesn't free it)
+static void tq_unlink(struct timeout_queue *q, uint32_t slot) {
+	struct tq_slot *s = &q->slots[slot];
+	uint32_t i = s->idx;
+	if (s->state == st_heap) {
+D		assert(i < q->heap_size && q->heap[i] == slot);
+		q->heap_size -= 1;
+		if (i != q->heap_size) {
+			q->heap[i] = q->heap[q->heap_size];
+			q->slots[q->heap[i]].idx = i;
+			tq_down(q, i);
+			tq_up(q, i);
+		}
+	} else {
+D		assert(s->state == st_deferred);
+D		assert(i < q->deferred_size && q->deferred[i] == slot);
+		q->deferred_size -= 1;
+		if (i != q->deferred_size) {
+			q->deferred[i] = q->deferred[q->deferred_size];
+			q->slots[q->deferred[i]].idx = i;
+		}
+	}
+}
+
+static void tq_free_slot(struct timeout_queue *q, uint32_t slot) {
+	struct tq_slot *s = &q->slots[slot];
+	s->state = st_free;
+	s->slotgen += 1;
+	s->idx = q->free_head;
+	q->free_head = slot;
+}
+
+static void tq_undefer_all(struct timeout_queue *q) {
+	while (q->deferred_size != 0) {
+		uint32_t slot = q->deferred[--q->deferred_size];
+		tq_heap_push(q, slot);
+	}
+}
+
+static bool tq_grow(struct timeout_queue *q) {
+	uint32_t newcap = (q->cap != 0) ? q->cap*2 : 32;
+	struct tq_slot *slots = realloc(q->slots, newcap*sizeof(struct tq_slot));
+	if (unlikely(slots == NULL)) return false;
+	q->slots = slots;
+	uint32_t *heap = realloc(q->heap, newcap*sizeof(uint32_t));
+	if (unlikely(heap == NULL)) return false;
+	q->heap = heap;
+	uint32_t *deferred = realloc(q->deferred, newcap*sizeof(uint32_t));
+	if (unlikely(deferred == NULL)) return false;
+	q->deferred = deferred;
+	for (uint32_t i = newcap; i-- > q->cap;) {
+		memset(&q->slots[i], 0, sizeof(struct tq_slot));
+		q->slots[i].idx = q->free_head;
+		q->free_head = i;
+	}
+	q->cap = newcap;
+	return true;
+}
+
+static inline lua_Integer tq_handle(const struct timeout_queue *q, uint32_t slot) {
+	return (lua_Integer)(((uint64_t)q->slots[slot].slotgen << 32) | slot);
+}
+
+// returns NO_SLOT if the handle is stale
+static uint32_t tq_slot_from_handle(const struct timeout_queue *q, lua_Integer handle) {
+	uint32_t slot = (uint32_t)((uint64_t)handle & 0xffffffff);
+	uint32_t slotgen = (uint32_t)((uint64_t)handle >> 32);
+	if (slot >= q->cap) return NO_SLOT;
+	if (q->slots[slot].state == st_free) return NO_SLOT;
+	if (q->slots[slot].slotgen != slotgen) return NO_SLOT;
+	return slot;
+}
+
+// pushes the coroutine for slot and removes it from the user value table
+static void tq_take_co(lua_State *L, int qidx, uint32_t slot) {
+	lua_getiuservalue(L, qidx, 1);
+	 lua_rawgeti(L, -1, (lua_Integer)slot+1);
+	  lua_pushnil(L);
+	  lua_rawseti(L, -3, (lua_Integer)slot+1);
+	lua_remove(L, -2);
+}
+
+// -----------------------------------------------------------------------------
+
+static struct timeout_queue *check_tq(lua_State *L) {
+	return luaL_checkudata(L, 1, TQ_MT);
+}
+
+// q:insert(target, gen, co, delay, ticket) -> handle
+static int l_tq_insert(lua_State *L) {
+	struct timeout_queue *q = check_tq(L);
+	double target = luaL_checknumber(L, 2);
+	lua_Integer gen = luaL_checkinteger(L, 3);
+	luaL_checktype(L, 4, LUA_TTHREAD);
+	double delay = luaL_optnumber(L, 5, 0.0);
+	lua_Integer ticket = luaL_optinteger(L, 6, 0);
+
+	if (unlikely(q->free_head == NO_SLOT && !tq_grow(q))) {
+		return luaL_error(L, "timeout queue: out of memory");
+	}
+	uint32_t slot = q->free_head;
+	struct tq_slot *s = &q->slots[slot];
+	q->free_head = s->idx;
+
+	s->target = target;
+	s->delay = delay;
+	s->gen = gen;
+	s->ticket = ticket;
+	s->seq = q->seq++;
+	tq_heap_push(q, slot);
+
+	lua_getiuservalue(L, 1, 1);
+	 lua_pushvalue(L, 4);
+	 lua_rawseti(L, -2, (lua_Integer)slot+1);
+	lua_pop(L, 1);
+
+	lua_pushinteger(L, tq_handle(q, slot));
+	return 1;
+}
+
+// q:cancel(handle) -> coroutine or nil if it wasn't queued anymore
+static int l_tq_cancel(lua_State *L) {
+	struct timeout_queue *q = check_tq(L);
+	lua_Integer handle = luaL_checkinteger(L, 2);
+	uint32_t slot = tq_slot_from_handle(q, handle);
+	if (slot == NO_SLOT) {
+		lua_pushnil(L);
+		return 1;
+	}
+	tq_unlink(q, slot);
+	tq_free_slot(q, slot);
+	tq_take_co(L, 1, slot);
+	return 1;
+}
+
+// q:pop(now, maxgen) -> co, target, delay, ticket
+// pops the earliest timeout that has expired (target <= now) and was added in
+//  generation maxgen or earlier. returns nothing when there are none left
+static int l_tq_pop(lua_State *L) {
+	struct timeout_queue *q = check_tq(L);
+	double now = luaL_checknumber(L, 2);
+	lua_Integer maxgen = luaL_checkinteger(L, 3);
+
+	// leftovers from a round that didn't finish?
+	if (unlikely(q->deferred_size != 0 && q->deferred_maxgen != maxgen)) {
+		tq_undefer_all(q);
+	}
+	q->deferred_maxgen = maxgen;
+
+	while (q->heap_size != 0) {
+		uint32_t slot = q->heap[0];
+		struct tq_slot *s = &q->slots[slot];
+		if (s->target > now) break;
+		tq_unlink(q, slot);
+		if (s->gen <= maxgen) {
+			double target = s->target;
+			double delay = s->delay;
+			lua_Integer ticket = s->ticket;
+			tq_free_slot(q, slot);
+			tq_take_co(L, 1, slot);
+			lua_pushnumber(L, target);
+			lua_pushnumber(L, delay);
+			lua_pushinteger(L, ticket);
+			return 4;
+		}
+		// added during this round, keep it out of the way until the
+		//  round is over
+		s->state = st_deferred;
+		s->idx = q->deferred_size;
+		q->deferred[q->deferred_size++] = slot;
+	}
+
+	tq_undefer_all(q);
+	return 0;
+}
+
+// q:list() -> array of {co, target, gen, delay} in no particular order
+__attribute__((minsize))
+static int l_tq_list(lua_State *L) {
+	struct timeout_queue *q = check_tq(L);
+	lua_getiuservalue(L, 1, 1);
+	int cos = lua_gettop(L);
+	lua_createtable(L, (int)(q->heap_size+q->deferred_size), 0);
+	int n = 0;
+	for (uint32_t slot = 0; slot < q->cap; slot++) {
+		const struct tq_slot *s = &q->slots[slot];
+		if (s->state == st_free) continue;
+		lua_createtable(L, 0, 4);
+		 lua_rawgeti(L, cos, (lua_Integer)slot+1);
+		 lua_setfield(L, -2, "co");
+		 lua_pushnumber(L, s->target);
+		 lua_setfield(L, -2, "target");
+		 lua_pushinteger(L, s->gen);
+		 lua_setfield(L, -2, "gen");
+		 lua_pushnumber(L, s->delay);
+		 lua_setfield(L, -2, "delay");
+		lua_rawseti(L, -2, ++n);
+	}
+	return 1;
+}
+
+// q:clear()
+static int l_tq_clear(lua_State *L) {
+	struct timeout_queue *q = check_tq(L);
+	for (uint32_t slot = 0; slot < q->cap; slot++) {
+		if (q->slots[slot].state != st_free) {
+			tq_unlink(q, slot);
+			tq_free_slot(q, slot);
+		}
+	}
+	q->seq = 0;
+	lua_newtable(L);
+	lua_setiuservalue(L, 1, 1);
+	return 0;
+}
+
+static int l_tq_len(lua_State *L) {
+	struct timeout_queue *q = check_tq(L);
+	lua_pushinteger(L, (lua_Integer)(q->heap_size+q->deferred_size));
+	return 1;
+}
+
+static int l_tq_gc(lua_State *L) {
+	struct timeout_queue *q = check_tq(L);
+	free(exchange(q->slots, NULL));
+	free(exchange(q->heap, NULL));
+	free(exchange(q->deferred, NULL));
+	q->cap = 0;
+	q->heap_size = 0;
+	q->deferred_size = 0;
+	q->free_head = NO_SLOT;
+	return 0;
+}
+
+static const luaL_Reg tq_methods[] = {
+	{"insert", l_tq_insert},
+	{"cancel", l_tq_cancel},
+	{"pop", l_tq_pop},
+	{"list", l_tq_list},
+	{"clear", l_tq_clear},
+	{NULL, NULL},
+};
+
+// _timeout_queue_new() -> q
+static int l_timeout_queue_new(lua_State *L) {
+	struct timeout_queue *q = lua_newuserdatauv(L, sizeof(struct timeout_queue), 1);
+	memset(q, 0, sizeof(struct timeout_queue));
+	q->free_head = NO_SLOT;
+
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+
+	if (luaL_newmetatable(L, TQ_MT)) {
+		luaL_newlib(L, tq_methods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, l_tq_len);
+		lua_setfield(L, -2, "__len");
+		lua_pushcfunction(L, l_tq_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+const luaL_Reg l_timeouts_fns[] = {
+	{"_timeout_queue_new", l_timeout_queue_new},
+	{NULL, NULL},
+};
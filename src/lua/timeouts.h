@@ -0,0 +1,5 @@
+#pragma once
+
+#include <lauxlib.h>
+
+extern const luaL_Reg l_timeouts_fns[];
@@ -37,15 +37,20 @@
 #include <lauxlib.h>
 
 #include "attention.h"
+#include "binds.h"
 #include "buffer_list.h"
 #include "buffers.h"
 #include "cfg.h"
+#include "charclass.h"
 #include "cli_input.h"
 #include "cli_output.h"
 #include "cli_scrollback.h"
 #include "click.h"
+#include "console_log.h"
 #include "click_thread.h"
 #include "keys.h"
+#include "logindex.h"
+#include "logwriter.h"
 #include "lua.h"
 #include "macros.h"
 #include "misc/string.h"
@@ -412,7 +417,7 @@ V		eprintln("cfgfs_read: can't read this type of file!");
 		return -EOPNOTSUPP;
 	}
 
-	if (unlikely(size < reported_cfg_size)) {
+	if (unlikely(size < min_reported_cfg_size)) {
 		eprintln("warning: cfgfs_read: read size %zu is too small, ignoring request", size);
 #if defined(__linux__)
 		// don't abort on windows. reads from "type" in cmd.exe are 512 bytes but i haven't seen anything like that on linux
@@ -458,6 +463,14 @@ D		abort();
 			unmask_cnt = UNMASK_IGNORE_CNT;
 			return 0;
 		}
+
+		// simple keybind? these don't need lua
+		rv = binds_try_read(path, pathlen, buf);
+		if (likely(rv >= 0)) {
+VV			eprintln("data=[[%.*s]] rv=%d", rv, buf, rv);
+			return rv;
+		}
+		rv = 0;
 	}
 
 	lua_State *L = lua_get_state("cfgfs_read");
@@ -465,17 +478,39 @@ D		abort();
 		return -errno;
 	}
 
+	// commands from other threads, they were queued before anything that lua
+	//  is about to write
+	cfg_emit_splice();
+
+	// the game wrote these before reading this file so lua should see them
+	//  first
+	console_log_drain_locked(L);
+
+	// thin out anything that piled up while nobody was reading
+	buffers_apply_backlog_policy();
+
+	// the game normally asks for what getattr() said but the live size might
+	//  have changed since then
+	size_t limit = reported_cfg_size;
+	if (unlikely(size < limit)) limit = size;
+
 	struct buffer fakebuf;
-	buffer_list_maybe_unshift_fake_buf(&buffers, &fakebuf, buf);
+	buffer_list_maybe_unshift_fake_buf(&buffers, &fakebuf, buf, limit);
 
 	 lua_pushvalue(L, GET_CONTENTS_IDX);
 	  lua_pushlstring(L, path, pathlen);
 	lua_call(L, 1, 0);
+	buffers_reset_lane();
 
-	struct buffer *ent = buffer_list_grab_first(&buffers);
+	struct buffer *ent = buffers_grab_for_read(buf, &fakebuf, limit);
+	buffers_note_read(size);
 
 	lua_release_state_no_click(L);
 
+	// emitted after cfg_emit_splice() above, their click may have been
+	//  dropped while this was going on
+	if (unlikely(cfg_emit_pending())) do_click();
+
 D	assert(ent != NULL); // should be fakebuf or a real one
 	rv = (int)buffer_get_size(ent);
 	if (unlikely(ent != &fakebuf)) {
@@ -512,12 +547,14 @@ VV	eprintln("cfgfs_write: %s (size=%lu, offset=%lu)", path, size, offset);
 		bool complete = (size >= 2 && data[size-1] == '\n') &&
 		                !(size == 2 && data[size-2] == '\r');
 #endif
+		// normally lua gets it from the console_log thread
+		if (likely(console_log_push(data, likely(complete) ? size-1 : size, complete))) {
+			return (int)size;
+		}
 		lua_State *L = lua_get_state("cfgfs_write/sft_console_log");
 		if (unlikely(L == NULL)) return -errno;
-		 lua_pushvalue(L, GAME_CONSOLE_OUTPUT_IDX);
-		  lua_pushlstring(L, data, likely(complete) ? size-1 : size);
-		   lua_pushboolean(L, complete);
-		lua_call(L, 2, 0);
+		console_log_drain_locked(L);
+		console_log_handle_write(L, data, likely(complete) ? size-1 : size, complete);
 		lua_release_state(L);
 		return (int)size;
 	}
@@ -942,7 +979,7 @@ int main(int argc, char **argv) {
 	}
 #endif
 
-	cfg_init_badchars();
+	charclass_init();
 
 	// === fuse stuff ===
 
@@ -1045,10 +1082,13 @@ D	assert(NULL != getenv("CFGFS_SCRIPT"));
 
 	click_init();
 	click_thread_init();
+	logwriter_init();
 	if (!lua_init()) {
 		rv = rv_cfgfs_lua_failed;
 		goto out_fuse_newed_and_mounted_and_signals_handled;
 	}
+	console_log_init();
+	logindex_init();
 #if defined(CFGFS_HAVE_ATTENTION)
 	attention_init();
 #endif
@@ -1090,7 +1130,10 @@ out_fuse_newed_and_mounted:
 out_fuse_newed:
 	fuse_destroy(fuse);
 out_no_fuse:
+	logindex_deinit();
+	console_log_deinit();
 	lua_deinit();
+	logwriter_deinit();
 #if defined(CFGFS_HAVE_ATTENTION)
 	attention_deinit();
 #endif
@@ -1,10 +1,25 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <stddef.h>
+
+// size of the configs we give to the game
+// it can be changed at runtime (see buffers.c) but it always stays between the
+//  min and the max. buffers are allocated with room for the max
 #if defined(REPORTED_CFG_SIZE)
- #define reported_cfg_size ((size_t)(REPORTED_CFG_SIZE))
+ #define default_reported_cfg_size ((size_t)(REPORTED_CFG_SIZE))
+#else
+ #define default_reported_cfg_size ((size_t)4096)
+#endif
+#if defined(MAX_REPORTED_CFG_SIZE)
+ #define max_reported_cfg_size ((size_t)(MAX_REPORTED_CFG_SIZE))
 #else
- #define reported_cfg_size ((size_t)4096)
+ #define max_reported_cfg_size ((size_t)16384)
 #endif
+#define min_reported_cfg_size ((size_t)1024)
+
+extern _Atomic(size_t) live_cfg_size;
+#define reported_cfg_size atomic_load_explicit(&live_cfg_size, memory_order_relaxed)
 
 void main_quit(void);
 
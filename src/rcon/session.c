@@ -20,6 +20,7 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include "../cfg.h"
 #include "../cli_output.h"
 #include "../lua.h"
 #include "../macros.h"
@@ -225,6 +226,11 @@ static void *rcon_reader_main(void *ud) {
 		auth_ok = true;
 	}
 auth_done:
+	if (!auth_ok) {
+		// tell whoever is playing, rcon() just fails
+		static const char *const msg[] = {"echo", "cfgfs: rcon authentication failed"};
+		cfg_emit(msg, 2);
+	}
 	{
 		lua_State *L = lua_get_state("rcon_reader");
 		if (L) {
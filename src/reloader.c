@@ -171,7 +171,9 @@ V	eprintln("reloader: reloading...");
 	get_or_init_inotify_fd();
 
 	buffer_list_reset(&buffers);
+	buffer_list_reset(&urgent_buffers);
 	buffer_list_reset(&init_cfg);
+	buffers_reset_lane();
 
 	lua_getglobal(L, "_reload_1");
 	 lua_call(L, 0, 1);
@@ -172,7 +172,9 @@ static void do_reload(void) {
 V	eprintln("reloader: reloading...");
 
 	buffer_list_reset(&buffers);
+	buffer_list_reset(&urgent_buffers);
 	buffer_list_reset(&init_cfg);
+	buffers_reset_lane();
 
 	lua_getglobal(L, "_reload_1");
 	 lua_call(L, 0, 1);
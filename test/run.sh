@@ -77,6 +77,15 @@ if ! { cat test/mnt/cfgfs/alias/testtest.cfg | fgrep -q '123123'; }; then
 	exit 11
 fi
 
+# key "a" is number 11
+
+if ! { cat test/mnt/cfgfs/keys/+11.cfg | fgrep -q '+attack'; }; then
+	exit 111
+fi
+if ! { cat test/mnt/cfgfs/keys/-11.cfg | fgrep -q -- '-attack'; }; then
+	exit 112
+fi
+
 # make sure ">" and ">>" both work
 
 echo ping1 >test/mnt/message/ping.1 || exit 121
@@ -89,6 +98,83 @@ if ! { cat test/mnt/cfgfs/buffer.cfg | fgrep -q 'pong2'; }; then
 	exit 132
 fi
 
+# cfg_emit() from a thread
+
+echo emit >test/mnt/message/emit || exit 141
+if ! { cat test/mnt/cfgfs/buffer.cfg | fgrep -q 'emitted from a thread'; }; then
+	exit 142
+fi
+
+# batches: the same lines as one at a time, even across buffers, and none
+#  from the ones that failed
+
+echo batch >test/mnt/message/batch || exit 171
+out=$(cat test/mnt/cfgfs/buffer.cfg) || exit 172
+all=$out
+while printf '%s\n' "$out" | fgrep -qx 'exec cfgfs/buffer'; do
+	out=$(cat test/mnt/cfgfs/buffer.cfg) || exit 173
+	all="$all
+$out"
+done
+if printf '%s\n' "$all" | fgrep -q cfgfs_test_batch_failed; then
+	exit 174
+fi
+res=$(printf '%s\n' "$all" | fgrep -vx 'exec cfgfs/buffer' | awk '
+	$0 == "echo cfgfs_test_batch_mark" { n++; i = 0; next }
+	n == 1 { a[++i] = $0; na = i }
+	n == 2 { if ($0 != a[++i]) bad = 1; nb = i }
+	n == 3 { c[++i] = $0; nc = i }
+	n == 4 { if ($0 != c[++i]) bad = 1; nd = i }
+	END { print (n == 5 && !bad && na == 150 && nb == 150 && nc == 150 && nd == 150) ? "ok" : "bad" }
+')
+if [ "$res" != ok ]; then
+	exit 175
+fi
+
+# coalescing: repeated sets of a cvar, alias or bind leave only the last one,
+#  but not across another command
+
+echo coalesce >test/mnt/message/coalesce || exit 151
+out=$(cat test/mnt/cfgfs/buffer.cfg) || exit 152
+sig=$(printf '%s\n' "$out" | awk '
+	/cfgfs_test_cvar/ { printf "c%s", $NF }
+	/cfgfs_test_alias/ { printf "a%s", ($0 ~ /coalesced 3/) ? 3 : "?" }
+	/kp_end/ { printf "b%s", ($0 ~ /coalesced 3/) ? 3 : "?" }
+	/coalesce barrier/ { printf "|" }
+')
+if [ "$sig" != "c3a3b3|c5" ]; then
+	>&2 echo "coalesce: $sig"
+	exit 153
+fi
+
+# both of cfgfs_init_log's con_logfile lines come out with coalescing on
+
+echo reinit_log >test/mnt/message/reinit_log || exit 156
+out=$(cat test/mnt/cfgfs/buffer.cfg) || exit 157
+if [ "$(printf '%s\n' "$out" | grep -c '^con_logfile ')" != 2 ]; then
+	exit 158
+fi
+
+# a buffer that had all of its lines replaced isn't read as just the exec
+
+echo coalesce_full >test/mnt/message/coalesce_full || exit 161
+out=$(cat test/mnt/cfgfs/buffer.cfg) || exit 162
+if ! { printf '%s\n' "$out" | fgrep -q cfgfs_test_coalescing_a_full_buffer_; }; then
+	exit 163
+fi
+all=$out
+while printf '%s\n' "$out" | fgrep -qx 'exec cfgfs/buffer'; do
+	out=$(cat test/mnt/cfgfs/buffer.cfg) || exit 164
+	all="$all
+$out"
+done
+if [ "$(printf '%s\n' "$all" | grep -c '^cfgfs_test_coalescing_a_full_buffer_[0-9]* 2$')" != 100 ]; then
+	exit 165
+fi
+if printf '%s\n' "$all" | grep -q '^cfgfs_test_coalescing_a_full_buffer_[0-9]* 1$'; then
+	exit 166
+fi
+
 # ------------------------------------------------------------------------------
 
 v do_unmount
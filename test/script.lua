@@ -19,6 +19,11 @@ assert(cmd_stringify('say', '"hi"') == 'say""hi""')
 
 assert(cmd_stringify('say', 'aa', 'b"b', 'cc') == 'say"aa b"b cc"')
 
+-- evil characters
+assert(cmd_stringify('x', 'a\0b') == 'x"a\127b')
+assert(cmd_stringify('say', 'a"b\n') == 'say"a"b\127"')
+assert(cmd_stringify('echo', 'a"b\n') == 'echo"a\'b\127\127')
+
 -- length limit
 assert(nil ~= cmd_stringify(string.rep('a', 510)))
 assert(nil == cmd_stringify(string.rep('a', 511)))
@@ -29,6 +34,154 @@ assert(nil == cmd_stringify('test', string.rep('a', 511-5)))
 assert(nil ~= cmd_stringify('a  a', string.rep('a', 510-6)))
 assert(nil == cmd_stringify('a  a', string.rep('a', 511-6)))
 
+-- batches are all or nothing
+assert(not pcall(cmd.batch, {{'echo', 'x'}, {'echo', {}}}))
+assert(not pcall(cmd.batch, {{'echo', 'x'}, {string.rep('a', 511)}}))
+assert(not pcall(cfg_lines, {'echo x', string.rep('a', 511)}))
+
+-- a coroutine that yielded goes back in the pool when it's done
+do
+	local co1, co3
+	spinoff(function ()
+		co1 = coroutine.running()
+		wait_for_event('_pool_test')
+	end)
+	fire_event('_pool_test')
+	spinoff(function ()
+		wait_for_event('_pool_test')
+	end)
+	spinoff(function ()
+		co3 = coroutine.running()
+	end)
+	assert(co3 == co1)
+	fire_event('_pool_test')
+	assert(coroutine_pool_stats().in_flight == 0)
+end
+
+-- a coroutine that's been reused can't be resumed through a stale handle
+do
+	local co1, co3
+	local woke = 0
+	spinoff(function ()
+		co1 = coroutine.running()
+		add_listener('_stale_test', co1) -- left behind on purpose
+		wait_for_event('_pool_test')
+	end)
+	fire_event('_pool_test')
+	spinoff(function ()
+		wait_for_event('_pool_test')
+	end)
+	spinoff(function ()
+		co3 = coroutine.running()
+		wait_for_event('_pool_test')
+		woke = woke+1
+	end)
+	assert(co3 == co1)
+	assert(fire_event('_stale_test') == 0)
+	assert(not has_listeners('_stale_test'))
+	assert(woke == 0)
+	fire_event('_pool_test')
+	assert(woke == 1)
+	assert(coroutine_pool_stats().in_flight == 0)
+end
+
+-- with_lane() is kept across a yield and doesn't leak while fn is waiting
+do
+	local lane = _get_lane()
+	local lanes = {}
+	spinoff(function ()
+		with_lane('urgent', function ()
+			wait_for_event('_lane_test')
+			table.insert(lanes, _get_lane())
+		end)
+		table.insert(lanes, _get_lane())
+	end)
+	assert(_get_lane() == lane)
+	fire_event('_lane_test')
+	assert(lanes[1] == 'urgent' and lanes[2] == lane)
+	assert(_get_lane() == lane)
+end
+
+-- a listener that can't be resumed doesn't leave fire_event() half done
+do
+	local co = coroutine.create(function () end)
+	coroutine.resume(co)
+	add_listener('_busy_test', co)
+	assert(not pcall(fire_event, '_busy_test'))
+	assert(not pcall(cancel_event)) -- not in an event anymore
+	remove_listener('_busy_test', co)
+	local calls = 0
+	local fn = function () calls = calls+1 end
+	add_listener('_busy_test', fn)
+	assert(fire_event('_busy_test') == 1 and calls == 1)
+	remove_listener('_busy_test', fn)
+	assert(not has_listeners('_busy_test'))
+end
+
+-- listeners changed while an event is going on
+do
+	local calls = {}
+	local a, b, c
+	a = function ()
+		table.insert(calls, 'a')
+		remove_listener('_ev_test', b) -- not called anymore
+		add_listener('_ev_test', c) -- not called until next time
+	end
+	b = function () table.insert(calls, 'b') end
+	c = function () table.insert(calls, 'c') end
+	add_listener('_ev_test', a)
+	add_listener('_ev_test', b)
+	assert(has_listeners('_ev_test'))
+	assert(fire_event('_ev_test') == 1)
+	assert(table.concat(calls) == 'a')
+	remove_listener('_ev_test', a)
+	assert(fire_event('_ev_test') == 1)
+	assert(table.concat(calls) == 'ac')
+	remove_listener('_ev_test', c)
+	assert(not has_listeners('_ev_test'))
+end
+
+-- vectorized character classification must match the scalar version
+do
+	local seeds = {
+		'test', 'aa', 'b b', 'cc', 'c c', 'a a', '', 'say', 'hi', '"hi"',
+		'b"b', 'a  a', string.rep('a', 510),
+	}
+	local all = {}
+	for i = 0, 255 do all[#all+1] = string.char(i) end
+	table.insert(seeds, table.concat(all))
+	local evil = '\0\1\t\n\r\31 "\'()/:;{|}~\127\128\255'
+	math.randomseed(1)
+	for _, seed in ipairs(seeds) do
+		for _ = 1, 20 do
+			local t = {}
+			for i = 1, math.random(0, 100) do
+				if math.random(4) == 1 then
+					local j = math.random(#evil)
+					t[i] = evil:sub(j, j)
+				elseif #seed > 0 then
+					local j = math.random(#seed)
+					t[i] = seed:sub(j, j)
+				else
+					t[i] = 'x'
+				end
+			end
+			local s = seed .. table.concat(t)
+			local ok, kernel, what = _charclass_check(s)
+			assert(ok, string.format('%s %s differs for %q', kernel, what, s))
+		end
+	end
+end
+
+-- console filters
+local f = compile_filters{'Unknown command "*"', 'pitch = #', '%*%*%* *', '*!'}
+assert(f:match('Unknown command "x"') == 1)
+assert(f:match('Unknown command "x') == nil)
+assert(f:match('pitch = -12') == 2)
+assert(f:match('pitch = 12x') == nil)
+assert(f:match('*** hi!') == 3)
+assert(f:match('hi!') == 4)
+
 
 
 cmd.testtest = function ()
@@ -53,7 +206,104 @@ add_listener('ping.2', function (data)
 	end
 end)
 
+-- commands from other threads go in the buffer without lua
+add_listener('emit', function (data)
+	if not data then
+		assert(_cfg_emit_test('echo', 'emitted from a thread'))
+	end
+end)
+
+-- cmd.batch{} and cfg_lines{} write the same as cmd() and cfg() would, and
+--  nothing at all if they fail (checked in run.sh)
+add_listener('batch', function (data)
+	if data then
+		return
+	end
+	assert(not pcall(cmd.batch, {{'echo', 'cfgfs_test_batch_failed'}, {'echo', {}}}))
+	assert(not pcall(cmd.batch, {{'echo', 'cfgfs_test_batch_failed'}, {string.rep('a', 511)}}))
+	assert(not pcall(cfg_lines, {'echo cfgfs_test_batch_failed', string.rep('a', 511)}))
+	-- enough to need a few buffers
+	local cmds, lines = {}, {}
+	for i = 1, 150 do
+		local n = i%4
+		if n == 0 then
+			cmds[i] = {'echo', 'cfgfs_test_batch', i} -- qm_echo
+		elseif n == 1 then
+			cmds[i] = {'say', 'cfgfs_test_batch "'..i..'"'} -- qm_say
+		elseif n == 2 then
+			cmds[i] = {'alias', 'cfgfs_test_batch', 'echo '..i..'; echo x'}
+		else
+			cmds[i] = {'cfgfs_test_batch', i}
+		end
+		lines[i] = string.format('echo cfgfs_test_batch line %d %s', i, string.rep('x', i%40))
+	end
+	cfg('echo cfgfs_test_batch_mark')
+	cmd.batch(cmds)
+	cfg('echo cfgfs_test_batch_mark')
+	for _, c in ipairs(cmds) do
+		cmd(table.unpack(c))
+	end
+	cfg('echo cfgfs_test_batch_mark')
+	cfg_lines(lines)
+	cfg('echo cfgfs_test_batch_mark')
+	for _, line in ipairs(lines) do
+		cfg(line)
+	end
+	cfg('echo cfgfs_test_batch_mark')
+end)
+
+-- coalescing (checked in run.sh)
+add_listener('coalesce', function (data)
+	if data then
+		return
+	end
+	set_coalescing(true)
+	for i = 1, 3 do
+		cvar.cfgfs_test_cvar = i
+		cmd.alias('cfgfs_test_alias', 'echo coalesced '..i)
+		cmd.bind('kp_end', 'echo coalesced '..i)
+	end
+	-- not replaced across this
+	cmd.echo('coalesce barrier')
+	cvar.cfgfs_test_cvar = 4
+	cvar.cfgfs_test_cvar = 5
+	set_coalescing(false)
+end)
+-- cfgfs_init_log sets con_logfile twice on purpose, that mustn't be merged
+do
+	set_coalescing(true)
+	local before = coalesce_stats().lines
+	cmd.cfgfs_init_log()
+	assert(coalesce_stats().lines == before)
+	set_coalescing(false)
+end
+add_listener('reinit_log', function (data)
+	if data then
+		return
+	end
+	set_coalescing(true)
+	cmd.cfgfs_init_log()
+	set_coalescing(false)
+end)
+-- fills more than one buffer and then replaces every line in the first one
+add_listener('coalesce_full', function (data)
+	if data then
+		return
+	end
+	set_coalescing(true)
+	for round = 1, 2 do
+		for i = 1, 100 do
+			cvar[string.format('cfgfs_test_coalescing_a_full_buffer_%03d', i)] = round
+		end
+	end
+	set_coalescing(false)
+end)
+
+
+
 
+-- plain string binds are answered by cfgfs_read() without lua
+bind('a', '+attack')
 
 
 -- shut up the warning